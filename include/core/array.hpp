@@ -15,54 +15,102 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "core/colormap.hpp"
+#include "core/storage.hpp"
+
 namespace dunescape
 {
 
 /**
- * @brief Array class, helper to manipulate 2D int array with "(i, j)"
+ * @brief 2D array shape {ni, nj}, stored inline.
+ *
+ */
+typedef std::array<int, 2> Shape;
+
+/**
+ * @brief Memory layout of a 2D array.
+ *
+ */
+enum Layout : int
+{
+  LAYOUT_ROW_MAJOR,    ///< 'j' contiguous, index i * shape[1] + j
+  LAYOUT_COLUMN_MAJOR, ///< 'i' (wind direction) contiguous, j * shape[0] + i
+};
+
+/**
+ * @brief Array class, helper to manipulate 2D array with "(i, j)"
  * indexing.
  *
+ * @tparam T Element type (explicitly instantiated for `uint8_t`,
+ * `uint16_t`, `int` and `float`).
  */
-class Array
+template <typename T> class Array
 {
 public:
   /**
    * @brief Array shape {ni, nj}.
    *
    */
-  std::vector<int> shape;
+  Shape shape;
+
+  /**
+   * @brief Memory layout.
+   *
+   */
+  Layout layout;
+
+  /**
+   * @brief Distance in memory between (i, j) and (i + 1, j).
+   *
+   */
+  size_t stride_i;
 
   /**
-   * @brief Vector for data storage, size shape[0] * shape[1].
+   * @brief Distance in memory between (i, j) and (i, j + 1).
    *
    */
-  std::vector<int> vector;
+  size_t stride_j;
+
+  /**
+   * @brief Vector for data storage, size shape[0] * shape[1], on the heap
+   * or memory-mapped (see `MappedAllocator`).
+   *
+   */
+  Storage<T> vector;
 
   /**
    * @brief Construct a new Array object.
    *
    * @param shape Array shape {ni, nj}.
+   * @param layout Memory layout.
+   * @param allocator Storage allocator, heap by default.
    */
-  Array(std::vector<int> shape);
+  Array(Shape                     shape,
+        Layout                    layout = LAYOUT_ROW_MAJOR,
+        const MappedAllocator<T> &allocator = MappedAllocator<T>());
 
   /**
    * @brief Call overloading, return array value at index (i, j).
    *
    * @param i 'i' index.
    * @param j 'j' index.
-   * @return int& Array value at index (i, j).
+   * @return T& Array value at index (i, j).
    */
-  inline int &operator()(int i, int j)
+  inline T &operator()(int i, int j)
   {
-    return this->vector[i * this->shape[1] + j];
+    return this->vector[(size_t)i * this->stride_i +
+                        (size_t)j * this->stride_j];
   }
 
-  inline const int &operator()(int i, int j) const ///< @overload
+  inline const T &operator()(int i, int j) const ///< @overload
   {
-    return this->vector[i * this->shape[1] + j];
+    return this->vector[(size_t)i * this->stride_i +
+                        (size_t)j * this->stride_j];
   }
 
   /**
@@ -70,12 +118,20 @@ public:
    *
    * @param new_shape New shape.
    */
-  void set_shape(std::vector<int> new_shape)
+  void set_shape(Shape new_shape)
   {
     this->shape = new_shape;
-    this->vector.resize(this->shape[0] * this->shape[1]);
+    this->set_strides();
+    this->vector.resize((size_t)this->shape[0] * this->shape[1]);
   }
 
+  /**
+   * @brief Set the memory layout, the values are moved accordingly.
+   *
+   * @param new_layout New layout.
+   */
+  void set_layout(Layout new_layout);
+
   /**
    * @brief Display a bunch of infos on the array.
    *
@@ -85,9 +141,9 @@ public:
   /**
    * @brief Return the value of the greastest element in the array.
    *
-   * @return int
+   * @return T
    */
-  inline int max() const
+  inline T max() const
   {
     return *std::max_element(this->vector.begin(), this->vector.end());
   }
@@ -95,15 +151,16 @@ public:
   /**
    * @brief Return the value of the smallest element in the array.
    *
-   * @return int
+   * @return T
    */
-  inline int min() const
+  inline T min() const
   {
     return *std::min_element(this->vector.begin(), this->vector.end());
   }
 
   /**
-   * @brief Fill the array with white noise.
+   * @brief Fill the array with white noise (the values drawn do not
+   * depend on the layout).
    *
    * @param a Lower bound of random distribution.
    * @param b Upper bound of random distribution.
@@ -111,6 +168,40 @@ public:
    */
   void randomize(int a, int b, uint seed);
 
+  /**
+   * @brief Convert array to a 8 bit image using a colormap lookup table.
+   * Nothing is allocated when the same image buffer and table are
+   * reused from one call to the other (with an unchanged shape).
+   *
+   * @param img Output image, (i, j) used as (x, y) coordinates, i.e.
+   * with (0, 0) at the bottom left. Resized to `shape[0] * shape[1] *
+   * channels` if needed.
+   * @param cmap Colormap.
+   * @param lut Colormap lookup table, updated if needed.
+   * @param vmax Value mapped to the last color, the array maximum is
+   * used if negative.
+   */
+  void to_img_8bit(std::vector<uint8_t> &img,
+                   Colormap              cmap,
+                   ColormapLut          &lut,
+                   float                 vmax = -1.f) const;
+
+  /**
+   * @brief Convert a range of rows of the 8 bit image (see
+   * `to_img_8bit`) with an up-to-date lookup table, e.g. to refresh
+   * only the part of an image that has changed.
+   *
+   * @param img Output buffer, the rows are written contiguously from
+   * its start (`(r1 - r0) * shape[0] * lut.channels` bytes).
+   * @param lut Colormap lookup table.
+   * @param r0 First image row, i.e. column `shape[1] - 1 - r0`.
+   * @param r1 Last image row (excluded).
+   */
+  void to_img_8bit_rows(uint8_t           *img,
+                        const ColormapLut &lut,
+                        int                r0,
+                        int                r1) const;
+
   /**
    * @brief Convert array to a 8 bit grayscale image.
    *
@@ -127,11 +218,21 @@ public:
   std::vector<uint8_t> to_img_8bit_nipy();
 
   /**
-   * @brief Export array as png image file.
+   * @brief Export array as a 8 bit grayscale png image file, the values
+   * being normalized to [0, 255] (see `export_heightmap` to keep the
+   * actual values).
    *
    * @param fname File name.
+   * @return bool Success.
    */
-  void to_png(std::string fname);
+  bool to_png(std::string fname) const;
+
+private:
+  void set_strides()
+  {
+    this->stride_i = this->layout == LAYOUT_ROW_MAJOR ? this->shape[1] : 1;
+    this->stride_j = this->layout == LAYOUT_ROW_MAJOR ? 1 : this->shape[0];
+  }
 };
 
 } // namespace dunescape
@@ -0,0 +1,168 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file boundary.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Boundary conditions and neighborhood stencils, resolved at
+ * compile-time by the simulation kernels.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <string>
+
+namespace dunescape
+{
+
+/**
+ * @brief Boundary conditions of the dune field (the wind blows along the
+ * 'i' direction).
+ *
+ */
+enum Boundary : int
+{
+  BOUNDARY_PERIODIC, ///< Periodic in both directions
+  BOUNDARY_OPEN,     ///< Sand blown in upwind and out downwind, periodic
+                     ///< across the wind
+  BOUNDARY_WALLS,    ///< Fixed walls on the four sides, sand is conserved
+};
+
+/**
+ * @brief Return true if the rows wrap around (along the wind).
+ *
+ * @param b Boundary conditions.
+ * @return bool
+ */
+constexpr bool periodic_rows(Boundary b) { return b == BOUNDARY_PERIODIC; }
+
+/**
+ * @brief Return true if the columns wrap around (across the wind).
+ *
+ * @param b Boundary conditions.
+ * @return bool
+ */
+constexpr bool periodic_columns(Boundary b) { return b != BOUNDARY_WALLS; }
+
+/**
+ * @brief Return the name of boundary conditions.
+ *
+ * @param b Boundary conditions.
+ * @return const char* Name, "periodic", "open" or "walls".
+ */
+const char *boundary_name(Boundary b);
+
+/**
+ * @brief Find boundary conditions by name.
+ *
+ * @param name Name (see `boundary_name`).
+ * @param b Boundary conditions found.
+ * @return bool False if the name is unknown.
+ */
+bool boundary_from_name(const std::string &name, Boundary &b);
+
+// --- Stencils, unit offsets only (see `visit_neighbors`)
+
+/**
+ * @brief Neighbors downwind and across the wind, where a slab deposited
+ * may avalanche to.
+ *
+ */
+struct MooreDown
+{
+  static constexpr int size = 5;
+  static constexpr int di[size] = {1, 0, 0, 1, 1};
+  static constexpr int dj[size] = {0, 1, -1, -1, 1};
+};
+
+/**
+ * @brief Neighbors upwind and across the wind, where a slab eroded may
+ * be taken from.
+ *
+ */
+struct MooreUp
+{
+  static constexpr int size = 5;
+  static constexpr int di[size] = {-1, 0, 0, -1, -1};
+  static constexpr int dj[size] = {0, 1, -1, -1, 1};
+};
+
+/**
+ * @brief The 8 neighbors.
+ *
+ */
+struct Moore
+{
+  static constexpr int size = 8;
+  static constexpr int di[size] = {-1, -1, -1, 0, 0, 1, 1, 1};
+  static constexpr int dj[size] = {-1, 0, 1, -1, 1, -1, 0, 1};
+};
+
+/**
+ * @brief Bring an index one step outside of [0, n[ back in, for a
+ * periodic axis.
+ *
+ * @tparam periodic Whether the axis wraps around.
+ * @param k Index, in [-1, n].
+ * @param n Axis size.
+ * @return bool False if the index is outside of a non-periodic axis.
+ */
+template <bool periodic> inline bool wrap_index(int &k, int n)
+{
+  if (k < 0)
+  {
+    k += n;
+    return periodic;
+  }
+  if (k >= n)
+  {
+    k -= n;
+    return periodic;
+  }
+  return true;
+}
+
+/**
+ * @brief Call `f(in, jn)` for the neighbors of the cell (i, j) in the
+ * stencil `S` (in its order), until `f` returns true. Neighbors beyond a
+ * non-periodic edge are skipped. Interior cells are visited without any
+ * wrapping, the whole loop being unrolled.
+ *
+ * @tparam B Boundary conditions.
+ * @tparam S Stencil.
+ * @tparam F Callable `bool(int, int)`.
+ * @param i Index.
+ * @param j Index.
+ * @param ni Number of rows.
+ * @param nj Number of columns.
+ * @param f Visitor.
+ */
+template <Boundary B, class S, class F>
+inline void visit_neighbors(int i, int j, int ni, int nj, F f)
+{
+  if ((i > 0) and (i < ni - 1) and (j > 0) and (j < nj - 1))
+  {
+    for (int k = 0; k < S::size; k++)
+      if (f(i + S::di[k], j + S::dj[k]))
+        return;
+  }
+  else
+  {
+    for (int k = 0; k < S::size; k++)
+    {
+      int in = i + S::di[k];
+      int jn = j + S::dj[k];
+
+      if (wrap_index<periodic_rows(B)>(in, ni) and
+          wrap_index<periodic_columns(B)>(jn, nj) and f(in, jn))
+        return;
+    }
+  }
+}
+
+} // namespace dunescape
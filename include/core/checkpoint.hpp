@@ -0,0 +1,213 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file checkpoint.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Binary checkpoint / restart of a dune field.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/dunefield.hpp"
+
+#define CHECKPOINT_MAGIC "DUNESCPE"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGNMENT 4096 // data sections are page-aligned
+
+namespace dunescape
+{
+
+/**
+ * @brief Checkpoint file header, followed by the sand height, shadow and
+ * active cell sections at the offsets given (native byte order).
+ *
+ * The random number generator is counter-based, its whole state is the
+ * seed and the cycle counter: resuming from a checkpoint is bit-exact.
+ */
+struct CheckpointHeader
+{
+  char     magic[8];          ///< CHECKPOINT_MAGIC, not null-terminated
+  uint32_t version;           ///< CHECKPOINT_VERSION
+  uint32_t header_size;       ///< sizeof(CheckpointHeader)
+  int32_t  shape[2];          ///< Shape {ni, nj}
+  int32_t  layout;            ///< Layout of the sand height section
+  uint32_t height_size;       ///< sizeof(Height)
+  float    shadow_slope;      ///< DuneField::shadow_slope
+  int32_t  hop_length;        ///< DuneField::hop_length
+  float    prob_deposit_bare; ///< DuneField::prob_deposit_bare
+  float    prob_deposit_sand; ///< DuneField::prob_deposit_sand
+  uint32_t seed;              ///< DuneField::seed
+  int32_t  boundary;          ///< DuneField::boundary
+  float    sand_inflow;       ///< DuneField::sand_inflow
+  uint32_t relax_avalanches;  ///< DuneField::relax_avalanches
+  uint32_t reserved;          ///< Zero (alignment)
+  uint32_t words_per_column;  ///< Mask::words_per_column
+  uint64_t cycle_count;       ///< DuneField::cycle_count
+  uint64_t h_offset;          ///< Sand height section offset
+  uint64_t shadow_offset;     ///< Shadow mask section offset
+  uint64_t active_offset;     ///< Active cell mask section offset
+  uint64_t file_size;         ///< Total file size
+};
+
+/**
+ * @brief CheckpointView class, read-only memory mapping of a checkpoint
+ * file: the data sections are accessed in place, without any copy.
+ *
+ */
+class CheckpointView
+{
+public:
+  /**
+   * @brief Construct a new CheckpointView object, the file is mapped
+   * and its header checked (see `is_valid`).
+   *
+   * @param fname File name.
+   */
+  CheckpointView(const std::string &fname);
+
+  CheckpointView(const CheckpointView &) = delete;
+  CheckpointView &operator=(const CheckpointView &) = delete;
+
+  /**
+   * @brief Destroy the CheckpointView object, the file is unmapped.
+   *
+   */
+  ~CheckpointView();
+
+  /**
+   * @brief Return wether the file is a valid checkpoint for this build.
+   *
+   * @return bool
+   */
+  bool is_valid() const { return this->valid; }
+
+  /**
+   * @brief Return the file header.
+   *
+   * @return const CheckpointHeader&
+   */
+  const CheckpointHeader &header() const
+  {
+    return *(const CheckpointHeader *)this->data;
+  }
+
+  /**
+   * @brief Return the sand height, `shape[0] * shape[1]` values stored
+   * with the layout given in the header.
+   *
+   * @return const Height*
+   */
+  const Height *h() const
+  {
+    return (const Height *)(this->data + this->header().h_offset);
+  }
+
+  /**
+   * @brief Return the shadow mask words (see Mask::words).
+   *
+   * @return const uint64_t*
+   */
+  const uint64_t *shadow() const
+  {
+    return (const uint64_t *)(this->data + this->header().shadow_offset);
+  }
+
+  /**
+   * @brief Return the active cell mask words (see Mask::words).
+   *
+   * @return const uint64_t*
+   */
+  const uint64_t *active() const
+  {
+    return (const uint64_t *)(this->data + this->header().active_offset);
+  }
+
+  /**
+   * @brief Restore a dune field from the checkpoint (shape, layout, state
+   * and parameters), the unstable cells being queued for relaxation when
+   * the avalanches are relaxed.
+   *
+   * @param df Dune field.
+   * @return bool Success.
+   */
+  bool restore(DuneField &df) const;
+
+private:
+  const char *data = nullptr;
+  size_t      size = 0;
+  bool        valid = false;
+};
+
+/**
+ * @brief Save a dune field checkpoint.
+ *
+ * @param df Dune field.
+ * @param fname File name, written atomically (through a temporary file
+ * renamed once complete).
+ * @return bool Success.
+ */
+bool save_checkpoint(const DuneField &df, const std::string &fname);
+
+/**
+ * @brief Load a dune field checkpoint.
+ *
+ * @param df Dune field.
+ * @param fname File name.
+ * @return bool Success.
+ */
+bool load_checkpoint(DuneField &df, const std::string &fname);
+
+/**
+ * @brief CheckpointWriter class, saves checkpoints on a background
+ * thread. The caller is only blocked for the time it takes to copy the
+ * state in memory (and by a previous write still in progress).
+ *
+ */
+class CheckpointWriter
+{
+public:
+  CheckpointWriter() = default;
+
+  CheckpointWriter(const CheckpointWriter &) = delete;
+  CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+  /**
+   * @brief Destroy the CheckpointWriter object, waiting for the last
+   * write to complete.
+   *
+   */
+  ~CheckpointWriter();
+
+  /**
+   * @brief Save a checkpoint asynchronously.
+   *
+   * @param df Dune field.
+   * @param fname File name.
+   */
+  void save(const DuneField &df, const std::string &fname);
+
+  /**
+   * @brief Wait for the write in progress, if any.
+   *
+   * @return bool Success of the last write.
+   */
+  bool wait();
+
+private:
+  std::vector<char> buffer;
+  std::thread       thread;
+  bool              success = true;
+};
+
+} // namespace dunescape
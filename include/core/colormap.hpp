@@ -0,0 +1,137 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file colormap.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#define COLORMAP_MAX_DIRECT 65536 // entries of a table indexed by value
+
+namespace dunescape
+{
+
+/**
+ * @brief Colormap type.
+ *
+ */
+enum Colormap : int
+{
+  CMAP_GRAYSCALE,     ///< 8 bit grayscale, 1 channel
+  CMAP_NIPY_SPECTRAL, ///< `nipy spectral`, 3 channels (RGB)
+};
+
+/**
+ * @brief ColormapLut class, lookup table of the 8 bit colors associated
+ * to the values [0, vmax] of an array, for a given colormap.
+ *
+ * For integer arrays the table is indexed by the value itself (exact
+ * colors, up to COLORMAP_MAX_DIRECT entries), for floating point arrays
+ * and larger integer ranges it has 256 entries spanning [0, vmax]. The
+ * table is only rebuilt when the colormap or `vmax` change, so that the
+ * same object can be reused frame after frame.
+ */
+class ColormapLut
+{
+public:
+  /**
+   * @brief Colormap.
+   *
+   */
+  Colormap cmap;
+
+  /**
+   * @brief Number of channels per color (1 or 3).
+   *
+   */
+  int channels;
+
+  /**
+   * @brief Value mapped to the last color of the colormap.
+   *
+   */
+  float vmax = -1.f;
+
+  /**
+   * @brief Wether the table is indexed by integer values or not.
+   *
+   */
+  bool integer_values = true;
+
+  /**
+   * @brief Wether the table is indexed by the values themselves (integer
+   * values, `vmax + 1` entries) or by the values scaled to its 256
+   * entries.
+   *
+   */
+  bool direct = true;
+
+  /**
+   * @brief Number of entries of the table.
+   *
+   */
+  int size = 0;
+
+  /**
+   * @brief Colors, size `size * channels`.
+   *
+   */
+  std::vector<uint8_t> table;
+
+  /**
+   * @brief Construct a new ColormapLut object.
+   *
+   * @param cmap Colormap.
+   */
+  ColormapLut(Colormap cmap = CMAP_GRAYSCALE);
+
+  /**
+   * @brief Update the table for a new colormap and/or a new range.
+   *
+   * @param new_cmap Colormap.
+   * @param new_vmax Value mapped to the last color.
+   * @param new_integer_values Wether the values are integers, the table
+   * being then indexed by value (`vmax + 1` entries) if that is no more
+   * than COLORMAP_MAX_DIRECT entries, by scaled values otherwise (256
+   * entries).
+   */
+  void update(Colormap new_cmap, float new_vmax, bool new_integer_values);
+
+  /**
+   * @brief Return the table index of a value.
+   *
+   * @param v Value.
+   * @return int Index.
+   */
+  inline int index(float v) const
+  {
+    float k = this->direct ? v : v * this->scale;
+    return std::max(0, std::min(this->size - 1, (int)k));
+  }
+
+  /**
+   * @brief Return the color of a value in [0, vmax], with the same
+   * rounding as the historical per-pixel conversion.
+   *
+   * @param v Value.
+   * @param rgb Output color (`channels` bytes).
+   */
+  void color(float v, uint8_t *rgb) const;
+
+private:
+  float scale = 0.f; // value to index factor, scaled tables
+};
+
+} // namespace dunescape
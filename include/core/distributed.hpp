@@ -0,0 +1,207 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file distributed.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Dune field distributed over several processes.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Exchange class, communication layer of a DistributedField. The
+ * processes (ranks) form a ring, rank `r + 1` being downwind of rank `r`
+ * (periodic boundary).
+ *
+ */
+class Exchange
+{
+public:
+  virtual ~Exchange() = default;
+
+  /**
+   * @brief Send a buffer to a neighbor and receive the buffer sent by the
+   * neighbor on the other side.
+   *
+   * @param direction +1 to send downwind (and receive from upwind), -1 to
+   * send upwind.
+   * @param send Buffer sent.
+   * @param recv Buffer received, resized.
+   */
+  virtual void shift(int                      direction,
+                     const std::vector<char> &send,
+                     std::vector<char>       &recv) = 0;
+
+  /**
+   * @brief Return the sum of a value over all the ranks.
+   *
+   * @param value Value of this rank.
+   * @return uint64_t Sum.
+   */
+  virtual uint64_t sum(uint64_t value) = 0;
+
+  /**
+   * @brief Return the maximum of a value over all the ranks.
+   *
+   * @param value Value of this rank.
+   * @return int Maximum.
+   */
+  virtual int max(int value) = 0;
+};
+
+/**
+ * @brief LocalExchange class, single process "ring" (everything sent is
+ * received back).
+ *
+ */
+class LocalExchange : public Exchange
+{
+public:
+  void shift(int, const std::vector<char> &send, std::vector<char> &recv)
+  {
+    recv = send;
+  }
+
+  uint64_t sum(uint64_t value) { return value; }
+
+  int max(int value) { return value; }
+};
+
+/**
+ * @brief Slab in flight between two ranks.
+ *
+ */
+struct HopMessage
+{
+  int32_t  i;     ///< Next row where the slab may deposit (global index)
+  int32_t  j;     ///< Column
+  uint64_t cell;  ///< Global index of the cell the slab was eroded from
+  uint64_t draws; ///< Random numbers drawn so far for this slab
+};
+
+/**
+ * @brief DistributedField class, band of rows [i0, i1[ of a periodic
+ * dune field split across the wind direction between several ranks.
+ *
+ * The band is stored in a local DuneField surrounded by `halo` rows on
+ * each side, copies of the rows of the neighboring ranks. A cycle erodes
+ * the active cells of the band, slabs hopping out of the band are sent
+ * downwind as messages (until they all have deposited somewhere), the
+ * avalanches onto the first halo rows are sent back to their owners,
+ * then the halos are refreshed and the shadow recomputed. The halos are
+ * deep enough for the shadow of the band to be exact (they grow with
+ * the maximum height, up to the smallest band size).
+ *
+ * Within a cycle, a rank sees the rows of its neighbors as they were at
+ * the beginning of the cycle, so that the result depends on the number
+ * of ranks (it is reproducible for a given number of ranks).
+ */
+class DistributedField
+{
+public:
+  /**
+   * @brief Global shape {ni, nj}.
+   *
+   */
+  Shape shape;
+
+  /**
+   * @brief Rank of this process and number of ranks.
+   *
+   */
+  int rank, n_ranks;
+
+  /**
+   * @brief Band of rows owned by this rank, [i0, i1[.
+   *
+   */
+  int i0, i1;
+
+  /**
+   * @brief Number of halo rows on each side of the band.
+   *
+   */
+  int halo = 1;
+
+  /**
+   * @brief Local dune field, the band and its halos. The model
+   * parameters (seed, hop length, probabilities) are set on it.
+   *
+   */
+  DuneField local = DuneField({0, 0});
+
+  /**
+   * @brief Construct a new DistributedField object.
+   *
+   * @param shape Global shape, with at least one row per rank.
+   * @param rank Rank of this process.
+   * @param n_ranks Number of ranks.
+   */
+  DistributedField(Shape shape, int rank, int n_ranks);
+
+  /**
+   * @brief Return the local row index of a global row index.
+   *
+   * @param i Global row index.
+   * @return int Local row index.
+   */
+  int local_row(int i) const { return i - this->i0 + this->halo; }
+
+  /**
+   * @brief Randomize the sand height of the band, the value of a cell
+   * only depends on the seed and on its position (not on the number of
+   * ranks).
+   *
+   * @param h0 Sand height upper bound.
+   */
+  void randomize(int h0);
+
+  /**
+   * @brief Perform one simulation cycle (collective).
+   *
+   * @param ex Exchange.
+   * @return uint64_t Number of slabs eroded in the band.
+   */
+  uint64_t cycle(Exchange &ex);
+
+  /**
+   * @brief Refresh the halos and update the shadow (collective), to be
+   * called after the heights have been modified outside of `cycle`.
+   *
+   * @param ex Exchange.
+   */
+  void synchronize(Exchange &ex);
+
+  /**
+   * @brief Return the sand height of the band.
+   *
+   * @return Array<Height> Heights, shape {i1 - i0, nj}.
+   */
+  Array<Height> band_heights() const;
+
+private:
+  bool halo_clamped = false;
+
+  uint64_t cycle_strip(int j0, int j1, std::vector<HopMessage> &outbox);
+
+  void hop(HopMessage m, std::vector<HopMessage> &outbox);
+
+  void set_halo(int new_halo);
+};
+
+} // namespace dunescape
@@ -14,22 +14,41 @@
  */
 #pragma once
 
-#include <random>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <omp.h>
 
 #include "core/array.hpp"
+#include "core/boundary.hpp"
+#include "core/histogram.hpp"
+#include "core/mask.hpp"
+#include "core/rng.hpp"
+#include "core/stats.hpp"
+
+// sand height storage type, unsigned 16 bit integers by default (can be
+// set to uint8_t to further reduce the memory footprint if the dunes
+// remain below 256 slabs)
+#ifndef DUNESCAPE_HEIGHT_TYPE
+#define DUNESCAPE_HEIGHT_TYPE uint16_t
+#endif
 
 #define SHADOW_SLOPE 0.8038475772933681f // == 3 * tan(15 / 180 * pi)
-// clang-format off
-#define DI_MOORE_DOWN { 1,  0,  0,  1,  1}
-#define DJ_MOORE_DOWN { 0,  1, -1, -1,  1}
-#define DI_MOORE_UP   {-1,  0,  0, -1, -1}
-#define DJ_MOORE_UP   { 0,  1, -1, -1,  1}
-// clang-format on
+#define CYCLE_STRIP_WIDTH 16 // minimum width of the parallel column strips
+#define CYCLE_SPARSE_RATIO 64 // sparser strips visit their active cells only
+#define SHADOW_BLOCK_WIDTH 64 // minimum column block width, shadow sweep
+#define SHADOW_TILE_WIDTH 64 // column tile width, column-major shadow sweep
+#define REPOSE_THRESHOLD 2 // max. stable height difference between neighbors
 
 namespace dunescape
 {
 
-class Array;
+/**
+ * @brief Sand height type (number of sand slabs).
+ *
+ */
+typedef DUNESCAPE_HEIGHT_TYPE Height;
 
 /**
  * @brief DuneField class.
@@ -42,7 +61,7 @@ public:
    * @brief Dune field underlying array shape {ni, nj}.
    *
    */
-  std::vector<int> shape;
+  Shape shape;
 
   /**
    * @brief Shadow slope.
@@ -68,18 +87,50 @@ public:
    */
   float prob_deposit_sand = 0.6f;
 
+  /**
+   * @brief Relax the avalanches at the end of each cycle, until the
+   * angle of repose is respected around every cell modified (see
+   * `relax`). Otherwise a slab only avalanches once, by one cell.
+   *
+   */
+  bool relax_avalanches = false;
+
+  /**
+   * @brief Boundary conditions. With open boundaries, slabs hopping past
+   * the last row leave the field and `sand_inflow` slabs per column are
+   * blown in upwind of the first row at each cycle. With walls, slabs
+   * reaching the last row are stopped there.
+   *
+   */
+  Boundary boundary = BOUNDARY_PERIODIC;
+
+  /**
+   * @brief Mean number of slabs blown into each column per cycle, open
+   * boundaries only.
+   *
+   */
+  float sand_inflow = 0.f;
+
   /**
    * @brief Number of sand slabs.
    *
    */
-  Array h = Array({0, 0});
+  Array<Height> h = Array<Height>({0, 0});
 
   /**
    * @brief Define wether a cell is in the shadow (1) or not (0) of
    * other cells.
    *
    */
-  Array shadow = Array({0, 0});
+  Mask shadow = Mask({0, 0});
+
+  /**
+   * @brief Define wether a cell can be eroded (1), i.e. is sandy and not
+   * in the shadow, or not (0). Kept up to date by `depose_at` and
+   * `update_shadow`.
+   *
+   */
+  Mask active = Mask({0, 0});
 
   /**
    * @brief Random seed number.
@@ -87,60 +138,264 @@ public:
    */
   uint seed = 1;
 
+  /**
+   * @brief Number of cycles performed so far, used with the seed to key
+   * the random number generator.
+   *
+   */
+  uint64_t cycle_count = 0;
+
+  /**
+   * @brief Flag (1) of the columns where the sand height has changed
+   * since the last call to `clear_modified_columns`, size shape[1].
+   *
+   */
+  std::vector<uint8_t> modified_columns;
+
+  /**
+   * @brief Histogram of the sand height (mass, extrema, roughness...),
+   * rebuilt by `update_shadow()` and maintained by the slab moves, up to
+   * date after each cycle.
+   *
+   */
+  HeightHistogram heights;
+
+  /**
+   * @brief Instrumentation counters and phase timings, only filled in
+   * when built with DUNESCAPE_STATS (see `Stats::collect`).
+   *
+   */
+  Stats stats;
+
+  /**
+   * @brief Per OpenMP thread, when set, the indices (in `active.words`) of
+   * the words of the active mask modified by the local shadow updates of
+   * the thread are appended to this vector, possibly more than once (see
+   * `KineticMonteCarlo` and the sparse strips of `cycle`).
+   *
+   */
+  std::vector<std::vector<size_t> *> active_changes;
+
   /**
    * @brief Construct a new Array object.
    *
    * @param shape Array shape {ni, nj}.
+   * @param layout Memory layout of the sand height. Column-major keeps
+   * the cells along the wind direction contiguous, which is what the
+   * hops of the slabs and the shadow searches walk through.
+   * @param storage Directory of the files the sand height and the masks
+   * are memory-mapped from, for fields larger than the RAM (see
+   * `MappedAllocator`), empty to keep them on the heap. The column strips
+   * are then paged in ahead of the cycle and hinted cold once updated.
    */
-  DuneField(std::vector<int> shape);
+  DuneField(Shape              shape,
+            Layout             layout = LAYOUT_COLUMN_MAJOR,
+            const std::string &storage = "");
 
   /**
-   * @brief Set the dunefield shape.
+   * @brief Set the dunefield shape, the shadow, the active cells and the
+   * height histogram being then rebuilt from the resized sand height (and
+   * the unstable cells queued if the avalanches are relaxed).
    *
    * @param new_shape New shape.
    */
-  void set_shape(std::vector<int> new_shape)
+  void set_shape(Shape new_shape)
   {
     this->shape = new_shape;
     this->h.set_shape(new_shape);
     this->shadow.set_shape(new_shape);
+    this->active.set_shape(new_shape);
+    this->modified_columns.assign(new_shape[1], 1);
+    this->relax_queued.set_shape(new_shape);
+    this->relax_pending.assign(this->relax_pending.size(), {});
+
+    this->update_shadow();
+    if (this->relax_avalanches)
+      this->queue_relaxation();
   }
 
+  /**
+   * @brief Return the range of the columns modified since the last call
+   * to `clear_modified_columns`.
+   *
+   * @param j0 First modified column.
+   * @param j1 Last modified column (included).
+   * @return bool False if no column has been modified.
+   */
+  bool modified_column_range(int &j0, int &j1) const;
+
+  /**
+   * @brief Reset the modified column flags.
+   *
+   */
+  void clear_modified_columns();
+
   /**
    * @brief Perform one simulation cycle.
    *
+   * The field is split into column strips (the wind blows along the 'i'
+   * direction, so a slab never leaves its column except by avalanching
+   * to a neighbor column). Even and odd strips are updated in two
+   * successive parallel phases, strips of a same phase being far enough
+   * apart to never touch the same cells. Combined with a counter-based
+   * random number generator, the result only depends on the seed and
+   * the cycle index, not on the number of threads.
+   *
+   * @return uint64_t Number of sand slabs moved during the cycle.
    */
-  void cycle();
+  uint64_t cycle();
 
   /**
-   * @brief Depose/erode one sand slab at location `(i, j){.}
+   * @brief Depose/erode one sand slab at location `(i, j)`. The slab
+   * avalanches to the first neighbor (downwind ones for a deposit,
+   * upwind ones for an erosion) with a height difference above
+   * REPOSE_THRESHOLD.
    *
    * @param i Index.
    * @param j Index.
    * @param amount +- 1
-   * @param di Avalanching coefficients for neighbor search.
-   * @param dj Avalanching coefficients for neighbor search.
    */
-  void depose_at(int               i,
-                 int               j,
-                 int               amount,
-                 std::vector<int> &di,
-                 std::vector<int> &dj);
+  void depose_at(int i, int j, int amount);
+
+  /**
+   * @brief Erode one slab at location `(i, j)` and move it downwind until
+   * it deposits (or leaves the field), i.e. one erosion event of `cycle`.
+   *
+   * @param i Index, -1 for a slab blown in upwind of the first row (open
+   * boundaries, nothing is eroded).
+   * @param j Index.
+   * @param rng Random number generator of the slab.
+   */
+  void move_slab(int i, int j, CounterRng &rng);
 
   /**
-   * @brief Update shadow field.
+   * @brief Update shadow field, O(N) with one upwind sweep per column,
+   * and the active cells accordingly. The height histogram is rebuilt
+   * along the way, this is to be called after the sand height has been
+   * modified outside of the simulation kernels.
    *
    */
   void update_shadow();
 
   void update_shadow(int i, int j); ///< @overload
 
+  /**
+   * @brief Queue a cell whose stability is to be checked by the next
+   * call to `relax`. Can be called from the parallel regions of `cycle`
+   * (cells are queued per thread).
+   *
+   * @param i Index.
+   * @param j Index.
+   */
+  void queue_relaxation(int i, int j)
+  {
+    this->relax_pending[omp_get_thread_num()].push_back(
+        (uint64_t)i * this->shape[1] + j);
+  }
+
+  /**
+   * @brief Queue all the unstable cells of the field (e.g. after the
+   * sand height has been set), found with a single parallel scan.
+   *
+   */
+  void queue_relaxation();
+
+  /**
+   * @brief Relax the avalanches from the queued cells until every cell
+   * is stable, i.e. at most REPOSE_THRESHOLD slabs above each of its 8
+   * neighbors.
+   *
+   * Unstable cells lose one slab to their lowest neighbor at a time,
+   * and the cells whose stability may have changed are queued in turn:
+   * the work is proportional to the size of the avalanches, the field is
+   * never scanned. The worklist is split into the column strips of
+   * `cycle`, even and odd strips being relaxed in successive parallel
+   * phases, and cells queued outside of a strip are handed over to
+   * their strip between two phases. The shadow is updated locally
+   * around each cell modified, and the result does not depend on the
+   * number of threads.
+   *
+   * @return uint64_t Number of sand slabs moved.
+   */
+  uint64_t relax();
+
 private:
-  std::mt19937     gen;
-  std::vector<int> di_down = DI_MOORE_DOWN;
-  std::vector<int> dj_down = DJ_MOORE_DOWN;
-  std::vector<int> di_up = DI_MOORE_UP;
-  std::vector<int> dj_up = DJ_MOORE_UP;
+  // avalanche relaxation worklist, cells (i * nj + j) queued by each
+  // thread and flags of the cells already queued
+  std::vector<std::vector<uint64_t>> relax_pending =
+      std::vector<std::vector<uint64_t>>(1);
+  Mask relax_queued = Mask({0, 0});
+
+  /**
+   * @brief Perform one simulation cycle restricted to the column strip
+   * [j0, j1[. The cells are visited in a random order and only the
+   * active ones (see `active`) are eroded, sparse strips visiting their
+   * active cells only (see `cycle_active_cells`).
+   *
+   * @param j0 First column index.
+   * @param j1 Last column index (excluded).
+   * @return uint64_t Number of sand slabs moved.
+   */
+  template <Boundary B> uint64_t cycle_strip(int j0, int j1);
+
+  /**
+   * @brief Visit the active cells of the column strip [j0, j1[ only, in
+   * the order of the permutation t -> (a * t + b) % n of `cycle_strip`
+   * (with n < 2^32): the cells active at the start are ranked and put in
+   * a heap, and the cells activated along the way (see `active_changes`)
+   * are added to it if they are ranked after the current one.
+   *
+   * @param j0 First column index.
+   * @param j1 Last column index (excluded).
+   * @param a Permutation factor, coprime with n.
+   * @param b Permutation offset.
+   * @return uint64_t Number of sand slabs moved.
+   */
+  template <Boundary B>
+  uint64_t cycle_active_cells(int j0, int j1, uint64_t a, uint64_t b);
+
+  /**
+   * @brief Give a paging hint for the columns [j0, j1[ of the sand height
+   * and of the masks, memory-mapped storage only (column-major sand
+   * height, the masks are always stored by column).
+   *
+   * @param j0 First column index.
+   * @param j1 Last column index (excluded).
+   * @param advice Hint.
+   */
+  void advise_columns(int j0, int j1, StorageAdvice advice);
+
+  /**
+   * @brief Move a slab downwind from row `i` by `hop_length` jumps until
+   * it deposits (or leaves the field).
+   *
+   * @param i Starting row index, -1 for a slab blown in.
+   * @param j Column index.
+   * @param rng Random number generator of the slab.
+   */
+  template <Boundary B> void hop(int i, int j, CounterRng &rng);
+
+  template <Boundary B, class S> void depose_at(int i, int j, int amount);
+
+  template <Boundary B> void update_shadow(int i, int j);
+
+  template <Boundary B> void queue_unstable_cells();
+
+  /**
+   * @brief Relax the queued cells of the column strip [j0, j1[, cells
+   * outside of the strip are queued to 'outbox' instead.
+   *
+   * @param j0 First column index.
+   * @param j1 Last column index (excluded).
+   * @param queue Cells to relax, emptied.
+   * @param outbox Cells queued outside of the strip.
+   * @return uint64_t Number of sand slabs moved.
+   */
+  template <Boundary B>
+  uint64_t relax_strip(int                    j0,
+                       int                    j1,
+                       std::vector<uint64_t> &queue,
+                       std::vector<uint64_t> &outbox);
 };
 
 } // namespace dunescape
@@ -0,0 +1,141 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file ensemble.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Concurrent runs of dune field ensembles (parameter sweeps).
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "core/dunefield.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Ensemble member, i.e. the settings of one simulation run.
+ *
+ */
+struct EnsembleMember
+{
+  int   id = 0;                    ///< Index of the run in the ensemble
+  Shape shape = {512, 128};        ///< Dune field shape
+  int   h0 = 4;                    ///< Initial sand height upper bound
+  int   cycles = 1000;             ///< Number of simulation cycles
+  uint  seed = 1;                  ///< DuneField::seed
+  int   hop_length = 1;            ///< DuneField::hop_length
+  float prob_deposit_bare = 0.4f;  ///< DuneField::prob_deposit_bare
+  float prob_deposit_sand = 0.6f;  ///< DuneField::prob_deposit_sand
+};
+
+/**
+ * @brief Summary metrics of a run, measured on the final state.
+ *
+ */
+struct EnsembleResult
+{
+  EnsembleMember member;                ///< Run settings
+  float          mean_height = 0.f;     ///< Mean sand height
+  float          rms_height = 0.f;      ///< Standard deviation of the height
+  int            max_height = 0;        ///< Maximum sand height
+  float          bare_fraction = 0.f;   ///< Fraction of cells without sand
+  float          shadow_fraction = 0.f; ///< Fraction of shadowed cells
+  uint64_t       n_moves = 0;           ///< Slabs moved by the last cycle
+  double         seconds = 0.;          ///< Wall time of the run
+};
+
+/**
+ * @brief Parameter sweep, the ensemble is the cartesian product of the
+ * parameter lists.
+ *
+ */
+struct EnsembleSweep
+{
+  Shape              shape = {512, 128};
+  int                h0 = 4;
+  int                cycles = 1000;
+  std::vector<float> prob_deposit_bare = {0.4f};
+  std::vector<float> prob_deposit_sand = {0.6f};
+  std::vector<int>   hop_lengths = {1};
+  std::vector<uint>  seeds = {1};
+
+  /**
+   * @brief Return the ensemble members, numbered from 0 with the seed
+   * varying fastest.
+   *
+   * @return std::vector<EnsembleMember> Members.
+   */
+  std::vector<EnsembleMember> members() const;
+};
+
+/**
+ * @brief Callback invoked when a run is complete, from the worker thread
+ * that ran it (it must be thread-safe).
+ *
+ */
+typedef std::function<void(const DuneField &, const EnsembleResult &)>
+    EnsembleCallback;
+
+/**
+ * @brief EnsembleRunner class, runs the members of an ensemble
+ * concurrently.
+ *
+ * Each worker thread runs one member at a time with its own OpenMP team.
+ * The members are dealt to the workers, longest first, and an idle
+ * worker steals work from the back of the other workers' queues. When
+ * the number of OpenMP threads per member is not imposed, it is updated
+ * every cycle to share the threads between the members being run: many
+ * small fields run side by side on a single thread each, and the last
+ * members (or a sweep smaller than the machine) get the threads of the
+ * workers that ran out of work. The simulation is deterministic whatever
+ * the number of threads.
+ *
+ */
+class EnsembleRunner
+{
+public:
+  /**
+   * @brief Total number of threads, 0 for `omp_get_max_threads()`.
+   *
+   */
+  int n_threads = 0;
+
+  /**
+   * @brief Number of OpenMP threads per member, 0 to balance them
+   * automatically.
+   *
+   */
+  int threads_per_member = 0;
+
+  /**
+   * @brief Run the ensemble.
+   *
+   * @param members Ensemble members.
+   * @param on_done Callback invoked after each run (optional).
+   * @return std::vector<EnsembleResult> Results, in the order of the
+   * members.
+   */
+  std::vector<EnsembleResult> run(const std::vector<EnsembleMember> &members,
+                                  EnsembleCallback on_done = nullptr);
+};
+
+/**
+ * @brief Compute the summary metrics of a dune field.
+ *
+ * @param df Dune field.
+ * @param result Result, the metrics are updated.
+ */
+void measure(const DuneField &df, EnsembleResult &result);
+
+} // namespace dunescape
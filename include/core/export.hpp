@@ -0,0 +1,136 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file export.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Heightmap export (8 / 16 bit grayscale PNG, raw float32).
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+
+#define PNG_DEFLATE_CHUNK 262144 // bytes compressed independently
+#define PNG_IDAT_SIZE 1048576    // maximum size of an IDAT chunk
+
+namespace dunescape
+{
+
+/**
+ * @brief Heightmap export format.
+ *
+ */
+enum ExportFormat : int
+{
+  EXPORT_PNG_8BIT,    ///< Grayscale PNG, heights normalized to [0, 255]
+  EXPORT_PNG_16BIT,   ///< Grayscale PNG, true slab counts
+  EXPORT_RAW_FLOAT32, ///< Headerless native float32, true slab counts
+};
+
+/**
+ * @brief Return the file extension of an export format.
+ *
+ * @param format Export format.
+ * @return const char* Extension, with the leading dot.
+ */
+const char *export_extension(ExportFormat format);
+
+/**
+ * @brief Write a grayscale PNG image. The rows are filtered and the
+ * image data compressed in parallel: the data is split into chunks of
+ * PNG_DEFLATE_CHUNK bytes deflated independently, then stitched in a
+ * single zlib stream.
+ *
+ * @param fname File name.
+ * @param width Image width.
+ * @param height Image height.
+ * @param bit_depth Bit depth, 8 or 16.
+ * @param pixels Pixels, `uint8_t` or (native) `uint16_t` values
+ * depending on the bit depth, rows stored from top to bottom.
+ * @return bool Success.
+ */
+bool write_png_gray(const std::string &fname,
+                    int                width,
+                    int                height,
+                    int                bit_depth,
+                    const void        *pixels);
+
+/**
+ * @brief Export a heightmap, with (i, j) used as (x, y) coordinates,
+ * i.e. with (0, 0) at the bottom left for all the formats. Raw files
+ * store `shape[1]` rows of `shape[0]` values, from top to bottom.
+ *
+ * @param h Sand height.
+ * @param fname File name.
+ * @param format Export format.
+ * @return bool Success.
+ */
+bool export_heightmap(const Array<Height> &h,
+                      const std::string   &fname,
+                      ExportFormat         format);
+
+/**
+ * @brief ExportWriter class, exports heightmaps on a background thread.
+ * The caller is only blocked for the time it takes to copy the heights
+ * (and by a previous export still in progress).
+ *
+ */
+class ExportWriter
+{
+public:
+  ExportWriter() = default;
+
+  ExportWriter(const ExportWriter &) = delete;
+  ExportWriter &operator=(const ExportWriter &) = delete;
+
+  /**
+   * @brief Destroy the ExportWriter object, waiting for the last export
+   * to complete.
+   *
+   */
+  ~ExportWriter();
+
+  /**
+   * @brief Export a heightmap asynchronously.
+   *
+   * @param h Sand height.
+   * @param fname File name.
+   * @param format Export format.
+   */
+  void save(const Array<Height> &h,
+            const std::string   &fname,
+            ExportFormat         format);
+
+  /**
+   * @brief Return wether an export is in progress.
+   *
+   * @return bool
+   */
+  bool busy() const { return this->running; }
+
+  /**
+   * @brief Wait for the export in progress, if any.
+   *
+   * @return bool Success of the last export.
+   */
+  bool wait();
+
+private:
+  Array<Height>     h = Array<Height>({0, 0});
+  std::thread       thread;
+  std::atomic<bool> running = {false};
+  bool              success = true;
+};
+
+} // namespace dunescape
@@ -0,0 +1,246 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file frames.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Time series of sand heights stored in a single container file.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+
+#define FRAMES_MAGIC "DUNEFRMS"
+#define FRAMES_VERSION 1
+#define FRAMES_KEYFRAME_INTERVAL 64 // default frame count between keyframes
+#define FRAMES_QUEUE_SIZE 4 // maximum number of frames waiting to be encoded
+
+namespace dunescape
+{
+
+/**
+ * @brief Frame container header.
+ *
+ * The header is followed by the encoded frames, then by the frame index
+ * (one FrameIndexEntry per frame) and a FramesFooter at the very end of
+ * the file. A frame stores the difference with the previous frame
+ * (with the zero array for keyframes) as a sequence of (number of
+ * unchanged cells, zigzag-encoded difference) pairs of LEB128 varints,
+ * the cells being taken in the memory order of the array.
+ */
+struct FramesHeader
+{
+  char     magic[8];           ///< FRAMES_MAGIC, not null-terminated
+  uint32_t version;            ///< FRAMES_VERSION
+  uint32_t header_size;        ///< sizeof(FramesHeader)
+  int32_t  shape[2];           ///< Shape {ni, nj}
+  int32_t  layout;             ///< Layout of the frames
+  uint32_t height_size;        ///< sizeof(Height)
+  uint32_t keyframe_interval;  ///< Number of frames between keyframes
+  uint32_t padding;            ///< Unused
+};
+
+/**
+ * @brief Frame index entry.
+ *
+ */
+struct FrameIndexEntry
+{
+  uint64_t cycle;    ///< Simulation cycle of the frame
+  uint64_t offset;   ///< Offset of the encoded frame in the file
+  uint64_t size;     ///< Size of the encoded frame
+  uint32_t keyframe; ///< 1 for keyframes, 0 for delta frames
+  uint32_t padding;  ///< Unused
+};
+
+/**
+ * @brief Frame container footer.
+ *
+ */
+struct FramesFooter
+{
+  uint64_t index_offset; ///< Offset of the frame index
+  uint64_t frame_count;  ///< Number of frames
+  char     magic[8];     ///< FRAMES_MAGIC, not null-terminated
+};
+
+/**
+ * @brief FrameWriter class, appends sand height frames to a container
+ * file. Frames are encoded and written on a background thread, `append`
+ * only copies the heights (and waits if too many frames are pending).
+ *
+ */
+class FrameWriter
+{
+public:
+  /**
+   * @brief Construct a new FrameWriter object, the file is created.
+   *
+   * @param fname File name.
+   * @param shape Frame shape.
+   * @param layout Frame memory layout.
+   * @param keyframe_interval Number of frames between keyframes.
+   */
+  FrameWriter(const std::string &fname,
+              Shape              shape,
+              Layout             layout = LAYOUT_COLUMN_MAJOR,
+              int                keyframe_interval = FRAMES_KEYFRAME_INTERVAL);
+
+  FrameWriter(const FrameWriter &) = delete;
+  FrameWriter &operator=(const FrameWriter &) = delete;
+
+  /**
+   * @brief Destroy the FrameWriter object, the file is closed.
+   *
+   */
+  ~FrameWriter();
+
+  /**
+   * @brief Return wether the file has been successfully opened.
+   *
+   * @return bool
+   */
+  bool is_open() const { return this->file != nullptr; }
+
+  /**
+   * @brief Append a frame.
+   *
+   * @param h Sand height, with the shape and layout of the writer.
+   * @param cycle Simulation cycle.
+   * @return bool False if the frame cannot be appended.
+   */
+  bool append(const Array<Height> &h, uint64_t cycle);
+
+  /**
+   * @brief Write the pending frames and the index, then close the file.
+   *
+   * @return bool Success.
+   */
+  bool close();
+
+private:
+  struct Pending
+  {
+    std::vector<Height> h;
+    uint64_t            cycle;
+  };
+
+  FILE  *file = nullptr;
+  Shape  shape;
+  Layout layout;
+  int    keyframe_interval;
+  bool   success = true;
+
+  std::thread                      worker;
+  std::mutex                       mutex;
+  std::condition_variable          changed;
+  std::deque<Pending>              queue;
+  std::vector<std::vector<Height>> free_buffers;
+  bool                             closing = false;
+
+  // worker thread state
+  std::vector<Height>          previous;
+  std::vector<uint8_t>         encoded;
+  std::vector<FrameIndexEntry> index;
+  uint64_t                     offset = 0;
+
+  void run();
+
+  void write_frame(const Pending &frame);
+};
+
+/**
+ * @brief FrameReader class, random access to the frames of a container
+ * file.
+ *
+ */
+class FrameReader
+{
+public:
+  /**
+   * @brief Frame shape.
+   *
+   */
+  Shape shape = {0, 0};
+
+  /**
+   * @brief Frame memory layout.
+   *
+   */
+  Layout layout = LAYOUT_ROW_MAJOR;
+
+  /**
+   * @brief Frame index.
+   *
+   */
+  std::vector<FrameIndexEntry> index;
+
+  /**
+   * @brief Construct a new FrameReader object, the header and the index
+   * are read.
+   *
+   * @param fname File name.
+   */
+  FrameReader(const std::string &fname);
+
+  FrameReader(const FrameReader &) = delete;
+  FrameReader &operator=(const FrameReader &) = delete;
+
+  /**
+   * @brief Destroy the FrameReader object.
+   *
+   */
+  ~FrameReader();
+
+  /**
+   * @brief Return wether the file is a valid frame container.
+   *
+   * @return bool
+   */
+  bool is_open() const { return this->file != nullptr; }
+
+  /**
+   * @brief Read a frame, decoding from the closest keyframe before it
+   * (or from the last frame read if it is closer).
+   *
+   * @param k Frame index.
+   * @param h Output sand height.
+   * @return bool Success.
+   */
+  bool read_frame(size_t k, Array<Height> &h);
+
+  /**
+   * @brief Read the last frame at or before a given cycle.
+   *
+   * @param cycle Simulation cycle.
+   * @param h Output sand height.
+   * @return bool Success (false if there is no frame before `cycle`).
+   */
+  bool read_cycle(uint64_t cycle, Array<Height> &h);
+
+private:
+  FILE                *file = nullptr;
+  std::vector<Height>  state;
+  long                 state_frame = -1; // frame currently decoded in 'state'
+  std::vector<uint8_t> encoded;
+
+  bool apply_frame(size_t k);
+};
+
+} // namespace dunescape
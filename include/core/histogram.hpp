@@ -0,0 +1,229 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file histogram.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Incremental statistics of the sand height and steady state
+ * detection.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+#include "core/array.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Summary of a sand height distribution.
+ *
+ */
+struct HeightSummary
+{
+  uint64_t n_cells = 0;          ///< Number of cells
+  uint64_t mass = 0;             ///< Total number of slabs
+  int      min = 0;              ///< Minimum height
+  int      max = 0;              ///< Maximum height
+  double   mean = 0.;            ///< Mean height
+  double   rms = 0.;             ///< Standard deviation (roughness)
+  float    sandy_fraction = 0.f; ///< Fraction of cells with sand
+};
+
+/**
+ * @brief HeightHistogram class, number of cells per sand height.
+ *
+ * The histogram is rebuilt from the whole field by `reset` and then
+ * maintained incrementally, at O(1) per slab move (see `move`): the
+ * moves are accumulated in per-thread deltas and folded into the
+ * histogram by `merge`, at the end of a parallel region.
+ *
+ */
+class HeightHistogram
+{
+public:
+  /**
+   * @brief Rebuild the histogram from a sand height.
+   *
+   * @param h Sand height.
+   */
+  template <typename T> void reset(const Array<T> &h);
+
+  /**
+   * @brief Set the histogram.
+   *
+   * @param new_counts Number of cells per height.
+   */
+  void set_counts(std::vector<uint64_t> new_counts);
+
+  /**
+   * @brief Make room for the deltas of all the OpenMP threads, to be
+   * called before entering a parallel region.
+   *
+   */
+  void reserve()
+  {
+    if ((int)this->deltas.size() < omp_get_max_threads())
+      this->deltas.resize(omp_get_max_threads());
+  }
+
+  /**
+   * @brief Record the move of a cell of height `v` to `v + amount`, from
+   * the calling thread.
+   *
+   * @param v Height before the move.
+   * @param amount +- 1
+   */
+  void move(int v, int amount)
+  {
+    Delta &d = this->deltas[omp_get_thread_num()];
+
+    if (v + 1 >= (int)d.counts.size())
+      d.counts.resize(v + 2, 0);
+    d.counts[v]--;
+    d.counts[v + amount]++;
+    d.mass += amount;
+    d.sum2 += 2 * v * amount + 1;
+  }
+
+  /**
+   * @brief Fold the deltas of the threads into the histogram (serial
+   * code only).
+   *
+   */
+  void merge();
+
+  /**
+   * @brief Return the number of cells per height, up to date after
+   * `merge`.
+   *
+   * @return const std::vector<uint64_t>&
+   */
+  const std::vector<uint64_t> &counts() const { return this->histogram; }
+
+  /**
+   * @brief Return the summary of the distribution, O(1), up to date
+   * after `merge`.
+   *
+   * @return HeightSummary
+   */
+  HeightSummary summary() const;
+
+private:
+  struct Delta
+  {
+    std::vector<int64_t> counts;
+    int64_t              mass = 0;
+    int64_t              sum2 = 0;
+    uint8_t              padding[64];
+  };
+
+  std::vector<uint64_t> histogram;
+  std::vector<Delta>    deltas = std::vector<Delta>(1);
+  uint64_t              n_cells = 0;
+  uint64_t              mass = 0;
+  uint64_t              sum2 = 0; // sum of the squared heights
+  int                   vmin = 0;
+  int                   vmax = 0;
+};
+
+template <typename T> void HeightHistogram::reset(const Array<T> &h)
+{
+  std::vector<uint64_t> total;
+
+#pragma omp parallel
+  {
+    std::vector<uint64_t> local;
+
+#pragma omp for schedule(static) nowait
+    for (size_t k = 0; k < h.vector.size(); k++)
+    {
+      const size_t v = (size_t)h.vector[k];
+
+      if (v >= local.size())
+        local.resize(v + 1, 0);
+      local[v]++;
+    }
+
+#pragma omp critical
+    {
+      if (local.size() > total.size())
+        total.resize(local.size(), 0);
+      for (size_t v = 0; v < local.size(); v++)
+        total[v] += local[v];
+    }
+  }
+
+  this->set_counts(std::move(total));
+}
+
+/**
+ * @brief ConvergenceDetector class, detects the steady state of a run
+ * from the slab flux (slabs moved per cycle), the roughness (standard
+ * deviation of the height) and the mean height.
+ *
+ * The means of each quantity over the last `window` cycles and over the
+ * `window` cycles before are compared, O(1) per cycle: the run has
+ * converged when they all differ by less than `tolerance` (relative).
+ *
+ */
+class ConvergenceDetector
+{
+public:
+  /**
+   * @brief Construct a new ConvergenceDetector object.
+   *
+   * @param window Number of cycles of each window.
+   * @param tolerance Relative tolerance.
+   */
+  ConvergenceDetector(int window = 500, float tolerance = 0.01f);
+
+  /**
+   * @brief Add the measures of a cycle.
+   *
+   * @param flux Slabs moved.
+   * @param s Height summary.
+   * @return bool True if the run has converged.
+   */
+  bool update(uint64_t flux, const HeightSummary &s);
+
+  /**
+   * @brief Return true if the run has converged at the last update.
+   *
+   * @return bool
+   */
+  bool converged() const { return this->is_converged; }
+
+  /**
+   * @brief Return the largest relative difference between the two
+   * windows at the last update (infinite until both are full).
+   *
+   * @return double
+   */
+  double residual() const { return this->last_residual; }
+
+private:
+  static const int n_measures = 3;
+
+  int                 window;
+  float               tolerance;
+  std::vector<double> samples; // ring buffer of 2 * window cycles
+  uint64_t            n_samples = 0;
+  double              sum_recent[n_measures] = {};
+  double              sum_previous[n_measures] = {};
+  double              last_residual;
+  bool                is_converged = false;
+};
+
+} // namespace dunescape
@@ -0,0 +1,81 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file import.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Heightmap import (8 / 16 bit PNG, raw integers or float32).
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <string>
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Heightmap import format.
+ *
+ */
+enum ImportFormat : int
+{
+  IMPORT_PNG,         ///< 8 or 16 bit PNG, gray level or first channel
+  IMPORT_RAW_UINT8,   ///< Headerless uint8
+  IMPORT_RAW_UINT16,  ///< Headerless native uint16
+  IMPORT_RAW_FLOAT32, ///< Headerless native float32 (as exported)
+};
+
+/**
+ * @brief Get an import format from its name: "png", "raw8", "raw16" or
+ * "raw" (float32).
+ *
+ * @param name Name.
+ * @param format Import format.
+ * @return bool Success, false for an unknown name.
+ */
+bool import_format_from_name(const std::string &name, ImportFormat &format);
+
+/**
+ * @brief Read the shape of a PNG image, {width, height}, from its header.
+ *
+ * @param fname File name.
+ * @param shape Shape.
+ * @return bool Success.
+ */
+bool read_png_shape(const std::string &fname, Shape &shape);
+
+/**
+ * @brief Import a heightmap, with the same conventions as
+ * `export_heightmap`: (i, j) are (x, y) coordinates, (0, 0) being at the
+ * bottom left, and raw files store `shape[1]` rows of `shape[0]` values
+ * from top to bottom.
+ *
+ * The values are quantized to slabs, `round((value - offset) * scale)`
+ * clamped to the range of `Height`, in parallel over blocks of rows. Raw
+ * files are memory-mapped and converted in place, the PNG images are
+ * decoded first (gray level or first channel, no interlacing). The shadow
+ * of a field is then to be updated (see `DuneField::update_shadow`).
+ *
+ * @param h Sand height, of the shape of the heightmap.
+ * @param fname File name.
+ * @param format Import format.
+ * @param scale Slabs per unit of the values of the file.
+ * @param offset Value of the bare ground.
+ * @return bool Success.
+ */
+bool import_heightmap(Array<Height>     &h,
+                      const std::string &fname,
+                      ImportFormat       format,
+                      float              scale = 1.f,
+                      float              offset = 0.f);
+
+} // namespace dunescape
@@ -0,0 +1,152 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file mask.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "core/array.hpp"
+#include "core/storage.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Mask class, bit-packed 2D boolean array with "(i, j)" indexing.
+ *
+ * Bits are packed along the 'i' direction (the wind direction) and each
+ * column starts on a new 64 bit word, so that distinct columns never
+ * share a word and can be safely modified by different threads.
+ */
+class Mask
+{
+public:
+  /**
+   * @brief Mask shape {ni, nj}.
+   *
+   */
+  Shape shape;
+
+  /**
+   * @brief Number of 64 bit words per column.
+   *
+   */
+  int words_per_column;
+
+  /**
+   * @brief Vector for data storage, size shape[1] * words_per_column, on
+   * the heap or memory-mapped (see `MappedAllocator`).
+   *
+   */
+  Storage<uint64_t> words;
+
+  /**
+   * @brief Construct a new Mask object, all bits set to 0.
+   *
+   * @param shape Mask shape {ni, nj}.
+   * @param allocator Storage allocator, heap by default.
+   */
+  Mask(Shape                            shape,
+       const MappedAllocator<uint64_t> &allocator =
+           MappedAllocator<uint64_t>());
+
+  /**
+   * @brief Call overloading, return mask value at index (i, j).
+   *
+   * @param i 'i' index.
+   * @param j 'j' index.
+   * @return bool Mask value at index (i, j).
+   */
+  inline bool operator()(int i, int j) const
+  {
+    return (this->word(i, j) >> (i & 63)) & 1;
+  }
+
+  /**
+   * @brief Set the mask value at index (i, j).
+   *
+   * @param i 'i' index.
+   * @param j 'j' index.
+   * @param value Value.
+   */
+  inline void set(int i, int j, bool value)
+  {
+    uint64_t &w = this->word(i, j);
+    w = (w & ~((uint64_t)1 << (i & 63))) | ((uint64_t)value << (i & 63));
+  }
+
+  /**
+   * @brief Return the word holding the bit at index (i, j).
+   *
+   * @param i 'i' index.
+   * @param j 'j' index.
+   * @return uint64_t& Word.
+   */
+  inline uint64_t &word(int i, int j)
+  {
+    return this->words[(size_t)j * this->words_per_column + (i >> 6)];
+  }
+
+  inline const uint64_t &word(int i, int j) const ///< @overload
+  {
+    return this->words[(size_t)j * this->words_per_column + (i >> 6)];
+  }
+
+  /**
+   * @brief Return a pointer to the first word of column `j`.
+   *
+   * @param j 'j' index.
+   * @return uint64_t* Column words.
+   */
+  inline uint64_t *column(int j)
+  {
+    return this->words.data() + (size_t)j * this->words_per_column;
+  }
+
+  inline const uint64_t *column(int j) const ///< @overload
+  {
+    return this->words.data() + (size_t)j * this->words_per_column;
+  }
+
+  /**
+   * @brief Set the mask shape, all bits are reset to 0.
+   *
+   * @param new_shape New shape.
+   */
+  void set_shape(Shape new_shape);
+
+  /**
+   * @brief Return the number of bits set to 1.
+   *
+   * @return size_t
+   */
+  size_t count() const;
+
+  /**
+   * @brief Set all the bits to a given value.
+   *
+   * @param value Value.
+   */
+  void fill(bool value);
+
+  /**
+   * @brief Convert the mask to an array of 0 and 1.
+   *
+   * @return Array<uint8_t>
+   */
+  Array<uint8_t> to_array() const;
+};
+
+} // namespace dunescape
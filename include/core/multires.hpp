@@ -0,0 +1,138 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file multires.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Coarse-to-fine warm start of a dune field.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "core/dunefield.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Multiresolution schedule, the coarse levels run before the
+ * full resolution one.
+ *
+ */
+struct MultiresSchedule
+{
+  /**
+   * @brief Number of levels including the full resolution, each coarse
+   * level halving the resolution of the next one (1 for no warm start).
+   *
+   */
+  int levels = 3;
+
+  /**
+   * @brief Cycles of each coarse level, coarsest first, the last value
+   * being repeated for the remaining levels.
+   *
+   */
+  std::vector<int> cycles = {1000};
+
+  /**
+   * @brief Return the number of cycles of a coarse level.
+   *
+   * @param level Coarse level, 0 for the coarsest one.
+   * @return int Number of cycles.
+   */
+  int cycles_at(int level) const
+  {
+    if (this->cycles.empty())
+      return 0;
+    return this->cycles[std::min(level, (int)this->cycles.size() - 1)];
+  }
+};
+
+/**
+ * @brief Callback invoked after each coarse level, with the field of the
+ * level and its index (0 for the coarsest).
+ *
+ */
+typedef std::function<void(const DuneField &, int)> MultiresCallback;
+
+/**
+ * @brief Halve the resolution of a sand height.
+ *
+ * The cells of level `level` cover (up to) 2^level x 2^level cells of the
+ * full resolution grid, fewer along its last row and column when its
+ * shape is not a multiple of 2^level. A coarse cell covers (up to) 2 x 2
+ * cells and its slabs are twice as thick, so that the slopes (in slabs
+ * per cell) and the shadow and repose angles are unchanged: its height is
+ * the sand of its cells, weighted by the full resolution cells they
+ * cover, divided by twice the number of full resolution cells it covers.
+ * The rounding errors are carried over to the next cell, the total amount
+ * of sand is conserved up to the last one, at every level and for any
+ * shape.
+ *
+ * @param h Sand height of level `level`.
+ * @param shape0 Full resolution shape.
+ * @param level Level of `h`, 0 for the full resolution.
+ * @return Array<Height> Coarse sand height, shape {(ni + 1) / 2, (nj + 1)
+ * / 2}, same layout.
+ */
+Array<Height> downsample_heights(const Array<Height> &h,
+                                 Shape               shape0,
+                                 int                 level);
+
+/**
+ * @brief Double the resolution of a sand height (inverse of
+ * `downsample_heights`).
+ *
+ * The fine heights are interpolated bilinearly between the coarse cells
+ * (wrapping around the periodic directions) and rescaled so that the
+ * cells of each coarse cell hold its sand, weighted by the full
+ * resolution cells they cover, and rounded by largest remainders. The
+ * amount of sand is conserved (within the range of Height): exactly cell
+ * by cell back to the full resolution, and up to a remainder carried over
+ * to the next cell, smaller than the area of a fine cell, at the
+ * intermediate levels.
+ *
+ * @param h Coarse sand height, of level `level` >= 1.
+ * @param shape0 Full resolution shape.
+ * @param level Level of `h`.
+ * @param boundary Boundary conditions of the field.
+ * @return Array<Height> Fine sand height, of level `level - 1`, same
+ * layout.
+ */
+Array<Height> upsample_heights(const Array<Height> &h,
+                               Shape               shape0,
+                               int                 level,
+                               Boundary            boundary);
+
+/**
+ * @brief Warm start a dune field by developing its sand height at coarser
+ * resolutions first.
+ *
+ * The sand height of the field is downsampled `levels - 1` times, the
+ * coarsest field is simulated for its number of cycles, then upsampled
+ * into the next level, and so on up to the field itself. The coarse
+ * levels have the same parameters as the field except for the hop length,
+ * halved at each level (at least 1 cell): one cycle of level k moves the
+ * sand over 2^k times the distance of a full resolution cycle, on 4^k
+ * times fewer cells. The shadow of the field is updated, and the cells
+ * to relax queued if needed, its cycle counter is left unchanged.
+ *
+ * @param df Dune field, with its initial sand height and parameters.
+ * @param schedule Levels and cycles.
+ * @param on_level Callback invoked after each coarse level (optional).
+ */
+void warm_start(DuneField              &df,
+                const MultiresSchedule &schedule,
+                MultiresCallback        on_level = nullptr);
+
+} // namespace dunescape
@@ -0,0 +1,124 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file png.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Building blocks shared by the PNG encoder (export) and decoder
+ * (import): checksums, deflate tables, zlib stream decoder.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+namespace dunescape
+{
+
+/**
+ * @brief Base lengths of the length codes 257 to 285.
+ *
+ */
+extern const int length_base[29];
+
+/**
+ * @brief Extra bits of the length codes 257 to 285.
+ *
+ */
+extern const int length_extra[29];
+
+/**
+ * @brief Base distances of the distance codes.
+ *
+ */
+extern const int dist_base[30];
+
+/**
+ * @brief Extra bits of the distance codes.
+ *
+ */
+extern const int dist_extra[30];
+
+/**
+ * @brief Update a CRC-32 (PNG chunks), starting from 0xffffffff and to be
+ * inverted once all the data is processed.
+ *
+ * @param crc Current value.
+ * @param p Data.
+ * @param n Size in bytes.
+ * @return uint32_t Updated value.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t n);
+
+/**
+ * @brief Return the Adler-32 checksum of a block (zlib streams).
+ *
+ * @param p Data.
+ * @param n Size in bytes.
+ * @return uint32_t Checksum.
+ */
+uint32_t adler32(const uint8_t *p, size_t n);
+
+/**
+ * @brief Return the Adler-32 checksum of the concatenation of two blocks,
+ * so that the checksums of a large buffer are computed in parallel.
+ *
+ * @param adler1 Checksum of the first block.
+ * @param adler2 Checksum of the second block.
+ * @param len2 Size in bytes of the second block.
+ * @return uint32_t Checksum.
+ */
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+
+/**
+ * @brief Return the `nbits` low bits of a code in reverse order (Huffman
+ * codes are packed starting from their most significant bit).
+ *
+ * @param code Code.
+ * @param nbits Number of bits.
+ * @return uint32_t Reversed code.
+ */
+uint32_t reverse_bits(uint32_t code, int nbits);
+
+/**
+ * @brief Return the Paeth predictor of a byte from its left (a), up (b)
+ * and upper left (c) neighbors (PNG filter type 4).
+ *
+ * @param a Left byte.
+ * @param b Up byte.
+ * @param c Upper left byte.
+ * @return int Predictor.
+ */
+inline int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  return (pa <= pb and pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+/**
+ * @brief Decode a zlib stream whose decoded size is known beforehand,
+ * the Adler-32 checksum of the data being verified.
+ *
+ * @param src Stream.
+ * @param src_size Stream size in bytes.
+ * @param dst Decoded data.
+ * @param dst_size Expected decoded size in bytes, anything else is an
+ * error.
+ * @return bool Success.
+ */
+bool inflate_zlib(const uint8_t *src,
+                  size_t         src_size,
+                  uint8_t       *dst,
+                  size_t         dst_size);
+
+} // namespace dunescape
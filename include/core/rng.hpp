@@ -0,0 +1,102 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file rng.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Counter-based random number generation.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace dunescape
+{
+
+/**
+ * @brief Stateless 64 bit integer hash (SplitMix64 finalizer).
+ *
+ * @param x Input value.
+ * @return uint64_t Hashed value.
+ */
+inline uint64_t hash_u64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * @brief Counter-based random number generator, the sequence of numbers
+ * drawn only depends on the key `(seed, cycle, cell)` and not on any
+ * shared state, which makes it safe and reproducible in parallel loops
+ * whatever the number of threads.
+ *
+ */
+class CounterRng
+{
+public:
+  /**
+   * @brief Construct a new CounterRng object.
+   *
+   * @param seed Random seed number.
+   * @param cycle Simulation cycle index.
+   * @param cell Cell (or stream) identifier.
+   */
+  CounterRng(uint64_t seed, uint64_t cycle, uint64_t cell)
+      : key(hash_u64(hash_u64(hash_u64(seed) ^ cycle) ^ cell))
+  {
+  }
+
+  /**
+   * @brief Return the next 64 bit random integer.
+   *
+   * @return uint64_t
+   */
+  inline uint64_t next_u64()
+  {
+    return hash_u64(this->key + 0x632be59bd9b4e019ULL * (++this->counter));
+  }
+
+  /**
+   * @brief Return the next random float, uniform in [0, 1).
+   *
+   * @return float
+   */
+  inline float next_float()
+  {
+    return (float)(this->next_u64() >> 40) * (1.f / 16777216.f);
+  }
+
+  /**
+   * @brief Return the next random integer, uniform in [0, n).
+   *
+   * @param n Upper bound (excluded).
+   * @return uint64_t
+   */
+  inline uint64_t next_below(uint64_t n)
+  {
+    return this->next_u64() % n;
+  }
+
+  /**
+   * @brief Skip numbers, as if `n` numbers had been drawn (e.g. to carry
+   * on a sequence in another process).
+   *
+   * @param n Number of numbers skipped.
+   */
+  inline void discard(uint64_t n) { this->counter += n; }
+
+private:
+  uint64_t key;
+  uint64_t counter = 0;
+};
+
+} // namespace dunescape
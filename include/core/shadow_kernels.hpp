@@ -0,0 +1,111 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file shadow_kernels.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Row kernels of the shadow sweep, with SIMD variants selected at
+ * runtime.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstdint>
+
+#include "core/dunefield.hpp"
+
+// x86 SIMD variants, compiled with function target attributes so that
+// the rest of the code keeps the baseline instruction set
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+    (defined(__x86_64__) || defined(__i386__))
+#define DUNESCAPE_X86_SIMD
+#endif
+
+namespace dunescape
+{
+
+/**
+ * @brief Instruction set of the shadow kernels.
+ *
+ */
+enum SimdLevel : int
+{
+  SIMD_SCALAR, ///< Portable C++
+  SIMD_AVX2,   ///< AVX2, 8 columns per instruction
+  SIMD_AVX512, ///< AVX-512F, 16 columns per instruction
+};
+
+/**
+ * @brief Row kernels of the shadow sweep (see DuneField::update_shadow).
+ *
+ */
+struct ShadowKernels
+{
+  /**
+   * @brief Move the shadow envelopes of `n` columns one row downwind and
+   * return the maximum height of the row.
+   *
+   */
+  int (*envelope_sweep_row)(const Height *__restrict h_row,
+                            int *__restrict hb,
+                            int *__restrict kb,
+                            int   n,
+                            float slope);
+
+  /**
+   * @brief Compute the shadow and the sandy cells of `n` columns for one
+   * row (bit `bit` of the column words), flag the near-ties and move the
+   * envelopes one row downwind. Return true if there is any near-tie.
+   *
+   */
+  bool (*shadow_sweep_row)(const Height *__restrict h_row,
+                           uint64_t *__restrict shadow_words,
+                           uint64_t *__restrict sandy_words,
+                           int             bit,
+                           int *__restrict hb,
+                           int *__restrict kb,
+                           uint8_t *__restrict near_tie,
+                           int   n,
+                           float slope,
+                           float margin,
+                           const int *__restrict thresholds);
+};
+
+/**
+ * @brief Return the kernels of the current SIMD level.
+ *
+ * @return const ShadowKernels&
+ */
+const ShadowKernels &shadow_kernels();
+
+/**
+ * @brief Return the SIMD level in use, the best one supported by the CPU
+ * unless lowered with `set_simd_level`.
+ *
+ * @return SimdLevel
+ */
+SimdLevel simd_level();
+
+/**
+ * @brief Set the SIMD level (capped to the levels supported by the CPU),
+ * e.g. to compare the kernels. All the levels give the same results.
+ *
+ * @param level SIMD level.
+ * @return SimdLevel Level actually set.
+ */
+SimdLevel set_simd_level(SimdLevel level);
+
+/**
+ * @brief Return the name of a SIMD level.
+ *
+ * @param level SIMD level.
+ * @return const char* Name.
+ */
+const char *simd_level_name(SimdLevel level);
+
+} // namespace dunescape
@@ -0,0 +1,181 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file simulation.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Dune field simulation running on a background thread.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+#include "core/triple_buffer.hpp"
+
+namespace dunescape
+{
+
+/**
+ * @brief Snapshot of the dune field published by the simulation thread.
+ *
+ */
+struct Snapshot
+{
+  /**
+   * @brief Sand height.
+   *
+   */
+  Array<Height> h = Array<Height>({0, 0});
+
+  /**
+   * @brief Snapshot index, starting at 1 (0 for an empty snapshot).
+   *
+   */
+  uint64_t id = 0;
+
+  /**
+   * @brief Index of the last snapshot in which each column has been
+   * modified, size shape[1]. A consumer that last displayed snapshot
+   * `id0` only needs to refresh the columns with `column_id > id0`.
+   *
+   */
+  std::vector<uint64_t> column_id;
+
+  /**
+   * @brief Number of cycles performed.
+   *
+   */
+  uint64_t cycle_count = 0;
+
+  /**
+   * @brief Number of sand slabs moved during the last cycle.
+   *
+   */
+  uint64_t n_moves = 0;
+
+  /**
+   * @brief Simulation rate, in cycles per second.
+   *
+   */
+  float cycles_per_second = 0.f;
+
+  /**
+   * @brief Summary of the sand height (mass, extrema, roughness).
+   *
+   */
+  HeightSummary heights;
+
+  /**
+   * @brief Solver statistics of the cycles performed since the previous
+   * snapshot (empty if not built with DUNESCAPE_STATS).
+   *
+   */
+  CycleStats stats;
+};
+
+/**
+ * @brief Simulation class, owns a DuneField and runs it on a worker
+ * thread.
+ *
+ * The field is only ever touched by the worker thread: modifications
+ * (parameters, reset, shape...) are posted as commands which are
+ * executed between two cycles, and the state is made available to other
+ * threads through snapshots published with a lock-free triple buffer.
+ */
+class Simulation
+{
+public:
+  /**
+   * @brief Number of cycles between two snapshots.
+   *
+   */
+  std::atomic<int> cycles_per_snapshot = {1};
+
+  /**
+   * @brief Construct a new Simulation object, the worker thread is
+   * started paused.
+   *
+   * @param shape Dune field shape {ni, nj}.
+   * @param n_threads Number of OpenMP threads used by the worker (all
+   * available threads if not positive).
+   */
+  Simulation(Shape shape, int n_threads = 0);
+
+  /**
+   * @brief Destroy the Simulation object, the worker thread is stopped.
+   *
+   */
+  ~Simulation();
+
+  /**
+   * @brief Post a command, executed by the worker thread before the
+   * next cycle. A snapshot is published once the pending commands have
+   * been executed.
+   *
+   * @param command Command.
+   */
+  void post(std::function<void(DuneField &)> command);
+
+  /**
+   * @brief Pause or resume the simulation.
+   *
+   * @param new_paused Pause state.
+   */
+  void set_paused(bool new_paused);
+
+  /**
+   * @brief Perform a single cycle (while paused).
+   *
+   */
+  void step();
+
+  /**
+   * @brief Acquire the latest published snapshot, if any.
+   *
+   * @return bool True if a new snapshot is available in `snapshot()`.
+   */
+  bool acquire_snapshot() { return this->snapshots.acquire(); }
+
+  /**
+   * @brief Return the snapshot last acquired.
+   *
+   * @return const Snapshot&
+   */
+  const Snapshot &snapshot() const { return this->snapshots.front(); }
+
+private:
+  DuneField df;
+  int       n_threads;
+
+  std::thread                                   worker;
+  std::mutex                                    mutex;
+  std::condition_variable                       wake_up;
+  std::vector<std::function<void(DuneField &)>> commands;
+  bool                                          paused = true;
+  bool                                          stopping = false;
+  int                                           pending_steps = 0;
+
+  TripleBuffer<Snapshot> snapshots;
+  uint64_t               snapshot_count = 0;
+  std::vector<uint64_t>  column_id; // see Snapshot::column_id
+
+  void run();
+
+  void publish(uint64_t n_moves, float cycles_per_second);
+};
+
+} // namespace dunescape
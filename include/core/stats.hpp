@@ -0,0 +1,199 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file stats.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Instrumentation of the simulation kernels.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#define STATS_HOP_BINS 16 // hop count histogram, last bin for longer flights
+
+// The counters and timers are only compiled in when DUNESCAPE_STATS is
+// defined (CMake option of the same name), the macros below expand to
+// nothing otherwise
+#ifdef DUNESCAPE_STATS
+#define STATS_ENABLED true
+#define STATS_RESERVE(stats) (stats).reserve()
+#define STATS_COUNT(stats, counter, n) (stats).local().counter += (n)
+#define STATS_HOPS(stats, n_hops)                                              \
+  (stats).local().hops[std::min((n_hops), STATS_HOP_BINS) - 1]++
+#define STATS_CYCLE(stats) (stats).n_cycles++
+#define STATS_TIMER(t0) const auto t0 = std::chrono::steady_clock::now()
+#define STATS_TIME(stats, phase, t0) (stats).add_time(phase, t0)
+#else
+#define STATS_ENABLED false
+#define STATS_RESERVE(stats)
+#define STATS_COUNT(stats, counter, n)
+#define STATS_HOPS(stats, n_hops)
+#define STATS_CYCLE(stats)
+#define STATS_TIMER(t0)
+#define STATS_TIME(stats, phase, t0)
+#endif
+
+namespace dunescape
+{
+
+/**
+ * @brief Timed phases.
+ *
+ */
+enum StatsPhase : int
+{
+  STATS_PHASE_EVEN,   ///< Erosion of the even column strips
+  STATS_PHASE_ODD,    ///< Erosion of the odd column strips
+  STATS_PHASE_SHADOW, ///< Global shadow updates
+  STATS_PHASE_RELAX,  ///< Avalanche relaxation
+  STATS_PHASE_COUNT,
+};
+
+/**
+ * @brief Return the name of a phase.
+ *
+ * @param phase Phase.
+ * @return const char* Name.
+ */
+const char *stats_phase_name(int phase);
+
+/**
+ * @brief Counters of a single thread, padded so that two threads never
+ * write to the same cache line.
+ *
+ */
+struct StatsCounters
+{
+  uint64_t n_eroded = 0;       ///< Slabs eroded
+  uint64_t n_deposited = 0;    ///< Slabs deposited
+  uint64_t n_avalanches = 0;   ///< Slabs redirected to a neighbor cell
+  uint64_t n_shadow_cells = 0; ///< Shadow cells updated
+
+  uint64_t hops[STATS_HOP_BINS] = {}; ///< Slabs per number of hops
+
+  uint8_t padding[64];
+};
+
+/**
+ * @brief Statistics gathered over one or several cycles.
+ *
+ */
+struct CycleStats
+{
+  uint64_t n_cycles = 0;       ///< Number of cycles
+  uint64_t n_eroded = 0;       ///< Slabs eroded
+  uint64_t n_deposited = 0;    ///< Slabs deposited
+  uint64_t n_avalanches = 0;   ///< Slabs redirected to a neighbor cell
+  uint64_t n_shadow_cells = 0; ///< Shadow cells updated
+
+  uint64_t hops[STATS_HOP_BINS] = {}; ///< Slabs per number of hops
+
+  double seconds[STATS_PHASE_COUNT] = {}; ///< Wall time per phase
+};
+
+/**
+ * @brief Stats class, per-thread counters and phase timings of a dune
+ * field. The counters are incremented through the `STATS_*` macros by
+ * the threads working on the field and gathered by `collect`.
+ *
+ */
+class Stats
+{
+public:
+  /**
+   * @brief Number of cycles since the last call to `collect`.
+   *
+   */
+  uint64_t n_cycles = 0;
+
+  /**
+   * @brief Make room for the counters of all the OpenMP threads, to be
+   * called before entering a parallel region.
+   *
+   */
+  void reserve();
+
+  /**
+   * @brief Return the counters of the calling thread.
+   *
+   * @return StatsCounters&
+   */
+  StatsCounters &local() { return this->counters[omp_get_thread_num()]; }
+
+  /**
+   * @brief Add the time elapsed since `t0` to a phase (serial code only).
+   *
+   * @param phase Phase.
+   * @param t0 Start of the phase.
+   */
+  void add_time(int phase, std::chrono::steady_clock::time_point t0)
+  {
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    this->seconds[phase] += dt.count();
+  }
+
+  /**
+   * @brief Return the statistics gathered since the last call and reset
+   * the counters.
+   *
+   * @return CycleStats
+   */
+  CycleStats collect();
+
+private:
+  std::vector<StatsCounters> counters = std::vector<StatsCounters>(1);
+  double                     seconds[STATS_PHASE_COUNT] = {};
+};
+
+/**
+ * @brief StatsWriter class, stream of statistics records written to a
+ * CSV file, or to a JSON Lines file (one object per line) if the file
+ * name ends with ".json" or ".jsonl". Records are flushed as they are
+ * written, the file can be followed while the simulation runs.
+ *
+ */
+class StatsWriter
+{
+public:
+  /**
+   * @brief Construct a new StatsWriter object and open the file.
+   *
+   * @param fname File name.
+   */
+  StatsWriter(const std::string &fname);
+
+  /**
+   * @brief Return true if the file is open.
+   *
+   * @return bool
+   */
+  bool is_open() const { return this->f.is_open(); }
+
+  /**
+   * @brief Write a record.
+   *
+   * @param cycle_count Cycle index at the end of the record.
+   * @param s Statistics.
+   */
+  void write(uint64_t cycle_count, const CycleStats &s);
+
+private:
+  std::ofstream f;
+  bool          json = false;
+};
+
+} // namespace dunescape
@@ -0,0 +1,175 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file storage.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Array storage in RAM or in memory-mapped files, for fields
+ * larger than the physical memory.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace dunescape
+{
+
+/**
+ * @brief Paging hints for a range of a memory-mapped storage.
+ *
+ */
+enum StorageAdvice : int
+{
+  STORAGE_WILL_NEED, ///< Soon accessed, read ahead
+  STORAGE_COLD,      ///< Not accessed for a while, reclaimed first
+};
+
+/**
+ * @brief Create a file of `bytes` bytes in a directory and map it in
+ * memory (shared read/write mapping). The file is unlinked right away:
+ * it only lives as long as the mapping and is never visible to other
+ * processes.
+ *
+ * @param directory Directory.
+ * @param bytes Size in bytes.
+ * @return void* Mapped memory, zero-filled, nullptr on failure.
+ */
+void *map_storage_file(const std::string &directory, size_t bytes);
+
+/**
+ * @brief Map an existing file in memory, read-only, e.g. to read large
+ * inputs without copying them.
+ *
+ * @param fname File name.
+ * @param bytes Size in bytes of the file.
+ * @return const void* Mapped memory, to be unmapped with
+ * `unmap_storage_file`, nullptr on failure (empty files included).
+ */
+const void *map_input_file(const std::string &fname, size_t &bytes);
+
+/**
+ * @brief Unmap a storage file (see `map_storage_file`).
+ *
+ * @param ptr Mapped memory.
+ * @param bytes Size in bytes.
+ */
+void unmap_storage_file(void *ptr, size_t bytes);
+
+/**
+ * @brief Give a paging hint to the kernel for a range of a storage file,
+ * extended to whole pages.
+ *
+ * @param ptr Start of the range.
+ * @param bytes Size in bytes.
+ * @param advice Hint.
+ */
+void advise_storage(const void *ptr, size_t bytes, StorageAdvice advice);
+
+/**
+ * @brief MappedAllocator class, allocates the storage of an array either
+ * on the heap (default) or in files memory-mapped from a directory (see
+ * `map_storage_file`), in which case the kernel pages the data in and
+ * out of the RAM as it is accessed.
+ *
+ * The storage follows the container: assigning an array to another one
+ * copies the values into the storage of the latter, and copies of an
+ * array are stored as the original.
+ *
+ * @tparam T Element type.
+ */
+template <typename T> class MappedAllocator
+{
+public:
+  typedef T value_type;
+
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::false_type propagate_on_container_move_assignment;
+  typedef std::true_type  propagate_on_container_swap;
+
+  /**
+   * @brief Directory of the storage files, empty for the heap.
+   *
+   */
+  std::string directory;
+
+  /**
+   * @brief Construct a new MappedAllocator object.
+   *
+   * @param directory Directory of the storage files, empty for the heap.
+   */
+  explicit MappedAllocator(const std::string &directory = "")
+      : directory(directory)
+  {
+  }
+
+  template <typename U>
+  MappedAllocator(const MappedAllocator<U> &other)
+      : directory(other.directory)
+  {
+  }
+
+  /**
+   * @brief Return true if the storage is memory-mapped.
+   *
+   * @return bool
+   */
+  bool is_mapped() const { return !this->directory.empty(); }
+
+  T *allocate(size_t n)
+  {
+    if (!this->is_mapped())
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    if (n == 0)
+      return nullptr;
+
+    void *ptr = map_storage_file(this->directory, n * sizeof(T));
+    if (!ptr)
+      throw std::bad_alloc();
+    return static_cast<T *>(ptr);
+  }
+
+  void deallocate(T *ptr, size_t n)
+  {
+    if (this->is_mapped())
+      unmap_storage_file(ptr, n * sizeof(T));
+    else
+      ::operator delete(ptr);
+  }
+
+  MappedAllocator select_on_container_copy_construction() const
+  {
+    return *this;
+  }
+};
+
+// memory from any heap allocator can be released by another one, same
+// thing for the mapped ones (whatever their directory)
+template <typename T, typename U>
+bool operator==(const MappedAllocator<T> &a, const MappedAllocator<U> &b)
+{
+  return a.is_mapped() == b.is_mapped();
+}
+
+template <typename T, typename U>
+bool operator!=(const MappedAllocator<T> &a, const MappedAllocator<U> &b)
+{
+  return !(a == b);
+}
+
+/**
+ * @brief Storage vector of the arrays.
+ *
+ */
+template <typename T> using Storage = std::vector<T, MappedAllocator<T>>;
+
+} // namespace dunescape
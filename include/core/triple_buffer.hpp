@@ -0,0 +1,87 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+/**
+ * @file triple_buffer.hpp
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief Lock-free single producer / single consumer triple buffer.
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#pragma once
+
+#include <atomic>
+
+namespace dunescape
+{
+
+/**
+ * @brief TripleBuffer class, hands over the latest value written by one
+ * producer thread to one consumer thread without any lock.
+ *
+ * The producer owns the back slot and the consumer the front slot, the
+ * third slot is exchanged atomically between them. Neither side ever
+ * waits: the producer can publish faster than the consumer reads
+ * (intermediate values are then dropped) and the consumer keeps the
+ * last value it acquired until a fresher one is available.
+ */
+template <typename T> class TripleBuffer
+{
+public:
+  /**
+   * @brief Return the slot the producer writes to.
+   *
+   * @return T&
+   */
+  T &back() { return this->slots[this->back_index]; }
+
+  /**
+   * @brief Publish the back slot (producer side), a new back slot is
+   * then handed over to the producer.
+   *
+   */
+  void publish()
+  {
+    int previous = this->middle.exchange(this->back_index | FRESH,
+                                         std::memory_order_acq_rel);
+    this->back_index = previous & INDEX;
+  }
+
+  /**
+   * @brief Acquire the last published value, if any (consumer side).
+   *
+   * @return bool True if the front slot has been updated.
+   */
+  bool acquire()
+  {
+    if (!(this->middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+
+    int previous = this->middle.exchange(this->front_index,
+                                         std::memory_order_acq_rel);
+    this->front_index = previous & INDEX;
+    return true;
+  }
+
+  /**
+   * @brief Return the slot last acquired by the consumer.
+   *
+   * @return const T&
+   */
+  const T &front() const { return this->slots[this->front_index]; }
+
+private:
+  static const int INDEX = 3; // slot index bits
+  static const int FRESH = 4; // set when the middle slot is unread
+
+  T                slots[3];
+  std::atomic<int> middle = {1};
+  int              back_index = 0;
+  int              front_index = 2;
+};
+
+} // namespace dunescape
@@ -0,0 +1,247 @@
+/* Copyright (c) 2023 Otto Link. Distributed under the terms of the
+ * MIT License. The full license is in the file LICENSE, distributed
+ * with this software. */
+
+/**
+ * @file dunescape.h
+ * @author Otto Link (otto.link.bv@gmail.com)
+ * @brief C API of the dune field simulation, for embedding (see
+ * python/dunescape.py for the Python bindings).
+ * @version 0.1
+ * @date 2023-06-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * The field is an opaque handle. Functions returning an int return 1 on
+ * success and 0 on failure (the error being logged to stderr), no
+ * exception crosses the interface. A field that failed to be updated,
+ * e.g. out of memory in the middle of a cycle, is only to be restored
+ * from a checkpoint or destroyed. The sand height and the shadow are
+ * borrowed in place, without any copy: the pointers remain valid until
+ * the field is destroyed, or resized by `dunescape_load_checkpoint`, and
+ * their content changes with each cycle.
+ */
+#ifndef DUNESCAPE_H
+#define DUNESCAPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DUNESCAPE_API_VERSION 2 /* bumped on incompatible changes */
+
+#if defined(__GNUC__)
+#define DUNESCAPE_API __attribute__((visibility("default")))
+#else
+#define DUNESCAPE_API
+#endif
+
+/* boundary conditions, "boundary" parameter */
+#define DUNESCAPE_BOUNDARY_PERIODIC 0
+#define DUNESCAPE_BOUNDARY_OPEN 1
+#define DUNESCAPE_BOUNDARY_WALLS 2
+
+/**
+ * @brief Dune field handle.
+ *
+ */
+typedef struct dunescape_field dunescape_field;
+
+/**
+ * @brief Borrowed 2D buffer, element (i, j) at `data + i * strides[0] +
+ * j * strides[1]` (strides in bytes).
+ *
+ */
+typedef struct
+{
+  const void *data;       /**< First element */
+  int64_t     shape[2];   /**< Shape {ni, nj} */
+  int64_t     strides[2]; /**< Strides in bytes */
+  int         itemsize;   /**< Element size in bytes (unsigned integers) */
+} dunescape_buffer;
+
+/**
+ * @brief Summary of the sand height, maintained incrementally.
+ *
+ */
+typedef struct
+{
+  uint64_t cycle_count;    /**< Cycles performed so far */
+  uint64_t mass;           /**< Total number of slabs */
+  int      min;            /**< Minimum height */
+  int      max;            /**< Maximum height */
+  double   mean;           /**< Mean height */
+  double   rms;            /**< Standard deviation (roughness) */
+  double   sandy_fraction; /**< Fraction of cells with sand */
+} dunescape_summary;
+
+/**
+ * @brief Return DUNESCAPE_API_VERSION of the library.
+ *
+ * @return int
+ */
+DUNESCAPE_API int dunescape_api_version(void);
+
+/**
+ * @brief Return the size in bytes of a sand height (see
+ * DUNESCAPE_HEIGHT_TYPE).
+ *
+ * @return int
+ */
+DUNESCAPE_API int dunescape_height_size(void);
+
+/**
+ * @brief Set the number of OpenMP threads.
+ *
+ * @param n_threads Number of threads, 0 for all.
+ */
+DUNESCAPE_API void dunescape_set_threads(int n_threads);
+
+/**
+ * @brief Create a dune field, flat and bare, with the default parameters
+ * (column-major sand height).
+ *
+ * @param ni Size along the wind direction.
+ * @param nj Size across the wind direction.
+ * @param storage Directory of memory-mapped storage files, NULL or "" to
+ * keep the field in RAM.
+ * @return dunescape_field* Field, NULL on failure.
+ */
+DUNESCAPE_API dunescape_field *dunescape_create(int         ni,
+                                                int         nj,
+                                                const char *storage);
+
+/**
+ * @brief Destroy a dune field (NULL is ignored).
+ *
+ * @param df Field.
+ */
+DUNESCAPE_API void dunescape_destroy(dunescape_field *df);
+
+/**
+ * @brief Set a model parameter: "shadow_slope", "hop_length",
+ * "prob_deposit_bare", "prob_deposit_sand", "relax_avalanches" (0 or 1),
+ * "boundary" (DUNESCAPE_BOUNDARY_*), "sand_inflow" or "seed".
+ *
+ * @param df Field.
+ * @param name Parameter name.
+ * @param value Value.
+ * @return int Success, 0 for an unknown parameter.
+ */
+DUNESCAPE_API int dunescape_set_param(dunescape_field *df,
+                                      const char      *name,
+                                      double           value);
+
+/**
+ * @brief Get a model parameter (see `dunescape_set_param`).
+ *
+ * @param df Field.
+ * @param name Parameter name.
+ * @param value Value.
+ * @return int Success, 0 for an unknown parameter.
+ */
+DUNESCAPE_API int dunescape_get_param(const dunescape_field *df,
+                                      const char            *name,
+                                      double                *value);
+
+/**
+ * @brief Fill the sand height with white noise, uniform in [a, b].
+ *
+ * @param df Field.
+ * @param a Lower bound.
+ * @param b Upper bound.
+ * @param seed Random seed number.
+ * @return int Success.
+ */
+DUNESCAPE_API int dunescape_randomize(dunescape_field *df,
+                                      int              a,
+                                      int              b,
+                                      uint32_t         seed);
+
+/**
+ * @brief Set the sand height, elements of `dunescape_height_size()`
+ * bytes, the shadow being updated accordingly.
+ *
+ * @param df Field.
+ * @param data Element (0, 0).
+ * @param stride_i Distance in bytes between (i, j) and (i + 1, j).
+ * @param stride_j Distance in bytes between (i, j) and (i, j + 1).
+ * @return int Success.
+ */
+DUNESCAPE_API int dunescape_set_heights(dunescape_field *df,
+                                        const void      *data,
+                                        int64_t          stride_i,
+                                        int64_t          stride_j);
+
+/**
+ * @brief Run simulation cycles.
+ *
+ * @param df Field.
+ * @param n_cycles Number of cycles.
+ * @param n_moves Output number of sand slabs moved, can be NULL.
+ * @return int Success.
+ */
+DUNESCAPE_API int dunescape_run(dunescape_field *df,
+                                int              n_cycles,
+                                uint64_t        *n_moves);
+
+/**
+ * @brief Borrow the sand height, elements of `dunescape_height_size()`
+ * bytes.
+ *
+ * @param df Field.
+ * @param buffer Output buffer description.
+ */
+DUNESCAPE_API void dunescape_heights(const dunescape_field *df,
+                                     dunescape_buffer      *buffer);
+
+/**
+ * @brief Borrow the shadow mask, bit-packed along the wind direction:
+ * 64 bit words of shape {(ni + 63) / 64, nj}, cell (i, j) being in the
+ * shadow if bit i % 64 of word (i / 64, j) is set.
+ *
+ * @param df Field.
+ * @param buffer Output buffer description.
+ */
+DUNESCAPE_API void dunescape_shadow(const dunescape_field *df,
+                                    dunescape_buffer      *buffer);
+
+/**
+ * @brief Summarize the sand height, O(1).
+ *
+ * @param df Field.
+ * @param summary Output summary.
+ */
+DUNESCAPE_API void dunescape_summarize(const dunescape_field *df,
+                                       dunescape_summary     *summary);
+
+/**
+ * @brief Save the field to a checkpoint file (see core/checkpoint.hpp).
+ *
+ * @param df Field.
+ * @param fname File name.
+ * @return int Success.
+ */
+DUNESCAPE_API int dunescape_save_checkpoint(const dunescape_field *df,
+                                            const char            *fname);
+
+/**
+ * @brief Restore the field from a checkpoint file, shape included (the
+ * buffers borrowed so far are then invalid).
+ *
+ * @param df Field.
+ * @param fname File name.
+ * @return int Success.
+ */
+DUNESCAPE_API int dunescape_load_checkpoint(dunescape_field *df,
+                                            const char      *fname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DUNESCAPE_H */
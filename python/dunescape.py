@@ -0,0 +1,301 @@
+# Copyright (c) 2023 Otto Link. Distributed under the terms of the
+# MIT License. The full license is in the file LICENSE, distributed
+# with this software.
+"""Python bindings of the DuneScape C API (include/dunescape.h).
+
+The shared library is looked up in $DUNESCAPE_LIBRARY, then in the
+library path and in build/lib next to this directory.
+
+The sand height and the shadow of a field are exposed through the buffer
+protocol, as read-only memoryviews of the memory of the field (no copy):
+they follow the simulation, keep the field alive (closing it is deferred
+until they are released), and are invalidated when the field is restored
+from a checkpoint. NumPy is only needed for the `*_array` helpers.
+
+    import dunescape
+
+    with dunescape.Field(512, 256) as f:
+        f.randomize(0, 4, seed=1)
+        f.hop_length = 3
+        f.run(1000)
+        h = f.heights_array()  # (ni, nj) view, no copy
+"""
+import ctypes
+import ctypes.util
+import os
+import weakref
+
+API_VERSION = 2
+
+BOUNDARY_PERIODIC = 0
+BOUNDARY_OPEN = 1
+BOUNDARY_WALLS = 2
+
+PARAMETERS = ('shadow_slope', 'hop_length', 'prob_deposit_bare',
+              'prob_deposit_sand', 'relax_avalanches', 'boundary',
+              'sand_inflow', 'seed')
+
+
+class _Buffer(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p),
+                ('shape', ctypes.c_int64 * 2),
+                ('strides', ctypes.c_int64 * 2),
+                ('itemsize', ctypes.c_int)]
+
+
+class Summary(ctypes.Structure):
+    """Summary of the sand height (see `Field.summary`)."""
+    _fields_ = [('cycle_count', ctypes.c_uint64),
+                ('mass', ctypes.c_uint64),
+                ('min', ctypes.c_int),
+                ('max', ctypes.c_int),
+                ('mean', ctypes.c_double),
+                ('rms', ctypes.c_double),
+                ('sandy_fraction', ctypes.c_double)]
+
+    def __repr__(self):
+        return ', '.join('%s=%s' % (name, getattr(self, name))
+                         for name, _ in self._fields_)
+
+
+def _load_library():
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [os.environ.get('DUNESCAPE_LIBRARY'),
+                  ctypes.util.find_library('dunescape_c'),
+                  os.path.join(here, '..', 'build', 'lib',
+                               'libdunescape_c.so')]
+
+    for path in candidates:
+        if path and (os.path.exists(path) or not os.path.dirname(path)):
+            try:
+                return ctypes.CDLL(path)
+            except OSError:
+                pass
+    raise OSError('libdunescape_c not found, set DUNESCAPE_LIBRARY')
+
+
+def _declare(lib):
+    c_field = ctypes.c_void_p
+    signatures = {
+        'dunescape_api_version': (ctypes.c_int, []),
+        'dunescape_height_size': (ctypes.c_int, []),
+        'dunescape_set_threads': (None, [ctypes.c_int]),
+        'dunescape_create': (c_field, [ctypes.c_int, ctypes.c_int,
+                                       ctypes.c_char_p]),
+        'dunescape_destroy': (None, [c_field]),
+        'dunescape_set_param': (ctypes.c_int, [c_field, ctypes.c_char_p,
+                                               ctypes.c_double]),
+        'dunescape_get_param': (ctypes.c_int,
+                                [c_field, ctypes.c_char_p,
+                                 ctypes.POINTER(ctypes.c_double)]),
+        'dunescape_randomize': (ctypes.c_int, [c_field, ctypes.c_int,
+                                               ctypes.c_int,
+                                               ctypes.c_uint32]),
+        'dunescape_set_heights': (ctypes.c_int, [c_field, ctypes.c_void_p,
+                                                 ctypes.c_int64,
+                                                 ctypes.c_int64]),
+        'dunescape_run': (ctypes.c_int, [c_field, ctypes.c_int,
+                                         ctypes.POINTER(ctypes.c_uint64)]),
+        'dunescape_heights': (None, [c_field, ctypes.POINTER(_Buffer)]),
+        'dunescape_shadow': (None, [c_field, ctypes.POINTER(_Buffer)]),
+        'dunescape_summarize': (None, [c_field, ctypes.POINTER(Summary)]),
+        'dunescape_save_checkpoint': (ctypes.c_int, [c_field,
+                                                     ctypes.c_char_p]),
+        'dunescape_load_checkpoint': (ctypes.c_int, [c_field,
+                                                     ctypes.c_char_p]),
+    }
+
+    for name, (restype, argtypes) in signatures.items():
+        fct = getattr(lib, name)
+        fct.restype = restype
+        fct.argtypes = argtypes
+
+    if lib.dunescape_api_version() != API_VERSION:
+        raise OSError('libdunescape_c API version %d, %d expected'
+                      % (lib.dunescape_api_version(), API_VERSION))
+    return lib
+
+
+_lib = _declare(_load_library())
+
+# buffer protocol format of the unsigned integers, by size
+_FORMATS = {1: 'B', 2: 'H', 4: 'I', 8: 'Q'}
+
+
+def set_threads(n_threads):
+    """Set the number of OpenMP threads, 0 for all."""
+    _lib.dunescape_set_threads(n_threads)
+
+
+def height_size():
+    """Return the size in bytes of a sand height."""
+    return _lib.dunescape_height_size()
+
+
+class Field:
+    """Dune field, `ni` cells along the wind direction and `nj` across.
+
+    The model parameters (see PARAMETERS) are attributes. `storage` is a
+    directory to memory-map the field from, for fields larger than the
+    RAM.
+    """
+
+    def __init__(self, ni, nj, storage=None):
+        self._n_borrowed = 0
+        self._closed = False
+        self._handle = _lib.dunescape_create(
+            ni, nj, storage.encode() if storage else None)
+        if not self._handle:
+            raise MemoryError('cannot create a (%d, %d) field' % (ni, nj))
+
+    def close(self):
+        """Destroy the field, once the views borrowed are released."""
+        self._closed = True
+        if self._handle and not self._n_borrowed:
+            _lib.dunescape_destroy(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __getattr__(self, name):
+        if name in PARAMETERS:
+            value = ctypes.c_double()
+            _lib.dunescape_get_param(self._handle, name.encode(),
+                                     ctypes.byref(value))
+            return value.value
+        raise AttributeError(name)
+
+    def __setattr__(self, name, value):
+        if name in PARAMETERS:
+            if not _lib.dunescape_set_param(self._handle, name.encode(),
+                                            float(value)):
+                raise ValueError('invalid %s: %s' % (name, value))
+        else:
+            object.__setattr__(self, name, value)
+
+    @property
+    def shape(self):
+        """Shape (ni, nj)."""
+        return self._borrow(_lib.dunescape_heights)[1]
+
+    def randomize(self, a, b, seed=1):
+        """Fill the sand height with white noise, uniform in [a, b]."""
+        if not _lib.dunescape_randomize(self._handle, a, b, seed):
+            raise MemoryError('cannot randomize the field')
+
+    def set_heights(self, heights):
+        """Set the sand height from a (ni, nj) buffer (e.g. a NumPy
+        array) of unsigned integers of `height_size()` bytes."""
+        view = memoryview(heights)
+
+        if view.ndim != 2 or view.shape != self.shape:
+            raise ValueError('(ni, nj) = %s buffer expected' % (self.shape,))
+        if view.itemsize != height_size():
+            raise ValueError('%d byte heights expected' % height_size())
+
+        # ctypes only takes the address of writable C-contiguous buffers,
+        # the other ones are copied first
+        if view.readonly or not view.c_contiguous:
+            view = memoryview(bytearray(view.tobytes())).cast(
+                view.format, view.shape)
+        strides = view.strides
+
+        data = (ctypes.c_char * view.nbytes).from_buffer(view)
+        if not _lib.dunescape_set_heights(self._handle,
+                                          ctypes.addressof(data),
+                                          strides[0], strides[1]):
+            raise MemoryError('cannot set the sand height')
+
+    def run(self, n_cycles=1):
+        """Run simulation cycles, return the number of slabs moved."""
+        n_moves = ctypes.c_uint64()
+        if not _lib.dunescape_run(self._handle, n_cycles,
+                                  ctypes.byref(n_moves)):
+            raise MemoryError('cannot run the field')
+        return n_moves.value
+
+    def summary(self):
+        """Return the summary of the sand height (Summary)."""
+        s = Summary()
+        _lib.dunescape_summarize(self._handle, ctypes.byref(s))
+        return s
+
+    def save_checkpoint(self, fname):
+        if not _lib.dunescape_save_checkpoint(self._handle, fname.encode()):
+            raise IOError('cannot save %s' % fname)
+
+    def load_checkpoint(self, fname):
+        """Restore the field, the views borrowed are then invalid."""
+        if not _lib.dunescape_load_checkpoint(self._handle, fname.encode()):
+            raise IOError('cannot load %s' % fname)
+
+    def heights(self):
+        """Return a read-only memoryview of the sand height, in memory
+        order: (nj, ni) for the default column-major layout, (ni, nj) for
+        a row-major one."""
+        return self._view(_lib.dunescape_heights)
+
+    def shadow_words(self):
+        """Return a read-only memoryview of the shadow, 64 bit words of
+        shape ((ni + 63) // 64, nj) in memory order, i.e. (nj, (ni + 63)
+        // 64): cell (i, j) is in the shadow if bit i % 64 of word
+        [j][i // 64] is set."""
+        return self._view(_lib.dunescape_shadow)
+
+    def heights_array(self):
+        """Return the sand height as a read-only (ni, nj) NumPy array,
+        viewing the memory of the field."""
+        import numpy
+
+        view, shape, strides = self._borrow(_lib.dunescape_heights)
+        return numpy.ndarray(shape, dtype=view.format, buffer=view,
+                             strides=strides)
+
+    def shadow_array(self):
+        """Return the shadow as a (ni, nj) NumPy array of booleans (copy,
+        the shadow being bit-packed)."""
+        import numpy
+
+        ni, nj = self.shape
+        words = numpy.asarray(self.shadow_words())
+        bits = numpy.unpackbits(words.view(numpy.uint8), axis=1,
+                                bitorder='little')
+        return bits[:, :ni].T.astype(bool)
+
+    def _borrow(self, getter):
+        # memory of a borrowed buffer, as a flat view of its whole span,
+        # along with its shape and strides
+        b = _Buffer()
+        getter(self._handle, ctypes.byref(b))
+
+        shape = tuple(b.shape)
+        strides = tuple(b.strides)
+        span = (shape[0] - 1) * strides[0] + (shape[1] - 1) * strides[1] + \
+            b.itemsize if shape[0] and shape[1] else 0
+
+        # the field outlives the views, a close() in the meantime being
+        # completed by the release of the last one
+        array = (ctypes.c_char * span).from_address(b.data)
+        self._n_borrowed += 1
+        weakref.finalize(array, self._release)
+
+        view = memoryview(array).cast('B').cast(_FORMATS[b.itemsize])
+        return view.toreadonly(), shape, strides
+
+    def _release(self):
+        self._n_borrowed -= 1
+        if self._closed:
+            self.close()
+
+    def _view(self, getter):
+        view, shape, strides = self._borrow(getter)
+        if strides[0] < strides[1]:
+            shape = shape[::-1]
+        return view.cast('B').cast(view.format, shape)
@@ -0,0 +1,535 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "macrologger.h"
+
+#include "core/array.hpp"
+#include "core/dunefield.hpp"
+#include "core/export.hpp"
+#include "core/kmc.hpp"
+#include "core/shadow_kernels.hpp"
+
+struct BenchOptions
+{
+  std::vector<int> sizes = {128, 256, 512, 1024, 2048, 4096};
+  std::vector<int> sand_heights = {4, 16};
+  std::vector<int> layouts = {dunescape::LAYOUT_ROW_MAJOR,
+                              dunescape::LAYOUT_COLUMN_MAJOR};
+  double           min_time = 0.5;
+  int              threads = 0;
+  std::string      simd = "";
+  std::string      json = "";
+  std::string      png = "bench_output.png";
+  std::string      storage = "";
+};
+
+struct BenchResult
+{
+  std::string kernel;
+  int         n;
+  int         h0;
+  std::string layout;
+  long        iterations = 0;
+  double      seconds = 0.;
+  double      cells = 0.; // total number of cells processed
+  double      slabs = 0.; // total number of slabs moved
+};
+
+// amount of work done by one call of a kernel
+struct Work
+{
+  double cells;
+  double slabs;
+};
+
+static std::vector<int> parse_list(const char *str)
+{
+  std::vector<int>  list;
+  std::stringstream ss(str);
+  std::string       item;
+
+  while (std::getline(ss, item, ','))
+    list.push_back(std::atoi(item.c_str()));
+  return list;
+}
+
+static const char *layout_name(int layout)
+{
+  return layout == dunescape::LAYOUT_ROW_MAJOR ? "row" : "column";
+}
+
+static std::vector<int> parse_layouts(const char *str)
+{
+  std::vector<int>  list;
+  std::stringstream ss(str);
+  std::string       item;
+
+  while (std::getline(ss, item, ','))
+    if (item == "row")
+      list.push_back(dunescape::LAYOUT_ROW_MAJOR);
+    else if (item == "column")
+      list.push_back(dunescape::LAYOUT_COLUMN_MAJOR);
+    else
+      LOG_ERROR("unknown layout %s", item.c_str());
+  return list;
+}
+
+static void print_usage(const char *exe)
+{
+  std::cout
+      << "Usage: " << exe << " [options]\n"
+      << "\n"
+      << "Options:\n"
+      << "  --sizes N,N,...          Square grid sizes "
+         "(128,256,512,1024,2048,4096)\n"
+      << "  --sand-heights N,N,...   Initial sand heights (4,16)\n"
+      << "  --layouts L,L,...        Height array layouts, row and/or "
+         "column (row,column)\n"
+      << "  --min-time X             Minimum timing duration per kernel, "
+         "in seconds (0.5)\n"
+      << "  --threads N              Number of OpenMP threads, 0 for all (0)\n"
+      << "  --simd LEVEL             Instruction set of the shadow kernels,\n"
+      << "                           scalar, avx2 or avx512 (best available)\n"
+      << "  --json FILE              Write the results to a JSON file\n"
+      << "  --png FILE               Temporary file used by the export "
+         "benchmarks (bench_output.png)\n"
+      << "  --storage DIR            Also time the cycle with the field\n"
+      << "                           memory-mapped from files in DIR\n"
+      << "  --help                   Show this message\n";
+}
+
+static bool parse_args(int argc, char **argv, BenchOptions &opt)
+{
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+
+    if (arg == "--help" or arg == "-h")
+    {
+      print_usage(argv[0]);
+      std::exit(0);
+    }
+
+    if (k + 1 >= argc)
+    {
+      LOG_ERROR("missing value for option %s", arg.c_str());
+      return false;
+    }
+    const char *value = argv[++k];
+
+    if (arg == "--sizes")
+      opt.sizes = parse_list(value);
+    else if (arg == "--sand-heights")
+      opt.sand_heights = parse_list(value);
+    else if (arg == "--layouts")
+      opt.layouts = parse_layouts(value);
+    else if (arg == "--min-time")
+      opt.min_time = std::atof(value);
+    else if (arg == "--threads")
+      opt.threads = std::atoi(value);
+    else if (arg == "--simd")
+      opt.simd = value;
+    else if (arg == "--json")
+      opt.json = value;
+    else if (arg == "--png")
+      opt.png = value;
+    else if (arg == "--storage")
+      opt.storage = value;
+    else
+    {
+      LOG_ERROR("unknown option %s", arg.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// call 'fn' repeatedly for at least 'min_time' seconds (and at least once)
+template <typename F>
+BenchResult time_kernel(const std::string &kernel,
+                        int                n,
+                        int                h0,
+                        double             min_time,
+                        F                  fn)
+{
+  BenchResult r;
+  r.kernel = kernel;
+  r.n = n;
+  r.h0 = h0;
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  while (r.iterations == 0 or r.seconds < min_time)
+  {
+    Work w = fn();
+    r.cells += w.cells;
+    r.slabs += w.slabs;
+    r.iterations++;
+
+    auto t1 = std::chrono::steady_clock::now();
+    r.seconds = std::chrono::duration<double>(t1 - t0).count();
+  }
+  return r;
+}
+
+static void print_result(const BenchResult &r)
+{
+  std::printf("%-24s %6d %4d %7s %8ld %12.4g %12.4g %10.3f\n",
+              r.kernel.c_str(),
+              r.n,
+              r.h0,
+              r.layout.c_str(),
+              r.iterations,
+              r.cells / r.seconds,
+              r.slabs / r.seconds,
+              1e9 * r.seconds / r.cells);
+  std::fflush(stdout);
+}
+
+static void write_json(const std::string              &fname,
+                       const std::vector<BenchResult> &results,
+                       int                             threads,
+                       const char                     *simd)
+{
+  std::ofstream f(fname);
+
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  f << "{\n";
+  f << "  \"threads\": " << threads << ",\n";
+  f << "  \"simd\": \"" << simd << "\",\n";
+  f << "  \"results\": [\n";
+  for (size_t k = 0; k < results.size(); k++)
+  {
+    const BenchResult &r = results[k];
+    f << "    {\"kernel\": \"" << r.kernel << "\", ";
+    f << "\"shape\": [" << r.n << ", " << r.n << "], ";
+    f << "\"sand_height\": " << r.h0 << ", ";
+    f << "\"layout\": \"" << r.layout << "\", ";
+    f << "\"iterations\": " << r.iterations << ", ";
+    f << "\"seconds\": " << r.seconds << ", ";
+    f << "\"cells_per_s\": " << r.cells / r.seconds << ", ";
+    f << "\"slabs_per_s\": " << r.slabs / r.seconds << ", ";
+    f << "\"ns_per_cell\": " << 1e9 * r.seconds / r.cells << "}";
+    f << (k + 1 < results.size() ? ",\n" : "\n");
+  }
+  f << "  ]\n";
+  f << "}\n";
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions opt;
+
+  if (!parse_args(argc, argv, opt))
+  {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (opt.threads > 0)
+    omp_set_num_threads(opt.threads);
+
+  if (!opt.simd.empty())
+  {
+    dunescape::SimdLevel level = dunescape::SIMD_SCALAR;
+
+    if (opt.simd == "avx2")
+      level = dunescape::SIMD_AVX2;
+    else if (opt.simd == "avx512")
+      level = dunescape::SIMD_AVX512;
+    else if (opt.simd != "scalar")
+    {
+      LOG_ERROR("unknown SIMD level %s", opt.simd.c_str());
+      return 1;
+    }
+
+    if (dunescape::set_simd_level(level) != level)
+      LOG_ERROR("SIMD level %s not supported by this CPU, using %s",
+                opt.simd.c_str(),
+                dunescape::simd_level_name(dunescape::simd_level()));
+  }
+
+  LOG_INFO("threads: %d, shadow kernels: %s",
+           omp_get_max_threads(),
+           dunescape::simd_level_name(dunescape::simd_level()));
+
+  std::vector<BenchResult> results;
+
+  std::printf("%-24s %6s %4s %7s %8s %12s %12s %10s\n",
+              "kernel",
+              "size",
+              "h0",
+              "layout",
+              "iters",
+              "cells/s",
+              "slabs/s",
+              "ns/cell");
+
+  for (int n : opt.sizes)
+    for (int h0 : opt.sand_heights)
+      for (int layout : opt.layouts)
+      {
+        const double ncells = (double)n * (double)n;
+        const int    nbatch = 4096; // number of calls for the local kernels
+
+        dunescape::DuneField df = dunescape::DuneField(
+            {n, n},
+            (dunescape::Layout)layout);
+        df.h.randomize(0, h0, 1);
+        df.update_shadow();
+
+        // random cells for the local kernels
+        std::mt19937                       gen(1);
+        std::uniform_int_distribution<int> dis(0, n - 1);
+        std::vector<int>                   ic(nbatch), jc(nbatch);
+        for (int k = 0; k < nbatch; k++)
+        {
+          ic[k] = dis(gen);
+          jc[k] = dis(gen);
+        }
+
+        std::vector<BenchResult> rs;
+
+        rs.push_back(time_kernel("update_shadow",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   df.update_shadow();
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("update_shadow(i, j)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   for (int k = 0; k < nbatch; k++)
+                                     df.update_shadow(ic[k], jc[k]);
+                                   return Work{(double)nbatch, 0.};
+                                 }));
+
+        // deposit then erode to leave the field (nearly) unchanged
+        rs.push_back(time_kernel("depose_at",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   double ncalls = nbatch;
+
+                                   for (int k = 0; k < nbatch; k++)
+                                     df.depose_at(ic[k], jc[k], 1);
+
+                                   for (int k = nbatch - 1; k > -1; k--)
+                                     if (df.h(ic[k], jc[k]) > 0)
+                                     {
+                                       df.depose_at(ic[k], jc[k], -1);
+                                       ncalls++;
+                                     }
+                                   return Work{ncalls, ncalls};
+                                 }));
+
+        rs.push_back(time_kernel("cycle",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   double slabs = (double)df.cycle();
+                                   return Work{ncells, slabs};
+                                 }));
+
+        // full avalanche relaxation, from an already relaxed field
+        dunescape::DuneField df_relax = df;
+        df_relax.relax_avalanches = true;
+        df_relax.queue_relaxation();
+        df_relax.relax();
+
+        rs.push_back(time_kernel("cycle(relax)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   double slabs = (double)df_relax.cycle();
+                                   return Work{ncells, slabs};
+                                 }));
+
+        // open boundaries, with a sand supply balancing the outflow
+        dunescape::DuneField df_open = df;
+        df_open.boundary = dunescape::BOUNDARY_OPEN;
+        df_open.sand_inflow = 0.1f;
+        df_open.update_shadow();
+
+        rs.push_back(time_kernel("cycle(open)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   double slabs = (double)df_open.cycle();
+                                   return Work{ncells, slabs};
+                                 }));
+
+        // event-driven engine, one unit of time per call
+        dunescape::DuneField         df_kmc = df;
+        dunescape::KineticMonteCarlo kmc(df_kmc);
+
+        rs.push_back(time_kernel("cycle(kmc)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   double slabs = (double)kmc.run(1.);
+                                   return Work{ncells, slabs};
+                                 }));
+
+        // out-of-core storage, same field memory-mapped
+        if (!opt.storage.empty())
+        {
+          dunescape::DuneField df_mapped = dunescape::DuneField(
+              {n, n},
+              (dunescape::Layout)layout,
+              opt.storage);
+          df_mapped.h = df.h;
+          df_mapped.update_shadow();
+
+          rs.push_back(time_kernel("cycle(mapped)",
+                                   n,
+                                   h0,
+                                   opt.min_time,
+                                   [&]()
+                                   {
+                                     double slabs =
+                                         (double)df_mapped.cycle();
+                                     return Work{ncells, slabs};
+                                   }));
+        }
+
+        rs.push_back(time_kernel("to_img_8bit_grayscale",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   volatile uint8_t c =
+                                       df.h.to_img_8bit_grayscale()[0];
+                                   (void)c;
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("to_img_8bit_nipy",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   volatile uint8_t c =
+                                       df.h.to_img_8bit_nipy()[0];
+                                   (void)c;
+                                   return Work{ncells, 0.};
+                                 }));
+
+        std::vector<uint8_t>   img;
+        dunescape::ColormapLut lut;
+
+        rs.push_back(time_kernel("to_img_8bit(grayscale)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   df.h.to_img_8bit(img,
+                                                    dunescape::CMAP_GRAYSCALE,
+                                                    lut);
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("to_img_8bit(nipy)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   df.h.to_img_8bit(
+                                       img,
+                                       dunescape::CMAP_NIPY_SPECTRAL,
+                                       lut);
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("to_png",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   df.h.to_png(opt.png);
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("export(png16)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   dunescape::export_heightmap(
+                                       df.h,
+                                       opt.png,
+                                       dunescape::EXPORT_PNG_16BIT);
+                                   return Work{ncells, 0.};
+                                 }));
+
+        rs.push_back(time_kernel("export(raw float32)",
+                                 n,
+                                 h0,
+                                 opt.min_time,
+                                 [&]()
+                                 {
+                                   dunescape::export_heightmap(
+                                       df.h,
+                                       opt.png,
+                                       dunescape::EXPORT_RAW_FLOAT32);
+                                   return Work{ncells, 0.};
+                                 }));
+        std::remove(opt.png.c_str());
+
+        for (auto &r : rs)
+        {
+          r.layout = layout_name(layout);
+          print_result(r);
+          results.push_back(r);
+        }
+      }
+
+  if (!opt.json.empty())
+    write_json(opt.json,
+               results,
+               omp_get_max_threads(),
+               dunescape::simd_level_name(dunescape::simd_level()));
+
+  return 0;
+}
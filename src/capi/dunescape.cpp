@@ -0,0 +1,268 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <string>
+
+#include <omp.h>
+
+#include "macrologger.h"
+
+#include "dunescape.h"
+
+#include "core/checkpoint.hpp"
+#include "core/dunefield.hpp"
+
+using dunescape::DuneField;
+
+// the handle is the field itself
+struct dunescape_field
+{
+  DuneField df;
+};
+
+// the field has been modified from the outside
+static void reset_field(DuneField &df)
+{
+  df.update_shadow();
+  df.modified_columns.assign(df.shape[1], 1);
+  if (df.relax_avalanches)
+    df.queue_relaxation();
+}
+
+// run the body of an entry point, no exception is to cross the C
+// interface (a memory-mapped storage or a relaxation worklist failing to
+// be allocated throws std::bad_alloc)
+template <typename F> static bool guarded(const char *fct_name, F body)
+{
+  try
+  {
+    body();
+    return true;
+  }
+  catch (const std::bad_alloc &)
+  {
+    LOG_ERROR("%s: out of memory", fct_name);
+  }
+  catch (const std::exception &e)
+  {
+    LOG_ERROR("%s: %s", fct_name, e.what());
+  }
+  return false;
+}
+
+int dunescape_api_version(void)
+{
+  return DUNESCAPE_API_VERSION;
+}
+
+int dunescape_height_size(void)
+{
+  return (int)sizeof(dunescape::Height);
+}
+
+void dunescape_set_threads(int n_threads)
+{
+  omp_set_num_threads(n_threads > 0 ? n_threads : omp_get_num_procs());
+}
+
+dunescape_field *dunescape_create(int ni, int nj, const char *storage)
+{
+  if (ni < 1 or nj < 1)
+  {
+    LOG_ERROR("invalid shape {%d, %d}", ni, nj);
+    return nullptr;
+  }
+
+  dunescape_field *f = nullptr;
+
+  if (!guarded(__func__,
+               [&]()
+               {
+                 f = new dunescape_field{
+                     DuneField({ni, nj},
+                               dunescape::LAYOUT_COLUMN_MAJOR,
+                               storage ? storage : "")};
+               }))
+    LOG_ERROR("cannot allocate a {%d, %d} field", ni, nj);
+  return f;
+}
+
+void dunescape_destroy(dunescape_field *df)
+{
+  delete df;
+}
+
+int dunescape_set_param(dunescape_field *f, const char *name, double value)
+{
+  DuneField &df = f->df;
+
+  if (std::strcmp(name, "shadow_slope") == 0)
+  {
+    df.shadow_slope = (float)value;
+    return guarded(__func__, [&]() { reset_field(df); }) ? 1 : 0;
+  }
+  else if (std::strcmp(name, "hop_length") == 0)
+    df.hop_length = std::max(1, (int)value);
+  else if (std::strcmp(name, "prob_deposit_bare") == 0)
+    df.prob_deposit_bare = (float)value;
+  else if (std::strcmp(name, "prob_deposit_sand") == 0)
+    df.prob_deposit_sand = (float)value;
+  else if (std::strcmp(name, "relax_avalanches") == 0)
+  {
+    df.relax_avalanches = value != 0.;
+    if (df.relax_avalanches)
+      return guarded(__func__, [&]() { df.queue_relaxation(); }) ? 1 : 0;
+  }
+  else if (std::strcmp(name, "boundary") == 0)
+  {
+    const int b = (int)value;
+
+    if (b < dunescape::BOUNDARY_PERIODIC or b > dunescape::BOUNDARY_WALLS)
+    {
+      LOG_ERROR("unknown boundary conditions %d", b);
+      return 0;
+    }
+    df.boundary = (dunescape::Boundary)b;
+    return guarded(__func__, [&]() { reset_field(df); }) ? 1 : 0;
+  }
+  else if (std::strcmp(name, "sand_inflow") == 0)
+    df.sand_inflow = (float)value;
+  else if (std::strcmp(name, "seed") == 0)
+    df.seed = (uint)value;
+  else
+  {
+    LOG_ERROR("unknown parameter %s", name);
+    return 0;
+  }
+
+  return 1;
+}
+
+int dunescape_get_param(const dunescape_field *f,
+                        const char            *name,
+                        double                *value)
+{
+  const DuneField &df = f->df;
+
+  if (std::strcmp(name, "shadow_slope") == 0)
+    *value = df.shadow_slope;
+  else if (std::strcmp(name, "hop_length") == 0)
+    *value = df.hop_length;
+  else if (std::strcmp(name, "prob_deposit_bare") == 0)
+    *value = df.prob_deposit_bare;
+  else if (std::strcmp(name, "prob_deposit_sand") == 0)
+    *value = df.prob_deposit_sand;
+  else if (std::strcmp(name, "relax_avalanches") == 0)
+    *value = df.relax_avalanches ? 1. : 0.;
+  else if (std::strcmp(name, "boundary") == 0)
+    *value = (int)df.boundary;
+  else if (std::strcmp(name, "sand_inflow") == 0)
+    *value = df.sand_inflow;
+  else if (std::strcmp(name, "seed") == 0)
+    *value = df.seed;
+  else
+  {
+    LOG_ERROR("unknown parameter %s", name);
+    return 0;
+  }
+
+  return 1;
+}
+
+int dunescape_randomize(dunescape_field *f, int a, int b, uint32_t seed)
+{
+  f->df.h.randomize(a, b, seed);
+  return guarded(__func__, [&]() { reset_field(f->df); }) ? 1 : 0;
+}
+
+int dunescape_set_heights(dunescape_field *f,
+                          const void      *data,
+                          int64_t          stride_i,
+                          int64_t          stride_j)
+{
+  DuneField  &df = f->df;
+  const char *p = (const char *)data;
+
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < df.shape[1]; j++)
+    for (int i = 0; i < df.shape[0]; i++)
+      std::memcpy(&df.h(i, j),
+                  p + i * stride_i + j * stride_j,
+                  sizeof(dunescape::Height));
+
+  return guarded(__func__, [&]() { reset_field(df); }) ? 1 : 0;
+}
+
+int dunescape_run(dunescape_field *f, int n_cycles, uint64_t *n_moves)
+{
+  uint64_t n = 0;
+
+  const bool ok = guarded(__func__,
+                          [&]()
+                          {
+                            for (int it = 0; it < n_cycles; it++)
+                              n += f->df.cycle();
+                          });
+
+  if (n_moves)
+    *n_moves = n;
+  return ok ? 1 : 0;
+}
+
+void dunescape_heights(const dunescape_field *f, dunescape_buffer *buffer)
+{
+  const dunescape::Array<dunescape::Height> &h = f->df.h;
+
+  buffer->data = h.vector.data();
+  buffer->shape[0] = h.shape[0];
+  buffer->shape[1] = h.shape[1];
+  buffer->strides[0] = (int64_t)(h.stride_i * sizeof(dunescape::Height));
+  buffer->strides[1] = (int64_t)(h.stride_j * sizeof(dunescape::Height));
+  buffer->itemsize = (int)sizeof(dunescape::Height);
+}
+
+void dunescape_shadow(const dunescape_field *f, dunescape_buffer *buffer)
+{
+  const dunescape::Mask &m = f->df.shadow;
+
+  buffer->data = m.words.data();
+  buffer->shape[0] = m.words_per_column;
+  buffer->shape[1] = m.shape[1];
+  buffer->strides[0] = (int64_t)sizeof(uint64_t);
+  buffer->strides[1] = (int64_t)(m.words_per_column * sizeof(uint64_t));
+  buffer->itemsize = (int)sizeof(uint64_t);
+}
+
+void dunescape_summarize(const dunescape_field *f,
+                         dunescape_summary     *summary)
+{
+  const dunescape::HeightSummary s = f->df.heights.summary();
+
+  summary->cycle_count = f->df.cycle_count;
+  summary->mass = s.mass;
+  summary->min = s.min;
+  summary->max = s.max;
+  summary->mean = s.mean;
+  summary->rms = s.rms;
+  summary->sandy_fraction = s.sandy_fraction;
+}
+
+int dunescape_save_checkpoint(const dunescape_field *f, const char *fname)
+{
+  bool ok = false;
+
+  guarded(__func__, [&]() { ok = dunescape::save_checkpoint(f->df, fname); });
+  return ok ? 1 : 0;
+}
+
+int dunescape_load_checkpoint(dunescape_field *f, const char *fname)
+{
+  bool ok = false;
+
+  guarded(__func__, [&]() { ok = dunescape::load_checkpoint(f->df, fname); });
+  return ok ? 1 : 0;
+}
@@ -0,0 +1,541 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+#include <unistd.h>
+
+#include "macrologger.h"
+
+#include "core/array.hpp"
+#include "core/checkpoint.hpp"
+#include "core/dunefield.hpp"
+#include "core/export.hpp"
+#include "core/frames.hpp"
+#include "core/import.hpp"
+#include "core/kmc.hpp"
+#include "core/multires.hpp"
+#include "core/stats.hpp"
+
+struct CliOptions
+{
+  int                     width = 512;
+  int                     height = 128;
+  int                     h0 = 4;
+  std::string             import = "";
+  std::string             import_format_name = "";
+  dunescape::ImportFormat import_format = dunescape::IMPORT_PNG;
+  float                   import_scale = 1.f;
+  float                   import_offset = 0.f;
+  uint                    seed = 1;
+  int                     hop_length = 1;
+  float                   prob_deposit_bare = 0.4f;
+  float                   prob_deposit_sand = 0.6f;
+  std::string             avalanches = "single";
+  std::string             boundary_name = "periodic";
+  dunescape::Boundary     boundary = dunescape::BOUNDARY_PERIODIC;
+  float                   sand_inflow = 0.f;
+  std::string             engine = "sweep";
+  int                     levels = 1;
+  std::vector<int>        level_cycles = {1000};
+  float                   stop_tolerance = 0.f;
+  int                     stop_window = 500;
+  int                     cycles = 1000;
+  int                     output_every = 0;
+  int                     threads = 0;
+  std::string             storage = "";
+  std::string             output = "dunefield";
+  int                     checkpoint_every = 0;
+  std::string             restart = "";
+  int                     frames_every = 0;
+  std::string             stats = "";
+  int                     stats_every = 1;
+  std::string             format = "png";
+  dunescape::ExportFormat export_format = dunescape::EXPORT_PNG_8BIT;
+};
+
+static void print_usage(const char *exe)
+{
+  std::cout
+      << "Usage: " << exe << " [options]\n"
+      << "\n"
+      << "Options:\n"
+      << "  --width N           Grid size along the wind direction (512)\n"
+      << "  --height N          Grid size across the wind direction (128)\n"
+      << "  --sand-height N     Initial sand height upper bound (4)\n"
+      << "  --import FILE       Initial sand height from a heightmap instead\n"
+      << "                      of white noise, the grid size is taken from\n"
+      << "                      PNG images\n"
+      << "  --import-format F   Heightmap format: png (8 or 16 bit), raw8,\n"
+      << "                      raw16 or raw (float32), raw files being\n"
+      << "                      --height rows of --width values, top row\n"
+      << "                      first (from the file extension, png or raw)\n"
+      << "  --import-scale X    Slabs per unit of the heightmap values (1)\n"
+      << "  --import-offset X   Heightmap value of the bare ground (0)\n"
+      << "  --seed N            Random seed number (1)\n"
+      << "  --hop-length N      Hop length (1)\n"
+      << "  --prob-bare X       Probability of deposit on bare ground (0.4)\n"
+      << "  --prob-sand X       Probability of deposit on sandy ground (0.6)\n"
+      << "  --avalanches MODE   Avalanches: single (one cell per slab) or\n"
+      << "                      relax (cascade down to the angle of repose)\n"
+      << "                      (single)\n"
+      << "  --boundary B        Boundary conditions: periodic, open (sand\n"
+      << "                      blown in upwind and out downwind) or walls\n"
+      << "                      (periodic)\n"
+      << "  --sand-inflow X     Slabs blown into each column per cycle, open\n"
+      << "                      boundaries (0)\n"
+      << "  --engine E          Simulation engine: sweep (cycles through\n"
+      << "                      every cell) or kmc (event-driven, only draws\n"
+      << "                      the active cells, faster on sparse fields)\n"
+      << "                      (sweep)\n"
+      << "  --cycles N          Number of simulation cycles (1000)\n"
+      << "  --levels N          Warm start the field at N - 1 coarser\n"
+      << "                      resolutions (halved at each level) before\n"
+      << "                      the simulation cycles, 1 for none (1)\n"
+      << "  --level-cycles N,N,...\n"
+      << "                      Cycles of each coarse level, coarsest first,\n"
+      << "                      the last value is repeated (1000)\n"
+      << "  --stop-tolerance X  Stop before --cycles once the run has reached\n"
+      << "                      a steady state: slab flux, roughness and mean\n"
+      << "                      height averaged over the last window within X\n"
+      << "                      (relative) of the window before, 0 to always\n"
+      << "                      run all the cycles (0)\n"
+      << "  --stop-window N     Cycles per window, steady state detection\n"
+      << "                      (500)\n"
+      << "  --output-every N    Output cadence in cycles, 0 for the final\n"
+      << "                      state only (0)\n"
+      << "  --output PREFIX     Output file prefix (dunefield)\n"
+      << "  --output-format F   Output format: png (8 bit, normalized),\n"
+      << "                      png16 (16 bit, slab counts) or raw (float32\n"
+      << "                      slab counts) (png)\n"
+      << "  --threads N         Number of OpenMP threads, 0 for all (0)\n"
+      << "  --storage DIR       Keep the field in files memory-mapped from\n"
+      << "                      DIR, paged in and out of the RAM as the\n"
+      << "                      cycles sweep through it, for fields larger\n"
+      << "                      than the RAM (none, in RAM)\n"
+      << "  --checkpoint-every N\n"
+      << "                      Checkpoint cadence in cycles, written to\n"
+      << "                      PREFIX.ckpt in the background, 0 for none (0)\n"
+      << "  --restart FILE      Resume from a checkpoint, the grid and\n"
+      << "                      model options are then ignored\n"
+      << "  --frames-every N    Time series cadence in cycles, the frames\n"
+      << "                      are appended to PREFIX.frames, 0 for none (0)\n"
+      << "  --stats FILE        Stream the solver statistics (slabs moved,\n"
+      << "                      avalanches, hops, phase timings) to a CSV\n"
+      << "                      file, or JSON Lines for a .json file name\n"
+      << "                      (requires a DUNESCAPE_STATS build)\n"
+      << "  --stats-every N     Cycles gathered in each statistics record (1)\n"
+      << "  --help              Show this message\n";
+}
+
+static std::vector<int> parse_list(const char *str)
+{
+  std::vector<int>  list;
+  std::stringstream ss(str);
+  std::string       item;
+
+  while (std::getline(ss, item, ','))
+    list.push_back(std::atoi(item.c_str()));
+  return list;
+}
+
+static bool parse_args(int argc, char **argv, CliOptions &opt)
+{
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+
+    if (arg == "--help" or arg == "-h")
+    {
+      print_usage(argv[0]);
+      std::exit(0);
+    }
+
+    if (k + 1 >= argc)
+    {
+      LOG_ERROR("missing value for option %s", arg.c_str());
+      return false;
+    }
+    const char *value = argv[++k];
+
+    if (arg == "--width")
+      opt.width = std::atoi(value);
+    else if (arg == "--height")
+      opt.height = std::atoi(value);
+    else if (arg == "--sand-height")
+      opt.h0 = std::atoi(value);
+    else if (arg == "--import")
+      opt.import = value;
+    else if (arg == "--import-format")
+      opt.import_format_name = value;
+    else if (arg == "--import-scale")
+      opt.import_scale = std::atof(value);
+    else if (arg == "--import-offset")
+      opt.import_offset = std::atof(value);
+    else if (arg == "--seed")
+      opt.seed = (uint)std::strtoul(value, nullptr, 10);
+    else if (arg == "--hop-length")
+      opt.hop_length = std::atoi(value);
+    else if (arg == "--prob-bare")
+      opt.prob_deposit_bare = (float)std::atof(value);
+    else if (arg == "--prob-sand")
+      opt.prob_deposit_sand = (float)std::atof(value);
+    else if (arg == "--avalanches")
+      opt.avalanches = value;
+    else if (arg == "--boundary")
+      opt.boundary_name = value;
+    else if (arg == "--engine")
+      opt.engine = value;
+    else if (arg == "--sand-inflow")
+      opt.sand_inflow = std::max(0.f, (float)std::atof(value));
+    else if (arg == "--cycles")
+      opt.cycles = std::atoi(value);
+    else if (arg == "--stop-tolerance")
+      opt.stop_tolerance = (float)std::atof(value);
+    else if (arg == "--stop-window")
+      opt.stop_window = std::max(1, std::atoi(value));
+    else if (arg == "--levels")
+      opt.levels = std::max(1, std::atoi(value));
+    else if (arg == "--level-cycles")
+      opt.level_cycles = parse_list(value);
+    else if (arg == "--output-every")
+      opt.output_every = std::atoi(value);
+    else if (arg == "--output")
+      opt.output = value;
+    else if (arg == "--output-format")
+      opt.format = value;
+    else if (arg == "--threads")
+      opt.threads = std::atoi(value);
+    else if (arg == "--storage")
+      opt.storage = value;
+    else if (arg == "--checkpoint-every")
+      opt.checkpoint_every = std::atoi(value);
+    else if (arg == "--restart")
+      opt.restart = value;
+    else if (arg == "--frames-every")
+      opt.frames_every = std::atoi(value);
+    else if (arg == "--stats")
+      opt.stats = value;
+    else if (arg == "--stats-every")
+      opt.stats_every = std::max(1, std::atoi(value));
+    else
+    {
+      LOG_ERROR("unknown option %s", arg.c_str());
+      return false;
+    }
+  }
+
+  // heightmap format from the file extension by default, the grid size
+  // being the one of the image for PNG files
+  if (!opt.import.empty())
+  {
+    if (opt.import_format_name.empty())
+      opt.import_format_name =
+          opt.import.size() > 4 and
+                  opt.import.compare(opt.import.size() - 4, 4, ".png") == 0
+              ? "png"
+              : "raw";
+
+    if (!dunescape::import_format_from_name(opt.import_format_name,
+                                            opt.import_format))
+    {
+      LOG_ERROR("unknown import format %s", opt.import_format_name.c_str());
+      return false;
+    }
+
+    if (!opt.restart.empty())
+    {
+      LOG_ERROR("--import and --restart are exclusive");
+      return false;
+    }
+
+    if (opt.import_format == dunescape::IMPORT_PNG)
+    {
+      dunescape::Shape shape;
+
+      if (!dunescape::read_png_shape(opt.import, shape))
+        return false;
+      opt.width = shape[0];
+      opt.height = shape[1];
+    }
+  }
+
+  if (opt.width < 1 or opt.height < 1 or opt.cycles < 0 or opt.h0 < 0)
+  {
+    LOG_ERROR("invalid grid size, sand height or number of cycles");
+    return false;
+  }
+  opt.hop_length = std::max(1, opt.hop_length);
+
+  if (opt.avalanches != "single" and opt.avalanches != "relax")
+  {
+    LOG_ERROR("unknown avalanche mode %s", opt.avalanches.c_str());
+    return false;
+  }
+
+  if (opt.engine != "sweep" and opt.engine != "kmc")
+  {
+    LOG_ERROR("unknown engine %s", opt.engine.c_str());
+    return false;
+  }
+
+  if (!opt.storage.empty() and access(opt.storage.c_str(), W_OK) != 0)
+  {
+    LOG_ERROR("storage directory %s is not writable", opt.storage.c_str());
+    return false;
+  }
+
+  if (!dunescape::boundary_from_name(opt.boundary_name, opt.boundary))
+  {
+    LOG_ERROR("unknown boundary conditions %s", opt.boundary_name.c_str());
+    return false;
+  }
+
+  if (!opt.stats.empty() and !STATS_ENABLED)
+  {
+    LOG_ERROR("--stats requires a build with -DDUNESCAPE_STATS=ON");
+    return false;
+  }
+
+  if (opt.format == "png")
+    opt.export_format = dunescape::EXPORT_PNG_8BIT;
+  else if (opt.format == "png16")
+    opt.export_format = dunescape::EXPORT_PNG_16BIT;
+  else if (opt.format == "raw")
+    opt.export_format = dunescape::EXPORT_RAW_FLOAT32;
+  else
+  {
+    LOG_ERROR("unknown output format %s", opt.format.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// the export runs in the background while the simulation goes on
+static void write_output(dunescape::DuneField    &df,
+                         const CliOptions        &opt,
+                         dunescape::ExportWriter &writer)
+{
+  char buffer[32];
+  std::snprintf(buffer,
+                sizeof(buffer),
+                "_%06llu%s",
+                (unsigned long long)df.cycle_count,
+                dunescape::export_extension(opt.export_format));
+  std::string fname = opt.output + buffer;
+
+  writer.save(df.h, fname, opt.export_format);
+  LOG_INFO("cycle %llu, saving %s",
+           (unsigned long long)df.cycle_count,
+           fname.c_str());
+}
+
+int main(int argc, char **argv)
+{
+  CliOptions opt;
+
+  if (!parse_args(argc, argv, opt))
+  {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (opt.threads > 0)
+    omp_set_num_threads(opt.threads);
+
+  // --- Initialize dune field (std::bad_alloc for a grid too large for
+  // the memory or the storage)
+  std::unique_ptr<dunescape::DuneField> field;
+
+  try
+  {
+    field.reset(new dunescape::DuneField({opt.width, opt.height},
+                                         dunescape::LAYOUT_COLUMN_MAJOR,
+                                         opt.storage));
+  }
+  catch (const std::bad_alloc &)
+  {
+    LOG_ERROR("cannot allocate a {%d, %d} field", opt.width, opt.height);
+    return 1;
+  }
+
+  dunescape::DuneField &df = *field;
+
+  if (!opt.restart.empty())
+  {
+    if (!dunescape::load_checkpoint(df, opt.restart))
+      return 1;
+    LOG_INFO("restarting from %s, cycle %llu",
+             opt.restart.c_str(),
+             (unsigned long long)df.cycle_count);
+  }
+  else
+  {
+    df.seed = opt.seed;
+    df.boundary = opt.boundary;
+    df.sand_inflow = opt.sand_inflow;
+    df.hop_length = opt.hop_length;
+    df.prob_deposit_bare = opt.prob_deposit_bare;
+    df.prob_deposit_sand = opt.prob_deposit_sand;
+    df.relax_avalanches = opt.avalanches == "relax";
+
+    if (opt.import.empty())
+      df.h.randomize(0, opt.h0, opt.seed);
+    else
+    {
+      if (!dunescape::import_heightmap(df.h,
+                                       opt.import,
+                                       opt.import_format,
+                                       opt.import_scale,
+                                       opt.import_offset))
+        return 1;
+      LOG_INFO("initial sand height from %s", opt.import.c_str());
+    }
+    df.update_shadow();
+
+    if (opt.levels > 1)
+    {
+      dunescape::MultiresSchedule schedule;
+      schedule.levels = opt.levels;
+      schedule.cycles = opt.level_cycles;
+
+      auto t0 = std::chrono::steady_clock::now();
+
+      dunescape::warm_start(
+          df,
+          schedule,
+          [&](const dunescape::DuneField &c, int level)
+          {
+            LOG_INFO("warm start level %d, shape: {%d, %d}, %d cycles",
+                     level,
+                     c.shape[0],
+                     c.shape[1],
+                     schedule.cycles_at(level));
+          });
+
+      LOG_INFO("warm start in %.3f s",
+               std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - t0)
+                   .count());
+    }
+    else if (df.relax_avalanches)
+      df.queue_relaxation(); // (done by the warm start otherwise)
+  }
+
+  // event-driven engine, one unit of time per cycle
+  std::unique_ptr<dunescape::KineticMonteCarlo> kmc;
+
+  if (opt.engine == "kmc")
+    kmc.reset(new dunescape::KineticMonteCarlo(df));
+
+  LOG_INFO("shape: {%d, %d}, boundary: %s, engine: %s, cycles: %d, "
+           "threads: %d",
+           df.shape[0],
+           df.shape[1],
+           dunescape::boundary_name(df.boundary),
+           opt.engine.c_str(),
+           opt.cycles,
+           omp_get_max_threads());
+
+  if (!opt.storage.empty())
+    LOG_INFO("storage: memory-mapped files in %s", opt.storage.c_str());
+
+  // --- Run
+  dunescape::ExportWriter     output;
+  dunescape::CheckpointWriter checkpoint;
+  const std::string           checkpoint_fname = opt.output + ".ckpt";
+
+  std::unique_ptr<dunescape::FrameWriter> frames;
+
+  if (opt.frames_every > 0)
+  {
+    frames.reset(new dunescape::FrameWriter(opt.output + ".frames",
+                                            df.shape,
+                                            df.h.layout));
+    if (!frames->is_open())
+      return 1;
+    frames->append(df.h, df.cycle_count);
+  }
+
+  std::unique_ptr<dunescape::StatsWriter> stats;
+
+  if (!opt.stats.empty())
+  {
+    stats.reset(new dunescape::StatsWriter(opt.stats));
+    if (!stats->is_open())
+      return 1;
+    df.stats.collect(); // initial shadow not accounted for
+  }
+
+  dunescape::ConvergenceDetector detector(opt.stop_window,
+                                          opt.stop_tolerance);
+  int                            n_cycles = 0;
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  for (int it = 0; it < opt.cycles; it++)
+  {
+    const uint64_t n_moves = kmc ? kmc->run(1.) : df.cycle();
+    n_cycles++;
+
+    if (stats and (it + 1) % opt.stats_every == 0)
+      stats->write(df.cycle_count, df.stats.collect());
+
+    if (opt.output_every > 0 and (it + 1) % opt.output_every == 0)
+      write_output(df, opt, output);
+
+    if (opt.checkpoint_every > 0 and (it + 1) % opt.checkpoint_every == 0)
+      checkpoint.save(df, checkpoint_fname);
+
+    if (frames and (it + 1) % opt.frames_every == 0)
+      frames->append(df.h, df.cycle_count);
+
+    if ((opt.stop_tolerance > 0.f) and
+        detector.update(n_moves, df.heights.summary()))
+    {
+      LOG_INFO("steady state at cycle %llu (residual %.2e)",
+               (unsigned long long)df.cycle_count,
+               detector.residual());
+      break;
+    }
+  }
+
+  if (!checkpoint.wait() or (frames and !frames->close()))
+    return 1;
+
+  auto   t1 = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(t1 - t0).count();
+
+  if (opt.output_every <= 0 or n_cycles == 0 or
+      n_cycles % opt.output_every != 0)
+    write_output(df, opt, output);
+
+  if (!output.wait())
+    return 1;
+
+  const dunescape::HeightSummary hs = df.heights.summary();
+
+  LOG_INFO("%d cycles in %.3f s (%.1f cycles/s)",
+           n_cycles,
+           elapsed,
+           elapsed > 0. ? n_cycles / elapsed : 0.);
+  LOG_INFO("%llu slabs, height: max %d, mean %.3f, rms %.3f, sand cover %.3f",
+           (unsigned long long)hs.mass,
+           hs.max,
+           hs.mean,
+           hs.rms,
+           hs.sandy_fraction);
+
+  return 0;
+}
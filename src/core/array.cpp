@@ -3,149 +3,249 @@
 // with this software.
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <random>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#define IMG_CHANNELS 3
-#include "stb_image_write.h"
+#define IMG_ROW_BLOCK 64 // image rows converted at once
 
 #include "core/array.hpp"
+#include "core/export.hpp"
 
 namespace dunescape
 {
 
-Array::Array(std::vector<int> shape) : shape(shape)
+template <typename T>
+Array<T>::Array(Shape                     shape,
+                Layout                    layout,
+                const MappedAllocator<T> &allocator)
+    : shape(shape), layout(layout), vector(allocator)
 {
-  this->vector.resize(this->shape[0] * this->shape[1]);
+  this->set_strides();
+  this->vector.resize((size_t)this->shape[0] * this->shape[1]);
 }
 
-void Array::infos() const
+template <typename T> void Array<T>::set_layout(Layout new_layout)
+{
+  if (new_layout == this->layout)
+    return;
+
+  Array<T> array = Array<T>(this->shape,
+                            new_layout,
+                            this->vector.get_allocator());
+
+  for (int i = 0; i < this->shape[0]; i++)
+    for (int j = 0; j < this->shape[1]; j++)
+      array(i, j) = (*this)(i, j);
+
+  *this = std::move(array);
+}
+
+template <typename T> void Array<T>::infos() const
 {
   std::cout << "Array:";
   std::cout << "address: " << this << ", ";
   std::cout << "shape: {" << this->shape[0] << ", " << this->shape[1] << "}"
             << ", ";
-  std::cout << "min: " << this->min() << ", ";
-  std::cout << "max: " << this->max();
+  std::cout << "min: " << (double)this->min() << ", ";
+  std::cout << "max: " << (double)this->max();
   std::cout << std::endl;
 }
 
-void Array::randomize(int a, int b, uint seed)
+template <typename T> void Array<T>::randomize(int a, int b, uint seed)
 {
   std::mt19937                       gen(seed);
   std::uniform_int_distribution<int> dis(a, b);
-  for (auto &v : this->vector)
-    v = dis(gen);
+  for (int i = 0; i < this->shape[0]; i++)
+    for (int j = 0; j < this->shape[1]; j++)
+      (*this)(i, j) = (T)dis(gen);
+}
+
+// table index of a value, integer values are used directly (unless
+// their range exceeds the direct tables)
+template <typename T>
+static inline typename std::enable_if<std::is_integral<T>::value, int>::type
+lut_index(const ColormapLut &lut, T v)
+{
+  if (!lut.direct)
+    return lut.index((float)v);
+  return std::max(0, std::min(lut.size - 1, (int)v));
+}
+
+template <typename T>
+static inline typename std::enable_if<!std::is_integral<T>::value, int>::type
+lut_index(const ColormapLut &lut, T v)
+{
+  return lut.index((float)v);
 }
 
-std::vector<uint8_t> Array::to_img_8bit_grayscale()
+// convert the image rows [r0, r1[ with a lookup table of 'NC' channels,
+// 'img' pointing to the output row 'r0'
+template <typename T, int NC>
+static void lut_block(const Array<T>     &array,
+                      const ColormapLut  &lut,
+                      int                 r0,
+                      int                 r1,
+                      uint8_t *__restrict img)
 {
-  std::vector<uint8_t> data(this->shape[0] * this->shape[1]);
-  const int            vmax = this->max();
+  const int      ni = array.shape[0];
+  const int      nj = array.shape[1];
+  const uint8_t *table = lut.table.data();
 
-  if (vmax > 0) // export a black image if not
+  for (int i = 0; i < ni; i++)
   {
-    // reorganize things to get an image with (i, j) used as (x, y)
-    // coordinates, i.e. with (0, 0) at the bottom left
-    float a = 1.f / (float)vmax;
-    int   k = 0;
+    const T *row = &array(i, 0);
 
-    for (int j = this->shape[1] - 1; j > -1; j--)
-      for (int i = 0; i < this->shape[0]; i++)
-      {
-        float   v = a * (float)(*this)(i, j);
-        uint8_t c = (uint8_t)std::floor(255 * v);
-        data[k++] = c;
-      }
+    for (int r = r0; r < r1; r++)
+    {
+      const uint8_t *c = table + NC * lut_index(lut, row[nj - 1 - r]);
+      uint8_t       *p = img + ((size_t)(r - r0) * ni + i) * NC;
+
+      for (int ch = 0; ch < NC; ch++)
+        p[ch] = c[ch];
+    }
   }
-  return data;
 }
 
-std::vector<uint8_t> Array::to_img_8bit_nipy()
+// same thing for a column-major array, the image rows are then the
+// (contiguous) columns of the array
+template <typename T, int NC>
+static void lut_block_column_major(const Array<T>     &array,
+                                   const ColormapLut  &lut,
+                                   int                 r0,
+                                   int                 r1,
+                                   uint8_t *__restrict img)
 {
-  std::vector<uint8_t> data(this->shape[0] * this->shape[1] * 3);
-  const int            vmax = this->max();
-
-  std::vector<std::vector<float>> colors = {
-      {0.000f, 0.000f, 0.000f},
-      {0.521f, 0.000f, 0.588f},
-      {0.000f, 0.000f, 0.794f},
-      {0.000f, 0.527f, 0.867f},
-      {0.000f, 0.667f, 0.630f},
-      {0.000f, 0.612f, 0.000f},
-      {0.000f, 0.855f, 0.000f},
-      {0.533f, 1.000f, 0.000f},
-      {0.970f, 0.861f, 0.000f},
-      {1.000f, 0.382f, 0.000f},
-      {0.855f, 0.000f, 0.000f},
-      {0.800f, 0.800f, 0.800f},
-  };
-  int nc = (int)colors.size();
-
-  if (vmax > 0) // export a black image if not
+  const int      ni = array.shape[0];
+  const int      nj = array.shape[1];
+  const uint8_t *table = lut.table.data();
+
+  for (int r = r0; r < r1; r++)
   {
-    float a = 1.f / (float)vmax;
-    int   k = -1;
+    const T *col = &array(0, nj - 1 - r);
+    uint8_t *p = img + (size_t)(r - r0) * ni * NC;
 
-    for (int j = this->shape[1] - 1; j > -1; j--)
-      for (int i = 0; i < this->shape[0]; i++)
-      {
-        std::vector<float> rgb(3);
-        float              v = a * (float)(*this)(i, j); // in [0, 1]
-        float              vc = v * (float)(nc - 1);     // in [0, nc - 1]
-        int                ic = (int)vc;
-
-        if (ic == nc - 1)
-          rgb = colors[nc - 1];
-        else
-        {
-          float t = vc - (float)ic;
-          for (int p = 0; p < 3; p++)
-            rgb[p] = (1.f - t) * colors[ic][p] + t * colors[ic + 1][p];
-        }
-
-        data[++k] = (uint8_t)std::floor(255 * rgb[0]);
-        data[++k] = (uint8_t)std::floor(255 * rgb[1]);
-        data[++k] = (uint8_t)std::floor(255 * rgb[2]);
-      }
+    for (int i = 0; i < ni; i++)
+    {
+      const uint8_t *c = table + NC * lut_index(lut, col[i]);
+
+      for (int ch = 0; ch < NC; ch++)
+        p[i * NC + ch] = c[ch];
+    }
   }
+}
+
+template <typename T>
+void Array<T>::to_img_8bit(std::vector<uint8_t> &img,
+                           Colormap              cmap,
+                           ColormapLut          &lut,
+                           float                 vmax) const
+{
+  const int ni = this->shape[0];
+  const int nj = this->shape[1];
+
+  if (vmax < 0.f)
+  {
+    T vm = this->vector.empty() ? (T)0 : this->vector[0];
+
+#pragma omp parallel for reduction(max : vm)
+    for (size_t k = 0; k < this->vector.size(); k++)
+      vm = std::max(vm, this->vector[k]);
+    vmax = (float)vm;
+  }
+
+  lut.update(cmap, vmax, std::is_integral<T>::value);
+
+  img.resize((size_t)ni * nj * lut.channels);
+  this->to_img_8bit_rows(img.data(), lut, 0, nj);
+}
+
+template <typename T>
+void Array<T>::to_img_8bit_rows(uint8_t           *img,
+                                const ColormapLut &lut,
+                                int                r0,
+                                int                r1) const
+{
+  const size_t row_size = (size_t)this->shape[0] * lut.channels;
+
+  // the image is the transposed array, (i, j) used as (x, y)
+  // coordinates with (0, 0) at the bottom left: work on blocks of image
+  // rows so that a row-major array is read along contiguous segments
+#pragma omp parallel for schedule(static)
+  for (int rb = r0; rb < r1; rb += IMG_ROW_BLOCK)
+  {
+    const int rb1 = std::min(r1, rb + IMG_ROW_BLOCK);
+    uint8_t  *p = img + (size_t)(rb - r0) * row_size;
+
+    if (this->layout == LAYOUT_COLUMN_MAJOR)
+    {
+      if (lut.channels == 1)
+        lut_block_column_major<T, 1>(*this, lut, rb, rb1, p);
+      else
+        lut_block_column_major<T, 3>(*this, lut, rb, rb1, p);
+    }
+    else if (lut.channels == 1)
+      lut_block<T, 1>(*this, lut, rb, rb1, p);
+    else
+      lut_block<T, 3>(*this, lut, rb, rb1, p);
+  }
+}
+
+template <typename T> std::vector<uint8_t> Array<T>::to_img_8bit_grayscale()
+{
+  std::vector<uint8_t> data;
+  ColormapLut          lut(CMAP_GRAYSCALE);
+
+  this->to_img_8bit(data, CMAP_GRAYSCALE, lut);
   return data;
 }
 
-void Array::to_png(std::string fname)
+template <typename T> std::vector<uint8_t> Array<T>::to_img_8bit_nipy()
 {
-  std::vector<uint8_t> data(IMG_CHANNELS * this->shape[0] * this->shape[1]);
-  const int            vmin = this->min();
-  const int            vmax = this->max();
+  std::vector<uint8_t> data;
+  ColormapLut          lut(CMAP_NIPY_SPECTRAL);
+
+  this->to_img_8bit(data, CMAP_NIPY_SPECTRAL, lut);
+  return data;
+}
+
+template <typename T> bool Array<T>::to_png(std::string fname) const
+{
+  const int            ni = this->shape[0];
+  const int            nj = this->shape[1];
+  std::vector<uint8_t> img((size_t)ni * nj, 0);
+  const T              vmin = this->min();
+  const T              vmax = this->max();
 
   if (vmin != vmax) // export a black image if not
   {
     // reorganize things to get an image with (i, j) used as (x, y)
     // coordinates, i.e. with (0, 0) at the bottom left
     float a = 1.f / (float)(vmax - vmin);
-    float b = vmin / (float)(vmax - vmin);
-    int   k = 0;
+    float b = -(float)vmin / (float)(vmax - vmin);
 
-    for (int j = this->shape[1] - 1; j > -1; j--)
-      for (int i = 0; i < this->shape[0]; i++)
+#pragma omp parallel for schedule(static)
+    for (int r = 0; r < nj; r++)
+    {
+      uint8_t *p = img.data() + (size_t)r * ni;
+      for (int i = 0; i < ni; i++)
       {
-        float   v = a * (float)(*this)(i, j) + b;
-        uint8_t c = (uint8_t)std::floor(255 * v);
-        data[k++] = c;
-        data[k++] = c;
-        data[k++] = c;
+        float v = a * (float)(*this)(i, nj - 1 - r) + b;
+        p[i] = (uint8_t)std::floor(255 * v);
       }
+    }
   }
 
-  // row and column are permutted
-  stbi_write_png(fname.c_str(),
-                 this->shape[0],
-                 this->shape[1],
-                 IMG_CHANNELS,
-                 data.data(),
-                 IMG_CHANNELS * this->shape[0]);
+  return write_png_gray(fname, ni, nj, 8, img.data());
 }
 
+// explicit instantiations
+template class Array<uint8_t>;
+template class Array<uint16_t>;
+template class Array<int>;
+template class Array<float>;
+
 } // namespace dunescape
@@ -0,0 +1,34 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include "core/boundary.hpp"
+
+namespace dunescape
+{
+
+constexpr int MooreDown::di[];
+constexpr int MooreDown::dj[];
+constexpr int MooreUp::di[];
+constexpr int MooreUp::dj[];
+constexpr int Moore::di[];
+constexpr int Moore::dj[];
+
+static const char *names[] = {"periodic", "open", "walls"};
+
+const char *boundary_name(Boundary b)
+{
+  return (b >= BOUNDARY_PERIODIC and b <= BOUNDARY_WALLS) ? names[b] : "";
+}
+
+bool boundary_from_name(const std::string &name, Boundary &b)
+{
+  for (int k = BOUNDARY_PERIODIC; k <= BOUNDARY_WALLS; k++)
+    if (name == names[k])
+    {
+      b = (Boundary)k;
+      return true;
+    }
+  return false;
+}
+
+} // namespace dunescape
@@ -0,0 +1,259 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macrologger.h"
+
+#include "core/checkpoint.hpp"
+
+namespace dunescape
+{
+
+static_assert(sizeof(CheckpointHeader) == 112,
+              "unexpected checkpoint header padding");
+
+static uint64_t align_offset(uint64_t offset)
+{
+  return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT *
+         CHECKPOINT_ALIGNMENT;
+}
+
+// copy the state of a dune field to a buffer with the layout of the file
+static void serialize(const DuneField &df, std::vector<char> &buffer)
+{
+  CheckpointHeader hd;
+  std::memset(&hd, 0, sizeof(hd));
+
+  const size_t h_size = df.h.vector.size() * sizeof(Height);
+  const size_t mask_size = df.shadow.words.size() * sizeof(uint64_t);
+
+  std::memcpy(hd.magic, CHECKPOINT_MAGIC, sizeof(hd.magic));
+  hd.version = CHECKPOINT_VERSION;
+  hd.header_size = sizeof(CheckpointHeader);
+  hd.shape[0] = df.shape[0];
+  hd.shape[1] = df.shape[1];
+  hd.layout = df.h.layout;
+  hd.height_size = sizeof(Height);
+  hd.shadow_slope = df.shadow_slope;
+  hd.hop_length = df.hop_length;
+  hd.prob_deposit_bare = df.prob_deposit_bare;
+  hd.prob_deposit_sand = df.prob_deposit_sand;
+  hd.seed = df.seed;
+  hd.boundary = df.boundary;
+  hd.sand_inflow = df.sand_inflow;
+  hd.relax_avalanches = df.relax_avalanches ? 1 : 0;
+  hd.words_per_column = df.shadow.words_per_column;
+  hd.cycle_count = df.cycle_count;
+  hd.h_offset = align_offset(sizeof(CheckpointHeader));
+  hd.shadow_offset = align_offset(hd.h_offset + h_size);
+  hd.active_offset = align_offset(hd.shadow_offset + mask_size);
+  hd.file_size = hd.active_offset + mask_size;
+
+  // no need to clear the whole buffer, only the padding
+  buffer.resize(hd.file_size);
+  std::memset(buffer.data(), 0, hd.h_offset);
+  std::memset(buffer.data() + hd.h_offset + h_size,
+              0,
+              hd.shadow_offset - hd.h_offset - h_size);
+  std::memset(buffer.data() + hd.shadow_offset + mask_size,
+              0,
+              hd.active_offset - hd.shadow_offset - mask_size);
+
+  std::memcpy(buffer.data(), &hd, sizeof(hd));
+  std::memcpy(buffer.data() + hd.h_offset, df.h.vector.data(), h_size);
+  std::memcpy(buffer.data() + hd.shadow_offset,
+              df.shadow.words.data(),
+              mask_size);
+  std::memcpy(buffer.data() + hd.active_offset,
+              df.active.words.data(),
+              mask_size);
+}
+
+// check that the sections are consistent with the shape and fit in the
+// file
+static bool sections_valid(const CheckpointHeader &hd, size_t file_size)
+{
+  if ((hd.shape[0] < 0) or (hd.shape[1] < 0) or
+      ((hd.layout != LAYOUT_ROW_MAJOR) and
+       (hd.layout != LAYOUT_COLUMN_MAJOR)) or
+      (hd.boundary < BOUNDARY_PERIODIC) or (hd.boundary > BOUNDARY_WALLS))
+    return false;
+
+  const uint64_t h_size = (uint64_t)hd.shape[0] * hd.shape[1] * sizeof(Height);
+  const uint64_t mask_size = (uint64_t)hd.shape[1] * hd.words_per_column *
+                             sizeof(uint64_t);
+
+  return (hd.file_size == file_size) and
+         (hd.words_per_column == (uint32_t)(hd.shape[0] + 63) / 64) and
+         (hd.h_offset >= sizeof(CheckpointHeader)) and
+         (hd.shadow_offset >= hd.h_offset + h_size) and
+         (hd.active_offset >= hd.shadow_offset + mask_size) and
+         (hd.file_size >= hd.active_offset + mask_size);
+}
+
+static bool write_file(const std::vector<char> &buffer,
+                       const std::string       &fname)
+{
+  const std::string tmp = fname + ".tmp";
+  FILE             *f = std::fopen(tmp.c_str(), "wb");
+
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", tmp.c_str());
+    return false;
+  }
+
+  bool ok = std::fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+  ok = (std::fclose(f) == 0) and ok;
+
+  if (!ok or std::rename(tmp.c_str(), fname.c_str()) != 0)
+  {
+    LOG_ERROR("cannot write %s", fname.c_str());
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+CheckpointView::CheckpointView(const std::string &fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) == 0) and
+      (st.st_size >= (off_t)sizeof(CheckpointHeader)))
+  {
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr != MAP_FAILED)
+    {
+      this->data = (const char *)ptr;
+      this->size = st.st_size;
+    }
+  }
+  close(fd); // the mapping remains valid
+
+  if (!this->data)
+  {
+    LOG_ERROR("%s is not a checkpoint file", fname.c_str());
+    return;
+  }
+
+  const CheckpointHeader &hd = this->header();
+
+  if (std::memcmp(hd.magic, CHECKPOINT_MAGIC, sizeof(hd.magic)) != 0)
+    LOG_ERROR("%s is not a checkpoint file", fname.c_str());
+  else if (hd.version != CHECKPOINT_VERSION or
+           hd.header_size != sizeof(CheckpointHeader))
+    LOG_ERROR("%s: unsupported checkpoint version %u",
+              fname.c_str(),
+              hd.version);
+  else if (hd.height_size != sizeof(Height))
+    LOG_ERROR("%s: height stored on %u bytes, %zu expected (see "
+              "DUNESCAPE_HEIGHT_TYPE)",
+              fname.c_str(),
+              hd.height_size,
+              sizeof(Height));
+  else if (!sections_valid(hd, this->size))
+    LOG_ERROR("%s: truncated or corrupted checkpoint", fname.c_str());
+  else
+    this->valid = true;
+}
+
+CheckpointView::~CheckpointView()
+{
+  if (this->data)
+    munmap((void *)this->data, this->size);
+}
+
+bool CheckpointView::restore(DuneField &df) const
+{
+  if (!this->valid)
+    return false;
+
+  const CheckpointHeader &hd = this->header();
+  const Shape             shape = {hd.shape[0], hd.shape[1]};
+
+  // (same storage as the current sand height)
+  df.h = Array<Height>(shape,
+                       (Layout)hd.layout,
+                       df.h.vector.get_allocator());
+  df.set_shape(shape);
+
+  std::memcpy(df.h.vector.data(),
+              this->h(),
+              df.h.vector.size() * sizeof(Height));
+  std::memcpy(df.shadow.words.data(),
+              this->shadow(),
+              df.shadow.words.size() * sizeof(uint64_t));
+  std::memcpy(df.active.words.data(),
+              this->active(),
+              df.active.words.size() * sizeof(uint64_t));
+
+  // (the shadow is restored as is, for the run to resume bit-exactly)
+  df.heights.reset(df.h);
+
+  df.shadow_slope = hd.shadow_slope;
+  df.hop_length = hd.hop_length;
+  df.prob_deposit_bare = hd.prob_deposit_bare;
+  df.prob_deposit_sand = hd.prob_deposit_sand;
+  df.seed = hd.seed;
+  df.boundary = (Boundary)hd.boundary;
+  df.sand_inflow = hd.sand_inflow;
+  df.relax_avalanches = hd.relax_avalanches != 0;
+  df.cycle_count = hd.cycle_count;
+
+  if (df.relax_avalanches)
+    df.queue_relaxation();
+
+  return true;
+}
+
+bool save_checkpoint(const DuneField &df, const std::string &fname)
+{
+  std::vector<char> buffer;
+
+  serialize(df, buffer);
+  return write_file(buffer, fname);
+}
+
+bool load_checkpoint(DuneField &df, const std::string &fname)
+{
+  CheckpointView view(fname);
+
+  return view.restore(df);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  this->wait();
+}
+
+void CheckpointWriter::save(const DuneField &df, const std::string &fname)
+{
+  this->wait();
+  serialize(df, this->buffer);
+
+  this->thread = std::thread(
+      [this, fname]() { this->success = write_file(this->buffer, fname); });
+}
+
+bool CheckpointWriter::wait()
+{
+  if (this->thread.joinable())
+    this->thread.join();
+  return this->success;
+}
+
+} // namespace dunescape
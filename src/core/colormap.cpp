@@ -0,0 +1,98 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <cmath>
+
+#include "core/colormap.hpp"
+
+namespace dunescape
+{
+
+// `nipy spectral` colormap
+static const int   NIPY_NC = 12;
+static const float NIPY_COLORS[NIPY_NC][3] = {
+    {0.000f, 0.000f, 0.000f},
+    {0.521f, 0.000f, 0.588f},
+    {0.000f, 0.000f, 0.794f},
+    {0.000f, 0.527f, 0.867f},
+    {0.000f, 0.667f, 0.630f},
+    {0.000f, 0.612f, 0.000f},
+    {0.000f, 0.855f, 0.000f},
+    {0.533f, 1.000f, 0.000f},
+    {0.970f, 0.861f, 0.000f},
+    {1.000f, 0.382f, 0.000f},
+    {0.855f, 0.000f, 0.000f},
+    {0.800f, 0.800f, 0.800f},
+};
+
+ColormapLut::ColormapLut(Colormap cmap) : cmap(cmap)
+{
+  this->channels = (cmap == CMAP_GRAYSCALE) ? 1 : 3;
+}
+
+void ColormapLut::update(Colormap new_cmap,
+                         float    new_vmax,
+                         bool     new_integer_values)
+{
+  if ((new_cmap == this->cmap) and (new_vmax == this->vmax) and
+      (new_integer_values == this->integer_values) and (this->size > 0))
+    return;
+
+  this->cmap = new_cmap;
+  this->channels = (new_cmap == CMAP_GRAYSCALE) ? 1 : 3;
+  this->vmax = new_vmax;
+  this->integer_values = new_integer_values;
+
+  this->direct = this->integer_values and
+                 (this->vmax < (float)COLORMAP_MAX_DIRECT);
+
+  if (this->direct)
+    this->size = std::max(1, (int)this->vmax + 1);
+  else
+    this->size = 256;
+
+  this->scale = this->vmax > 0.f ? (float)(this->size - 1) / this->vmax : 0.f;
+  this->table.resize(this->size * this->channels);
+
+  for (int k = 0; k < this->size; k++)
+  {
+    float v = this->direct ? (float)k
+                           : (float)k * this->vmax / (this->size - 1);
+    this->color(v, &this->table[k * this->channels]);
+  }
+}
+
+void ColormapLut::color(float v, uint8_t *rgb) const
+{
+  if (this->vmax <= 0.f) // black if not
+  {
+    for (int p = 0; p < this->channels; p++)
+      rgb[p] = 0;
+    return;
+  }
+
+  float a = 1.f / this->vmax;
+  float vn = a * v; // in [0, 1]
+
+  if (this->cmap == CMAP_GRAYSCALE)
+    rgb[0] = (uint8_t)std::floor(255 * vn);
+  else
+  {
+    float vc = vn * (float)(NIPY_NC - 1); // in [0, nc - 1]
+    int   ic = (int)vc;
+
+    if (ic >= NIPY_NC - 1)
+      for (int p = 0; p < 3; p++)
+        rgb[p] = (uint8_t)std::floor(255 * NIPY_COLORS[NIPY_NC - 1][p]);
+    else
+    {
+      float t = vc - (float)ic;
+      for (int p = 0; p < 3; p++)
+        rgb[p] = (uint8_t)std::floor(255 * ((1.f - t) * NIPY_COLORS[ic][p] +
+                                            t * NIPY_COLORS[ic + 1][p]));
+    }
+  }
+}
+
+} // namespace dunescape
@@ -0,0 +1,359 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstring>
+
+#include "macrologger.h"
+
+#include "core/distributed.hpp"
+#include "core/rng.hpp"
+
+namespace dunescape
+{
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+  while (b != 0)
+  {
+    uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// copy rows [r0, r0 + count[ of the local field to a buffer
+static void pack_rows(const DuneField   &f,
+                      int                r0,
+                      int                count,
+                      std::vector<char> &buf)
+{
+  const int nj = f.shape[1];
+
+  buf.resize((size_t)count * nj * sizeof(Height));
+  Height *p = (Height *)buf.data();
+
+  for (int j = 0; j < nj; j++)
+    for (int k = 0; k < count; k++)
+      *p++ = f.h(r0 + k, j);
+}
+
+static void unpack_rows(DuneField &f, int r0, const std::vector<char> &buf)
+{
+  const int     nj = f.shape[1];
+  const int     count = (int)(buf.size() / sizeof(Height) / nj);
+  const Height *p = (const Height *)buf.data();
+
+  for (int j = 0; j < nj; j++)
+    for (int k = 0; k < count; k++)
+      f.h(r0 + k, j) = *p++;
+}
+
+template <typename T>
+static void to_bytes(const std::vector<T> &v, std::vector<char> &buf)
+{
+  buf.resize(v.size() * sizeof(T));
+  if (!v.empty())
+    std::memcpy(buf.data(), v.data(), buf.size());
+}
+
+template <typename T>
+static void from_bytes(const std::vector<char> &buf, std::vector<T> &v)
+{
+  v.resize(buf.size() / sizeof(T));
+  if (!v.empty())
+    std::memcpy(v.data(), buf.data(), v.size() * sizeof(T));
+}
+
+DistributedField::DistributedField(Shape shape, int rank, int n_ranks)
+    : shape(shape), rank(rank), n_ranks(n_ranks)
+{
+  if (shape[0] < n_ranks)
+    LOG_ERROR("%d rows for %d ranks, each rank needs at least one row",
+              shape[0],
+              n_ranks);
+
+  this->i0 = (int)((int64_t)rank * shape[0] / n_ranks);
+  this->i1 = (int)((int64_t)(rank + 1) * shape[0] / n_ranks);
+  this->local = DuneField({this->i1 - this->i0 + 2 * this->halo, shape[1]});
+}
+
+void DistributedField::set_halo(int new_halo)
+{
+  const int n_own = this->i1 - this->i0;
+  DuneField f({n_own + 2 * new_halo, this->shape[1]});
+
+  f.shadow_slope = this->local.shadow_slope;
+  f.hop_length = this->local.hop_length;
+  f.prob_deposit_bare = this->local.prob_deposit_bare;
+  f.prob_deposit_sand = this->local.prob_deposit_sand;
+  f.seed = this->local.seed;
+  f.cycle_count = this->local.cycle_count;
+
+  for (int j = 0; j < this->shape[1]; j++)
+    for (int k = 0; k < n_own; k++)
+      f.h(new_halo + k, j) = this->local.h(this->halo + k, j);
+
+  this->local = std::move(f);
+  this->halo = new_halo;
+}
+
+void DistributedField::randomize(int h0)
+{
+  const int nj = this->shape[1];
+
+#pragma omp parallel for
+  for (int j = 0; j < nj; j++)
+    for (int i = this->i0; i < this->i1; i++)
+    {
+      CounterRng rng(this->local.seed, ~(uint64_t)0, (uint64_t)i * nj + j);
+      this->local.h(this->local_row(i), j) = (Height)rng.next_below(h0 + 1);
+    }
+}
+
+Array<Height> DistributedField::band_heights() const
+{
+  Array<Height> band({this->i1 - this->i0, this->shape[1]});
+
+  for (int j = 0; j < this->shape[1]; j++)
+    for (int i = this->i0; i < this->i1; i++)
+      band(i - this->i0, j) = this->local.h(this->local_row(i), j);
+  return band;
+}
+
+uint64_t DistributedField::cycle(Exchange &ex)
+{
+  DuneField &f = this->local;
+  const int  nj = this->shape[1];
+
+  // first halo rows, the only ones an avalanche from the band can reach
+  const int        ru = this->local_row(this->i0) - 1;
+  const int        rd = this->local_row(this->i1);
+  std::vector<int> hu(nj), hd(nj);
+
+  for (int j = 0; j < nj; j++)
+  {
+    hu[j] = f.h(ru, j);
+    hd[j] = f.h(rd, j);
+  }
+
+  // erosion of the band, with the strips of DuneField::cycle
+  uint64_t n_moves = 0;
+  int      ns = nj / CYCLE_STRIP_WIDTH;
+  ns -= ns % 2;
+
+  std::vector<std::vector<HopMessage>> outboxes(std::max(1, ns));
+
+  STATS_RESERVE(f.stats);
+  f.heights.reserve();
+
+  if (ns < 2)
+    n_moves = this->cycle_strip(0, nj, outboxes[0]);
+  else
+    for (int phase = 0; phase < 2; phase++)
+    {
+      int parity = (int)((phase + f.cycle_count) % 2);
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : n_moves)
+      for (int s = parity; s < ns; s += 2)
+        n_moves += this->cycle_strip(s * nj / ns,
+                                     (s + 1) * nj / ns,
+                                     outboxes[s]);
+    }
+
+  std::vector<HopMessage> outbox;
+  for (auto &o : outboxes)
+    outbox.insert(outbox.end(), o.begin(), o.end());
+
+  // slabs that left the band are passed downwind until they have all
+  // deposited somewhere
+  std::vector<char>       send, recv;
+  std::vector<HopMessage> inbox;
+
+  while (ex.sum(outbox.size()) > 0)
+  {
+    to_bytes(outbox, send);
+    ex.shift(1, send, recv);
+    from_bytes(recv, inbox);
+
+    outbox.clear();
+    for (auto &m : inbox)
+      this->hop(m, outbox);
+  }
+
+  // avalanches onto the first halo rows are applied by their owners
+  std::vector<int32_t> du(nj), dd(nj), delta;
+
+  for (int j = 0; j < nj; j++)
+  {
+    du[j] = (int)f.h(ru, j) - hu[j];
+    dd[j] = (int)f.h(rd, j) - hd[j];
+  }
+
+  to_bytes(du, send);
+  ex.shift(-1, send, recv);
+  from_bytes(recv, delta);
+  for (int j = 0; j < nj; j++)
+  {
+    Height &v = f.h(this->local_row(this->i1 - 1), j);
+    v = (Height)std::max(0, (int)v + delta[j]);
+  }
+
+  to_bytes(dd, send);
+  ex.shift(1, send, recv);
+  from_bytes(recv, delta);
+  for (int j = 0; j < nj; j++)
+  {
+    Height &v = f.h(this->local_row(this->i0), j);
+    v = (Height)std::max(0, (int)v + delta[j]);
+  }
+
+  f.heights.merge();
+  STATS_CYCLE(f.stats);
+  f.cycle_count++;
+  this->synchronize(ex);
+
+  return n_moves;
+}
+
+uint64_t DistributedField::cycle_strip(int                      j0,
+                                       int                      j1,
+                                       std::vector<HopMessage> &outbox)
+{
+  DuneField     &f = this->local;
+  uint64_t       n_moves = 0;
+  const int      n_own = this->i1 - this->i0;
+  const int      w = j1 - j0;
+  const uint64_t n = (uint64_t)n_own * (uint64_t)w;
+
+  // same affine permutation of the cells as DuneField::cycle_strip,
+  // keyed by the band as well
+  CounterRng rng_strip(f.seed,
+                       f.cycle_count,
+                       ~(uint64_t)j0 ^ ((uint64_t)this->i0 << 32));
+  uint64_t   a = n > 1 ? 1 + rng_strip.next_below(n - 1) : 1;
+  uint64_t   b = rng_strip.next_below(n);
+
+  while (gcd(a, n) != 1)
+    a = a % (n - 1) + 1;
+
+  const int a_i = (int)(a / w);
+  const int a_j = (int)(a % w);
+  int       k = (int)(b / w); // row in the band
+  int       j = j0 + (int)(b % w);
+
+  for (uint64_t t = 0; t < n; t++, k += a_i, j += a_j)
+  {
+    if (j >= j1)
+    {
+      j -= w;
+      k++;
+    }
+    if (k >= n_own)
+      k -= n_own;
+
+    if (f.active(this->halo + k, j))
+    {
+      const int i = this->i0 + k;
+
+      f.depose_at(this->halo + k, j, -1);
+      n_moves++;
+      STATS_COUNT(f.stats, n_eroded, 1);
+
+      HopMessage m;
+      m.i = (int32_t)((i + f.hop_length) % this->shape[0]);
+      m.j = j;
+      m.cell = (uint64_t)i * this->shape[1] + j;
+      m.draws = 0;
+
+      this->hop(m, outbox);
+    }
+  }
+  return n_moves;
+}
+
+void DistributedField::hop(HopMessage m, std::vector<HopMessage> &outbox)
+{
+  DuneField &f = this->local;
+  CounterRng rng(f.seed, f.cycle_count, m.cell);
+
+  rng.discard(m.draws);
+
+  while (true)
+  {
+    if ((m.i < this->i0) or (m.i >= this->i1))
+    {
+      outbox.push_back(m);
+      return;
+    }
+
+    const int li = this->local_row(m.i);
+    bool      deposit = f.shadow(li, m.j);
+
+    if (!deposit)
+    {
+      float rd = rng.next_float();
+      m.draws++;
+      deposit = ((f.h(li, m.j) == 0) and (rd < f.prob_deposit_bare)) or
+                (rd < f.prob_deposit_sand);
+    }
+
+    if (deposit)
+    {
+      f.depose_at(li, m.j, 1);
+      STATS_COUNT(f.stats, n_deposited, 1);
+      return;
+    }
+
+    m.i = (m.i + f.hop_length) % this->shape[0];
+  }
+}
+
+void DistributedField::synchronize(Exchange &ex)
+{
+  const int n_own = this->i1 - this->i0;
+  int       hmax = 0;
+
+  for (int j = 0; j < this->shape[1]; j++)
+    for (int k = 0; k < n_own; k++)
+      hmax = std::max(hmax, (int)this->local.h(this->halo + k, j));
+
+  // halo deep enough for the shadow of the band to be exact (and for the
+  // local shadow updates of DuneField::depose_at), the halo rows of a
+  // rank being taken from a single neighbor
+  hmax = ex.max(hmax);
+  const int min_band = -ex.max(-n_own);
+  int       needed = 3 + (int)((float)hmax / this->local.shadow_slope);
+
+  if (needed > min_band)
+  {
+    if (!this->halo_clamped and (this->rank == 0))
+      LOG_ERROR("bands of %d rows are too narrow for a shadow reach of %d "
+                "rows, use fewer ranks",
+                min_band,
+                needed);
+    this->halo_clamped = true;
+    needed = min_band;
+  }
+
+  if (needed > this->halo)
+    this->set_halo(needed);
+
+  std::vector<char> send, recv;
+
+  pack_rows(this->local, this->local_row(this->i0), this->halo, send);
+  ex.shift(-1, send, recv);
+  unpack_rows(this->local, this->local_row(this->i1), recv);
+
+  pack_rows(this->local,
+            this->local_row(this->i1) - this->halo,
+            this->halo,
+            send);
+  ex.shift(1, send, recv);
+  unpack_rows(this->local, 0, recv);
+
+  this->local.update_shadow();
+}
+
+} // namespace dunescape
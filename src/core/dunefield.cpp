@@ -4,149 +4,1022 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <utility>
+
+#include <omp.h>
+
 #include "macrologger.h"
 
 #include "core/array.hpp"
 #include "core/dunefield.hpp"
+#include "core/rng.hpp"
+#include "core/shadow_kernels.hpp"
 
 namespace dunescape
 {
 
-DuneField::DuneField(std::vector<int> shape) : shape(shape)
+// an exception is not to leave a parallel region (the process would be
+// terminated): the iterations are run through this and the first
+// exception thrown is kept, to be rethrown once the region is over
+template <typename F>
+static void catch_parallel(std::exception_ptr &error, F body)
+{
+  try
+  {
+    body();
+  }
+  catch (...)
+  {
+#pragma omp critical(dunescape_catch_parallel)
+    if (!error)
+      error = std::current_exception();
+  }
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+  while (b != 0)
+  {
+    uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// inverse of 'a' modulo 'n', a and n < 2^32 being coprime
+static uint64_t inverse_mod(uint64_t a, uint64_t n)
 {
-  this->h = Array(shape);
-  this->shadow = Array(shape);
-  this->gen.seed(this->seed);
+  int64_t t = 0, t1 = 1;
+  int64_t r = (int64_t)n, r1 = (int64_t)a;
+
+  while (r1 != 0)
+  {
+    const int64_t q = r / r1;
+    std::swap(t, t1);
+    t1 -= q * t;
+    std::swap(r, r1);
+    r1 -= q * r;
+  }
+  return (uint64_t)(t < 0 ? t + (int64_t)n : t) % n;
 }
 
-void DuneField::cycle()
+// wether fewer than 1 / CYCLE_SPARSE_RATIO of the n cells of the column
+// strip [j0, j1[ are active, counted up to that limit
+static bool is_sparse(const Mask &active, int j0, int j1, uint64_t n)
 {
-  std::uniform_real_distribution<float> dis(0.f, 1.f);
-  std::uniform_int_distribution<int>    dis_ij(0, 10); // this->shape[0] - 1);
+  const uint64_t *words = active.column(j0);
+  const size_t    nw = (size_t)(j1 - j0) * active.words_per_column;
+  const uint64_t  limit = n / CYCLE_SPARSE_RATIO;
+  uint64_t        count = 0;
 
-#pragma omp parallel for
-  for (int i = 0; i < this->shape[0]; i++)
-    for (int j = 0; j < this->shape[1]; j++)
+  for (size_t k = 0; k < nw; k++)
+  {
+    count += __builtin_popcountll(words[k]);
+    if (count >= limit)
+      return false;
+  }
+  return true;
+}
+
+// return a pointer to the heights h(i, j0:j1), gathered in 'buffer' if
+// they are not contiguous
+static inline const Height *row_segment(const Array<Height> &h,
+                                        int                  i,
+                                        int                  j0,
+                                        int                  j1,
+                                        Height *__restrict   buffer)
+{
+  const Height *p = &h(i, j0);
+
+  if (h.layout == LAYOUT_ROW_MAJOR)
+    return p;
+
+  for (int j = 0; j < j1 - j0; j++)
+    buffer[j] = p[(size_t)j * h.stride_j];
+  return buffer;
+}
+
+DuneField::DuneField(Shape              shape,
+                     Layout             layout,
+                     const std::string &storage)
+    : shape(shape), h(shape, layout, MappedAllocator<Height>(storage)),
+      shadow(shape, MappedAllocator<uint64_t>(storage)),
+      active(shape, MappedAllocator<uint64_t>(storage)),
+      relax_queued(shape, MappedAllocator<uint64_t>(storage))
+{
+  this->modified_columns.assign(shape[1], 1);
+}
+
+uint64_t DuneField::cycle()
+{
+  uint64_t n_moves = 0;
+
+  // number of strips, must be even so that strips of a same phase are
+  // never neighbors, including across the periodic boundary
+  int ns = this->shape[1] / CYCLE_STRIP_WIDTH;
+  ns -= ns % 2;
+
+  STATS_RESERVE(this->stats);
+  this->heights.reserve();
+
+  const bool mapped = this->h.vector.get_allocator().is_mapped();
+
+  if (this->relax_avalanches and
+      ((int)this->relax_pending.size() < omp_get_max_threads()))
+    this->relax_pending.resize(omp_get_max_threads());
+
+  if ((int)this->active_changes.size() < omp_get_max_threads())
+    this->active_changes.resize(omp_get_max_threads(), nullptr);
+
+  // kernel specialized for the boundary conditions
+  uint64_t (DuneField::*cycle_strip)(int, int) =
+      &DuneField::cycle_strip<BOUNDARY_PERIODIC>;
+
+  if (this->boundary == BOUNDARY_OPEN)
+    cycle_strip = &DuneField::cycle_strip<BOUNDARY_OPEN>;
+  else if (this->boundary == BOUNDARY_WALLS)
+    cycle_strip = &DuneField::cycle_strip<BOUNDARY_WALLS>;
+
+  if (ns < 2)
+  {
+    STATS_TIMER(t0);
+    n_moves = (this->*cycle_strip)(0, this->shape[1]);
+    STATS_TIME(this->stats, STATS_PHASE_EVEN, t0);
+  }
+  else
+  {
+    std::exception_ptr error;
+
+    // alternate which phase goes first to avoid any directional bias
+    for (int phase = 0; phase < 2; phase++)
     {
-      // shuffle cell indices to avoid artifacts
-      i = (i + dis_ij(this->gen)) % this->shape[0];
-      j = (j + dis_ij(this->gen)) % this->shape[1];
+      int parity = (int)((phase + this->cycle_count) % 2);
 
-      if ((this->h(i, j) > 0) and (this->shadow(i, j) == 0))
+      STATS_TIMER(t0);
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : n_moves)
+      for (int s = parity; s < ns; s += 2)
       {
-        // remove slab from initial cell
-        this->depose_at(i, j, -1, this->di_up, this->dj_up);
+        const int j0 = s * this->shape[1] / ns;
+        const int j1 = (s + 1) * this->shape[1] / ns;
 
-        // keep moving the cell downwind by 'hop_length' jumps until
-        // it deposits
-        bool keep_hopping = true;
-        int  ic = i;
+        // memory-mapped storage, the strip is paged in at once along with
+        // the one to be handed out when every thread is done with its
+        // current strip, and hinted cold once updated
+        const int sn = s + 2 * omp_get_num_threads();
 
-        while (keep_hopping)
+        if (mapped)
         {
-          ic = (ic + this->hop_length) % this->shape[0];
-
-          if (this->shadow(ic, j) == 1)
-          {
-            this->depose_at(ic, j, 1, this->di_down, this->dj_down);
-            keep_hopping = false;
-          }
-          else
-          {
-            float rd = dis(this->gen);
-            if (((this->h(ic, j) == 0) and (rd < this->prob_deposit_bare)) or
-                (rd < this->prob_deposit_sand))
-            {
-              this->depose_at(ic, j, 1, this->di_down, this->dj_down);
-              keep_hopping = false;
-            }
-          }
+          this->advise_columns(j0, j1, STORAGE_WILL_NEED);
+          if (sn < ns)
+            this->advise_columns(sn * this->shape[1] / ns,
+                                 (sn + 1) * this->shape[1] / ns,
+                                 STORAGE_WILL_NEED);
         }
+
+        // (the relaxation and active cell worklists grow in the strip)
+        catch_parallel(error,
+                       [&]() { n_moves += (this->*cycle_strip)(j0, j1); });
+
+        if (mapped)
+          this->advise_columns(j0, j1, STORAGE_COLD);
       }
+
+      STATS_TIME(this->stats, STATS_PHASE_EVEN + parity, t0);
+
+      if (error)
+        std::rethrow_exception(error);
     }
+  }
+
+  if (this->relax_avalanches)
+  {
+    STATS_TIMER(t0);
+    this->relax();
+    STATS_TIME(this->stats, STATS_PHASE_RELAX, t0);
+  }
+
+  this->heights.merge();
+
+  STATS_CYCLE(this->stats);
+  this->cycle_count++;
+  return n_moves;
+}
+
+template <Boundary B> uint64_t DuneField::cycle_strip(int j0, int j1)
+{
+  uint64_t       n_moves = 0;
+  const int      w = j1 - j0;
+  const uint64_t n = (uint64_t)this->shape[0] * (uint64_t)w;
+
+  // shuffle cell indices to avoid artifacts, using the affine
+  // permutation t -> (a * t + b) % n with a and n coprime
+  CounterRng rng_strip(this->seed, this->cycle_count, ~(uint64_t)j0);
+  uint64_t   a = n > 1 ? 1 + rng_strip.next_below(n - 1) : 1;
+  uint64_t   b = rng_strip.next_below(n);
+
+  while (gcd(a, n) != 1)
+    a = a % (n - 1) + 1;
+
+  const int ni = this->shape[0];
+
+  if ((n >> 32 == 0) and is_sparse(this->active, j0, j1, n))
+    n_moves = this->cycle_active_cells<B>(j0, j1, a, b);
+  else
+  {
+    // the permutation is walked incrementally, (i, j) being the cell of
+    // index idx = i * w + j - j0, so that inactive cells cost a single
+    // bit test
+    const int a_i = (int)(a / w);
+    const int a_j = (int)(a % w);
+    int       i = (int)(b / w);
+    int       j = j0 + (int)(b % w);
+
+    for (uint64_t t = 0; t < n; t++, i += a_i, j += a_j)
+    {
+      if (j >= j1)
+      {
+        j -= w;
+        i++;
+      }
+      if (i >= ni)
+        i -= ni;
+
+      if (this->active(i, j))
+      {
+        CounterRng rng(this->seed,
+                       this->cycle_count,
+                       (uint64_t)i * this->shape[1] + j);
+
+        // remove slab from initial cell and move it downwind
+        this->depose_at<B, MooreUp>(i, j, -1);
+        this->hop<B>(i, j, rng);
+        n_moves++;
+
+        STATS_COUNT(this->stats, n_eroded, 1);
+      }
+    }
+  }
+
+  // sand blown in upwind of the first row, floor(sand_inflow + U) slabs
+  // per column (U uniform in [0, 1[), keyed past the cell indices
+  if ((B == BOUNDARY_OPEN) and (this->sand_inflow > 0.f))
+    for (int j = j0; j < j1; j++)
+    {
+      CounterRng rng(this->seed,
+                     this->cycle_count,
+                     (uint64_t)ni * this->shape[1] + j);
+      const int  n_in = (int)(this->sand_inflow + rng.next_float());
+
+      for (int k = 0; k < n_in; k++)
+        this->hop<B>(-1, j, rng);
+      n_moves += n_in;
+    }
+
+  return n_moves;
+}
+
+template <Boundary B>
+uint64_t DuneField::cycle_active_cells(int j0, int j1, uint64_t a, uint64_t b)
+{
+  uint64_t       n_moves = 0;
+  const int      ni = this->shape[0];
+  const uint64_t w = (uint64_t)(j1 - j0);
+  const uint64_t n = (uint64_t)ni * w;
+  const uint64_t a_inv = inverse_mod(a, n);
+  const int      wpc = this->active.words_per_column;
+  const size_t   k0 = (size_t)j0 * wpc;
+
+  // active cells seen so far (words of the strip), and the ranks t in the
+  // permutation of the ones yet to be visited, in a min-heap
+  std::vector<uint64_t>  known(this->active.column(j0),
+                               this->active.column(j0) + w * wpc);
+  std::vector<uint64_t>  ranks;
+  std::greater<uint64_t> after;
+
+  auto push_cells = [&](size_t k, uint64_t bits, uint64_t t_min)
+  {
+    const int i0 = (int)(k % wpc) * 64;
+    const int dj = (int)(k / wpc);
+
+    for (; bits; bits &= bits - 1)
+    {
+      const int i = i0 + __builtin_ctzll(bits);
+
+      if (i >= ni)
+        break;
+
+      const uint64_t idx = (uint64_t)i * w + dj;
+      const uint64_t t = (idx + n - b) % n * a_inv % n;
+
+      if (t >= t_min)
+      {
+        ranks.push_back(t);
+        std::push_heap(ranks.begin(), ranks.end(), after);
+      }
+    }
+  };
+
+  for (size_t k = 0; k < known.size(); k++)
+    push_cells(k, known[k], 0);
+
+  std::vector<size_t> changes;
+  this->active_changes[omp_get_thread_num()] = &changes;
+
+  for (uint64_t t_next = 0; !ranks.empty();)
+  {
+    std::pop_heap(ranks.begin(), ranks.end(), after);
+    const uint64_t t = ranks.back();
+    ranks.pop_back();
+
+    if (t < t_next)
+      continue;
+    t_next = t + 1;
+
+    const uint64_t idx = (a * t + b) % n;
+    const int      i = (int)(idx / w);
+    const int      j = j0 + (int)(idx % w);
+
+    if (!this->active(i, j))
+      continue;
+
+    CounterRng rng(this->seed,
+                   this->cycle_count,
+                   (uint64_t)i * this->shape[1] + j);
+
+    // remove slab from initial cell and move it downwind
+    this->depose_at<B, MooreUp>(i, j, -1);
+    this->hop<B>(i, j, rng);
+    n_moves++;
+
+    STATS_COUNT(this->stats, n_eroded, 1);
+
+    // cells of the strip activated by the move
+    for (size_t c : changes)
+      if ((c >= k0) and (c - k0 < known.size()))
+      {
+        const uint64_t v = this->active.words[c];
+
+        push_cells(c - k0, v & ~known[c - k0], t_next);
+        known[c - k0] |= v;
+      }
+    changes.clear();
+  }
+
+  this->active_changes[omp_get_thread_num()] = nullptr;
+  return n_moves;
+}
+
+void DuneField::advise_columns(int j0, int j1, StorageAdvice advice)
+{
+  if (this->h.layout == LAYOUT_COLUMN_MAJOR)
+    advise_storage(&this->h(0, j0),
+                   (size_t)(j1 - j0) * this->h.stride_j * sizeof(Height),
+                   advice);
+
+  for (const Mask *m : {&this->shadow, &this->active, &this->relax_queued})
+    advise_storage(m->column(j0),
+                   (size_t)(j1 - j0) * m->words_per_column *
+                       sizeof(uint64_t),
+                   advice);
+}
+
+template <Boundary B> void DuneField::hop(int i, int j, CounterRng &rng)
+{
+  // keep moving the slab downwind by 'hop_length' jumps until it
+  // deposits, the hop being reduced to a single wrap around periodic
+  // rows
+  const int ni = this->shape[0];
+  const int step = periodic_rows(B) ? this->hop_length % ni
+                                    : this->hop_length;
+  int       ic = i;
+  int       n_hops = 0;
+
+  while (true)
+  {
+    bool deposit = false;
+
+    ic += step;
+    n_hops++;
+
+    if (ic >= ni)
+    {
+      if (periodic_rows(B))
+        ic -= ni;
+      else if (B == BOUNDARY_OPEN)
+        return; // blown out of the field
+      else
+      {
+        ic = ni - 1; // stopped by the wall
+        deposit = true;
+      }
+    }
+
+    if (!deposit)
+      deposit = this->shadow(ic, j);
+
+    if (!deposit)
+    {
+      float rd = rng.next_float();
+      deposit = ((this->h(ic, j) == 0) and (rd < this->prob_deposit_bare)) or
+                (rd < this->prob_deposit_sand);
+    }
+
+    if (deposit)
+    {
+      this->depose_at<B, MooreDown>(ic, j, 1);
+      STATS_COUNT(this->stats, n_deposited, 1);
+      STATS_HOPS(this->stats, n_hops);
+      return;
+    }
+  }
+}
+
+void DuneField::move_slab(int i, int j, CounterRng &rng)
+{
+  switch (this->boundary)
+  {
+  case BOUNDARY_OPEN:
+    if (i >= 0)
+      this->depose_at<BOUNDARY_OPEN, MooreUp>(i, j, -1);
+    this->hop<BOUNDARY_OPEN>(i, j, rng);
+    break;
+
+  case BOUNDARY_WALLS:
+    this->depose_at<BOUNDARY_WALLS, MooreUp>(i, j, -1);
+    this->hop<BOUNDARY_WALLS>(i, j, rng);
+    break;
+
+  default:
+    this->depose_at<BOUNDARY_PERIODIC, MooreUp>(i, j, -1);
+    this->hop<BOUNDARY_PERIODIC>(i, j, rng);
+  }
 }
 
-void DuneField::depose_at(int               i,
-                          int               j,
-                          int               amount,
-                          std::vector<int> &di,
-                          std::vector<int> &dj)
+void DuneField::depose_at(int i, int j, int amount)
 {
-  // loop over the neighbors
+  switch (this->boundary)
+  {
+  case BOUNDARY_OPEN:
+    if (amount > 0)
+      this->depose_at<BOUNDARY_OPEN, MooreDown>(i, j, amount);
+    else
+      this->depose_at<BOUNDARY_OPEN, MooreUp>(i, j, amount);
+    break;
+
+  case BOUNDARY_WALLS:
+    if (amount > 0)
+      this->depose_at<BOUNDARY_WALLS, MooreDown>(i, j, amount);
+    else
+      this->depose_at<BOUNDARY_WALLS, MooreUp>(i, j, amount);
+    break;
+
+  default:
+    if (amount > 0)
+      this->depose_at<BOUNDARY_PERIODIC, MooreDown>(i, j, amount);
+    else
+      this->depose_at<BOUNDARY_PERIODIC, MooreUp>(i, j, amount);
+  }
+}
+
+template <Boundary B, class S>
+void DuneField::depose_at(int i, int j, int amount)
+{
+  const int ni = this->shape[0];
+  const int nj = this->shape[1];
+  const int v = this->h(i, j);
+
+  // first neighbor (in the stencil order) the slab avalanches to
   int p = i;
   int q = j;
 
-  for (size_t k = 0; k < di.size(); k++)
+  visit_neighbors<B, S>(i,
+                        j,
+                        ni,
+                        nj,
+                        [&](int in, int jn)
+                        {
+                          if (amount * (v - this->h(in, jn)) >
+                              REPOSE_THRESHOLD)
+                          {
+                            p = in;
+                            q = jn;
+                            return true;
+                          }
+                          return false;
+                        });
+
+  this->heights.move(this->h(p, q), amount);
+  this->h(p, q) += amount;
+  this->modified_columns[q] = 1; // columns owned by a single strip
+
+  STATS_COUNT(this->stats, n_avalanches, (p != i) or (q != j));
+
+  this->update_shadow<B>(p, q);
+
+  // a slab added can only make the cell itself unstable, a slab removed
+  // its neighbors
+  if (this->relax_avalanches)
+  {
+    if (amount > 0)
+      this->queue_relaxation(p, q);
+    else
+      visit_neighbors<B, Moore>(p,
+                                q,
+                                ni,
+                                nj,
+                                [this](int in, int jn)
+                                {
+                                  this->queue_relaxation(in, jn);
+                                  return false;
+                                });
+  }
+}
+
+void DuneField::queue_relaxation()
+{
+  if ((int)this->relax_pending.size() < omp_get_max_threads())
+    this->relax_pending.resize(omp_get_max_threads());
+
+  switch (this->boundary)
   {
-    int in = (i + di[k] + this->shape[0]) % this->shape[0];
-    int jn = (j + dj[k] + this->shape[1]) % this->shape[1];
+  case BOUNDARY_OPEN: this->queue_unstable_cells<BOUNDARY_OPEN>(); break;
+  case BOUNDARY_WALLS: this->queue_unstable_cells<BOUNDARY_WALLS>(); break;
+  default: this->queue_unstable_cells<BOUNDARY_PERIODIC>();
+  }
+}
+
+template <Boundary B> void DuneField::queue_unstable_cells()
+{
+  const int          ni = this->shape[0];
+  const int          nj = this->shape[1];
+  std::exception_ptr error;
+
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < nj; j++)
+    catch_parallel(
+        error,
+        [&]()
+        {
+          for (int i = 0; i < ni; i++)
+          {
+            const int v = this->h(i, j);
+
+            visit_neighbors<B, Moore>(
+                i,
+                j,
+                ni,
+                nj,
+                [&](int in, int jn)
+                {
+                  if (v - this->h(in, jn) > REPOSE_THRESHOLD)
+                  {
+                    this->queue_relaxation(i, j);
+                    return true;
+                  }
+                  return false;
+                });
+          }
+        });
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+uint64_t DuneField::relax()
+{
+  const int nj = this->shape[1];
+
+  STATS_RESERVE(this->stats);
+  this->heights.reserve();
 
-    if (amount * (this->h(i, j) - this->h(in, jn)) > 2)
+  // same column strips as the cycle
+  int ns = nj / CYCLE_STRIP_WIDTH;
+  ns -= ns % 2;
+  ns = std::max(1, ns);
+
+  std::vector<int> strip_of(nj);
+  for (int s = 0; s < ns; s++)
+    for (int j = s * nj / ns; j < (s + 1) * nj / ns; j++)
+      strip_of[j] = s;
+
+  std::vector<std::vector<uint64_t>> queues(ns), outboxes(ns);
+
+  // kernel specialized for the boundary conditions
+  uint64_t (DuneField::*relax_strip)(int,
+                                     int,
+                                     std::vector<uint64_t> &,
+                                     std::vector<uint64_t> &) =
+      &DuneField::relax_strip<BOUNDARY_PERIODIC>;
+
+  if (this->boundary == BOUNDARY_OPEN)
+    relax_strip = &DuneField::relax_strip<BOUNDARY_OPEN>;
+  else if (this->boundary == BOUNDARY_WALLS)
+    relax_strip = &DuneField::relax_strip<BOUNDARY_WALLS>;
+
+  // hand the cells over to their strip (once)
+  auto dispatch = [&](std::vector<uint64_t> &cells)
+  {
+    for (uint64_t cell : cells)
+    {
+      const int i = (int)(cell / nj);
+      const int j = (int)(cell % nj);
+
+      if (!this->relax_queued(i, j))
+      {
+        this->relax_queued.set(i, j, true);
+        queues[strip_of[j]].push_back(cell);
+      }
+    }
+    cells.clear();
+  };
+
+  // (sorted, the order in which the threads queued them is arbitrary)
+  for (auto &pending : this->relax_pending)
+    dispatch(pending);
+  for (auto &queue : queues)
+    std::sort(queue.begin(), queue.end());
+
+  uint64_t           n_moves = 0;
+  bool               done = false;
+  std::exception_ptr error;
+
+  while (!done)
+  {
+    for (int phase = 0; phase < 2; phase++)
     {
-      p = in;
-      q = jn;
-      break;
+#pragma omp parallel for schedule(dynamic) reduction(+ : n_moves)
+      for (int s = phase; s < ns; s += 2)
+        catch_parallel(error,
+                       [&]()
+                       {
+                         n_moves += (this->*relax_strip)(s * nj / ns,
+                                                         (s + 1) * nj / ns,
+                                                         queues[s],
+                                                         outboxes[s]);
+                       });
+
+      if (error)
+        std::rethrow_exception(error);
+
+      for (auto &outbox : outboxes)
+        dispatch(outbox);
     }
+
+    done = true;
+    for (auto &queue : queues)
+      done = done and queue.empty();
+  }
+
+  this->heights.merge();
+  return n_moves;
+}
+
+template <Boundary B>
+uint64_t DuneField::relax_strip(int                    j0,
+                                int                    j1,
+                                std::vector<uint64_t> &queue,
+                                std::vector<uint64_t> &outbox)
+{
+  const int ni = this->shape[0];
+  const int nj = this->shape[1];
+  uint64_t  n_moves = 0;
+
+  auto push = [&](int i, int j)
+  {
+    if ((j < j0) or (j >= j1))
+      outbox.push_back((uint64_t)i * nj + j);
+    else if (!this->relax_queued(i, j))
+    {
+      this->relax_queued.set(i, j, true);
+      queue.push_back((uint64_t)i * nj + j);
+    }
+  };
+
+  // first in, first out, the queue growing while it is processed
+  for (size_t k = 0; k < queue.size(); k++)
+  {
+    const int i = (int)(queue[k] / nj);
+    const int j = (int)(queue[k] % nj);
+
+    this->relax_queued.set(i, j, false);
+
+    // steepest drop towards a neighbor
+    const int v = this->h(i, j);
+    int       p = -1, q = -1;
+    int       drop_max = REPOSE_THRESHOLD;
+
+    visit_neighbors<B, Moore>(i,
+                              j,
+                              ni,
+                              nj,
+                              [&](int in, int jn)
+                              {
+                                const int drop = v - (int)this->h(in, jn);
+
+                                if (drop > drop_max)
+                                {
+                                  drop_max = drop;
+                                  p = in;
+                                  q = jn;
+                                }
+                                return false;
+                              });
+
+    if (p < 0)
+      continue;
+
+    this->heights.move(v, -1);
+    this->heights.move(this->h(p, q), 1);
+    this->h(i, j) -= 1;
+    this->h(p, q) += 1;
+    this->modified_columns[j] = 1;
+    this->modified_columns[q] = 1;
+    this->update_shadow<B>(i, j);
+    this->update_shadow<B>(p, q);
+    n_moves++;
+    STATS_COUNT(this->stats, n_avalanches, 1);
+
+    // the cell may still be unstable, its neighbors may have become so
+    push(i, j);
+    push(p, q);
+    visit_neighbors<B, Moore>(i,
+                              j,
+                              ni,
+                              nj,
+                              [&](int in, int jn)
+                              {
+                                push(in, jn);
+                                return false;
+                              });
   }
-  this->h(p, q) =
-      std::max(0, this->h(p, q) + amount); // need to check this because of OMP
 
-  this->update_shadow(p, q);
+  queue.clear();
+  return n_moves;
+}
+
+bool DuneField::modified_column_range(int &j0, int &j1) const
+{
+  j0 = 0;
+  j1 = this->shape[1] - 1;
+
+  while ((j0 <= j1) and (this->modified_columns[j0] == 0))
+    j0++;
+  while ((j1 >= j0) and (this->modified_columns[j1] == 0))
+    j1--;
+  return j0 <= j1;
+}
+
+void DuneField::clear_modified_columns()
+{
+  std::fill(this->modified_columns.begin(), this->modified_columns.end(), 0);
 }
 
 void DuneField::update_shadow()
 {
-  int kmax = 2 + (int)((float)this->h.max() / this->shadow_slope);
+  // A cell (i, j) is in the shadow if there is a cell upstream at a
+  // distance k such that h(i - k, j) - h(i, j) > k * shadow_slope. This
+  // is evaluated with one upwind sweep per column carrying the "shadow
+  // envelope" max_k (h(i - k, j) - k * shadow_slope), stored as the
+  // height 'hb' and the distance 'kb' of the cell casting it. The slope
+  // k * shadow_slope is accumulated in single precision, so near-ties
+  // between the envelope and the cell height are resolved with the
+  // exact upstream search to keep the historical definition.
+  const int   ni = this->shape[0];
+  const int   nj = this->shape[1];
+  const float slope = this->shadow_slope;
 
-#pragma omp parallel for
-  for (int i = 0; i < this->shape[0]; i++)
-    for (int j = 0; j < this->shape[1]; j++)
+  STATS_TIMER(t0);
+
+  // one block of contiguous columns per thread, rows are swept within
+  // each block (narrow blocks defeat the hardware prefetcher)
+  const int nblocks = std::max(
+      1,
+      std::min(omp_get_max_threads(), nj / SHADOW_BLOCK_WIDTH));
+
+  std::vector<int> hb(nj, 0);
+  std::vector<int> kb(nj, -1); // no source yet
+  int              hmax = 0;
+
+  // a column-major array is swept through narrow tiles of columns whose
+  // rows are gathered in a small buffer, the cache lines of the tile
+  // columns being reused from one row to the next
+  const bool row_major = this->h.layout == LAYOUT_ROW_MAJOR;
+
+  // row kernels of the best instruction set available (AVX2, AVX-512)
+  const ShadowKernels &kernels = shadow_kernels();
+
+  // height histogram, rebuilt along the way
+  std::vector<uint64_t> counts;
+
+  // first pass, warm-up the envelope so that it accounts for the whole
+  // column (periodic boundary) when starting again from i = 0
+#pragma omp parallel for reduction(max : hmax)
+  for (int b = 0; b < nblocks; b++)
+  {
+    const int             j0 = b * nj / nblocks;
+    const int             j1 = (b + 1) * nj / nblocks;
+    const int             tile = row_major ? j1 - j0 : SHADOW_TILE_WIDTH;
+    std::vector<Height>   buffer(row_major ? 0 : tile);
+    std::vector<uint64_t> block_counts;
+
+    for (int t0 = j0; t0 < j1; t0 += tile)
     {
-      this->shadow(i, j) = 0;
-      float slope = this->shadow_slope;
-      int   k = 1;
-      float dh = -1.f;
-
-      // look for a cell upstream that would cast a shadow over the
-      // current cell
-      while ((k < kmax) and (dh <= 0.f))
+      const int t1 = std::min(j1, t0 + tile);
+
+      for (int i = 0; i < ni; i++)
       {
-        int k_shifted = (i - k + this->shape[0]) % this->shape[0];
-        dh = (float)this->h(k_shifted, j) - (float)this->h(i, j) - slope;
-        slope += this->shadow_slope;
-        k++;
+        const Height *h_row = row_segment(this->h, i, t0, t1, buffer.data());
+        const int     row_max = kernels.envelope_sweep_row(h_row,
+                                                       hb.data() + t0,
+                                                       kb.data() + t0,
+                                                       t1 - t0,
+                                                       slope);
+
+        hmax = std::max(hmax, row_max);
+
+        if (row_max >= (int)block_counts.size())
+          block_counts.resize(row_max + 1, 0);
+        for (int j = 0; j < t1 - t0; j++)
+          block_counts[h_row[j]]++;
       }
+    }
+
+#pragma omp critical
+    {
+      if (block_counts.size() > counts.size())
+        counts.resize(block_counts.size(), 0);
+      for (size_t v = 0; v < block_counts.size(); v++)
+        counts[v] += block_counts[v];
+    }
+  }
+
+  this->heights.set_counts(std::move(counts));
+
+  // without periodic rows, nothing casts a shadow on the first row: the
+  // envelopes are reset to a source beyond the column (replaced by the
+  // first cell, and never dark with the padded thresholds below)
+  const bool periodic = periodic_rows(this->boundary);
 
-      if (dh > 0.f)
-        this->shadow(i, j) = 1;
+  if (!periodic)
+  {
+    std::fill(hb.begin(), hb.end(), 0);
+    std::fill(kb.begin(), kb.end(), ni);
+  }
+
+  // integer thresholds: a cell upstream at a distance k casts a shadow
+  // if h(i - k, j) - h(i, j) >= thresholds[k]
+  const int kmax = std::min(ni, 2 + (int)((float)hmax / slope));
+
+  // (padded up to the column length, distances beyond kmax can never
+  // cast a shadow)
+  std::vector<int> thresholds(ni + 1, std::numeric_limits<int>::max() / 2);
+  float            dmin = 1.f;
+  {
+    float slope_k = slope;
+    for (int k = 1; k < kmax; k++)
+    {
+      thresholds[k] = (int)std::floor(slope_k) + 1;
+      double delta = thresholds[k] - (double)k * slope;
+      dmin = std::min(dmin, (float)delta);
+      slope_k += slope;
     }
+  }
+  // margin for the rounding errors on the envelope, beyond which the
+  // envelope alone is enough to conclude that a cell is not shadowed
+  const float margin = dmin - 1e-5f * (1.f + hmax + ni * slope);
+
+  // second pass, actual shadow computation
+#pragma omp parallel for
+  for (int b = 0; b < nblocks; b++)
+  {
+    const int             j0 = b * nj / nblocks;
+    const int             j1 = (b + 1) * nj / nblocks;
+    const int             tile = row_major ? j1 - j0 : SHADOW_TILE_WIDTH;
+    std::vector<Height>   buffer(row_major ? 0 : tile);
+    std::vector<uint8_t>  near_tie(tile);
+    std::vector<uint64_t> shadow_words(tile, 0);
+    std::vector<uint64_t> sandy_words(tile, 0);
+
+    for (int t0 = j0; t0 < j1; t0 += tile)
+    {
+      const int t1 = std::min(j1, t0 + tile);
+
+      for (int i = 0; i < ni; i++)
+      {
+        const Height *h_row = row_segment(this->h, i, t0, t1, buffer.data());
+        const int     bit = i & 63;
+
+        const bool any_tie = kernels.shadow_sweep_row(h_row,
+                                                      shadow_words.data(),
+                                                      sandy_words.data(),
+                                                      bit,
+                                                      hb.data() + t0,
+                                                      kb.data() + t0,
+                                                      near_tie.data(),
+                                                      t1 - t0,
+                                                      slope,
+                                                      margin,
+                                                      thresholds.data());
+
+        // exact search upstream for the (rare) near-ties
+        const int kmax_i = periodic ? kmax : std::min(kmax, i + 1);
+
+        for (int j = t0; any_tie and (j < t1); j++)
+          if (near_tie[j - t0])
+          {
+            const int v = h_row[j - t0];
+            for (int k = 1; k < kmax_i; k++)
+              if (this->h(i - k < 0 ? i - k + ni : i - k, j) - v >=
+                  thresholds[k])
+              {
+                shadow_words[j - t0] |= (uint64_t)1 << bit;
+                break;
+              }
+          }
+
+        // flush the shadow bits every 64 rows, and the active cells
+        // (sandy and not in the shadow)
+        if ((bit == 63) or (i == ni - 1))
+          for (int j = t0; j < t1; j++)
+          {
+            this->shadow.word(i, j) = shadow_words[j - t0];
+            this->active.word(i, j) = sandy_words[j - t0] &
+                                      ~shadow_words[j - t0];
+            shadow_words[j - t0] = 0;
+            sandy_words[j - t0] = 0;
+          }
+      }
+    }
+  }
+
+  STATS_COUNT(this->stats, n_shadow_cells, (uint64_t)ni * nj);
+  STATS_TIME(this->stats, STATS_PHASE_SHADOW, t0);
 }
 
 void DuneField::update_shadow(int i, int j)
 {
-  int kmax = 2;
-  int imax = 2 + this->h(i, j);
+  switch (this->boundary)
+  {
+  case BOUNDARY_OPEN: this->update_shadow<BOUNDARY_OPEN>(i, j); break;
+  case BOUNDARY_WALLS: this->update_shadow<BOUNDARY_WALLS>(i, j); break;
+  default: this->update_shadow<BOUNDARY_PERIODIC>(i, j);
+  }
+}
+
+template <Boundary B> void DuneField::update_shadow(int i, int j)
+{
+  // local update, only the cell just upstream is looked at (kmax = 2 in
+  // the original upstream search), the active flags follow
+  const int   ni = this->shape[0];
+  const int   imax = 2 + this->h(i, j);
+  const float slope = this->shadow_slope;
+
+  int ir, hu, n;
 
-  for (int p = -imax; p < imax; p++)
+  if (periodic_rows(B))
   {
-    int   ir = (i + p + this->shape[0]) % this->shape[0];
-    float slope = this->shadow_slope;
-    int   k = 1;
-    float dh = -1.f;
+    ir = ((i - imax) % ni + ni) % ni;
+    hu = this->h(ir > 0 ? ir - 1 : ni - 1, j);
+    n = 2 * imax;
+  }
+  else
+  {
+    // nothing upwind of the first row
+    ir = std::max(0, i - imax);
+    hu = ir > 0 ? this->h(ir - 1, j) : 0;
+    n = std::min(ni, i + imax) - ir;
+  }
 
-    while ((k < kmax) and (dh <= 0.f))
-    {
-      int k_shifted = (ir - k + this->shape[0]) % this->shape[0];
-      dh = (float)this->h(k_shifted, j) - (float)this->h(ir, j) - slope;
-      slope += this->shadow_slope;
-      k++;
-    }
+  const size_t col = (size_t)j * this->active.words_per_column;
+  const size_t tid = (size_t)omp_get_thread_num();
 
-    if (dh > 0.f)
-      this->shadow(ir, j) = 1;
-    else
-      this->shadow(ir, j) = 0;
+  std::vector<size_t> *changes = tid < this->active_changes.size()
+                                     ? this->active_changes[tid]
+                                     : nullptr;
+
+  for (int p = 0; p < n; p++)
+  {
+    const int   hr = this->h(ir, j);
+    const float dh = (float)hu - (float)hr - slope;
+
+    this->shadow.set(ir, j, dh > 0.f);
+    this->active.set(ir, j, (dh <= 0.f) and (hr > 0));
+
+    if (changes and ((p == 0) or ((ir & 63) == 0)))
+      changes->push_back(col + (ir >> 6));
+
+    hu = hr;
+    ir = ir + 1 < ni ? ir + 1 : 0;
   }
+
+  STATS_COUNT(this->stats, n_shadow_cells, n);
 }
 
 } // namespace dunescape
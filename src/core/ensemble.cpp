@@ -0,0 +1,217 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <omp.h>
+
+#include "core/ensemble.hpp"
+
+namespace dunescape
+{
+
+// queue of member indices, the owner pops from the front and thieves
+// from the back
+struct WorkQueue
+{
+  std::mutex         mutex;
+  std::deque<size_t> items;
+};
+
+static bool take_work(std::vector<std::unique_ptr<WorkQueue>> &queues,
+                      size_t                                   w,
+                      size_t                                  &item)
+{
+  for (size_t k = 0; k < queues.size(); k++)
+  {
+    WorkQueue                  &q = *queues[(w + k) % queues.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+
+    if (!q.items.empty())
+    {
+      if (k == 0)
+      {
+        item = q.items.front();
+        q.items.pop_front();
+      }
+      else
+      {
+        item = q.items.back();
+        q.items.pop_back();
+      }
+      return true;
+    }
+  }
+  return false; // nothing is ever added, all the work is taken
+}
+
+std::vector<EnsembleMember> EnsembleSweep::members() const
+{
+  std::vector<EnsembleMember> list;
+
+  for (float pb : this->prob_deposit_bare)
+    for (float ps : this->prob_deposit_sand)
+      for (int hl : this->hop_lengths)
+        for (uint seed : this->seeds)
+        {
+          EnsembleMember m;
+          m.id = (int)list.size();
+          m.shape = this->shape;
+          m.h0 = this->h0;
+          m.cycles = this->cycles;
+          m.seed = seed;
+          m.hop_length = std::max(1, hl);
+          m.prob_deposit_bare = pb;
+          m.prob_deposit_sand = ps;
+          list.push_back(m);
+        }
+  return list;
+}
+
+void measure(const DuneField &df, EnsembleResult &result)
+{
+  const Storage<Height> &v = df.h.vector;
+  const size_t           n = v.size();
+  double                 sum = 0., sum2 = 0.;
+  int                    hmax = 0;
+  size_t                 n_bare = 0;
+
+#pragma omp parallel for reduction(+ : sum, sum2, n_bare) reduction(max : hmax)
+  for (size_t k = 0; k < n; k++)
+  {
+    const double h = (double)v[k];
+    sum += h;
+    sum2 += h * h;
+    hmax = std::max(hmax, (int)v[k]);
+    n_bare += v[k] == 0 ? 1 : 0;
+  }
+
+  size_t n_shadow = 0;
+
+#pragma omp parallel for reduction(+ : n_shadow)
+  for (int j = 0; j < df.shape[1]; j++)
+    for (int i = 0; i < df.shape[0]; i++)
+      n_shadow += df.shadow(i, j) ? 1 : 0;
+
+  const double mean = n > 0 ? sum / n : 0.;
+
+  result.mean_height = (float)mean;
+  result.rms_height = n > 0 ? (float)std::sqrt(
+                                  std::max(0., sum2 / n - mean * mean))
+                            : 0.f;
+  result.max_height = hmax;
+  result.bare_fraction = n > 0 ? (float)n_bare / n : 0.f;
+  result.shadow_fraction = n > 0 ? (float)n_shadow / n : 0.f;
+}
+
+std::vector<EnsembleResult> EnsembleRunner::run(
+    const std::vector<EnsembleMember> &members,
+    EnsembleCallback                   on_done)
+{
+  std::vector<EnsembleResult> results(members.size());
+
+  if (members.empty())
+    return results;
+
+  const int n_threads = this->n_threads > 0 ? this->n_threads
+                                            : omp_get_max_threads();
+  const int per_member = this->threads_per_member;
+  const int n_workers = (int)std::min(
+      members.size(),
+      (size_t)std::max(1, per_member > 0 ? n_threads / per_member
+                                         : n_threads));
+
+  // longest runs first, dealt round-robin
+  std::vector<size_t> order(members.size());
+  for (size_t k = 0; k < order.size(); k++)
+    order[k] = k;
+
+  auto cost = [&members](size_t k)
+  {
+    const EnsembleMember &m = members[k];
+    return (double)m.shape[0] * m.shape[1] * m.cycles;
+  };
+  std::stable_sort(order.begin(),
+                   order.end(),
+                   [&cost](size_t a, size_t b) { return cost(a) > cost(b); });
+
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  for (int w = 0; w < n_workers; w++)
+    queues.emplace_back(new WorkQueue);
+  for (size_t k = 0; k < order.size(); k++)
+    queues[k % n_workers]->items.push_back(order[k]);
+
+  std::atomic<int> running(0);
+
+  auto worker = [&](size_t w)
+  {
+    size_t k;
+    int    team_size = 0;
+
+    while (take_work(queues, w, k))
+    {
+      const EnsembleMember &m = members[k];
+      EnsembleResult       &r = results[k];
+      auto                  t0 = std::chrono::steady_clock::now();
+
+      running++;
+
+      DuneField df(m.shape);
+      df.seed = m.seed;
+      df.hop_length = m.hop_length;
+      df.prob_deposit_bare = m.prob_deposit_bare;
+      df.prob_deposit_sand = m.prob_deposit_sand;
+
+      for (int c = -1; c < m.cycles; c++)
+      {
+        // share the threads between the members being run (OpenMP
+        // settings are per thread)
+        int n = per_member > 0 ? per_member
+                               : std::max(1, n_threads / running.load());
+        if (n != team_size)
+        {
+          omp_set_num_threads(n);
+          team_size = n;
+        }
+
+        if (c < 0)
+        {
+          df.h.randomize(0, m.h0, m.seed);
+          df.update_shadow();
+        }
+        else
+          r.n_moves = df.cycle();
+      }
+
+      r.member = m;
+      measure(df, r);
+      r.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - t0)
+                      .count();
+
+      running--;
+
+      if (on_done)
+        on_done(df, r);
+    }
+  };
+
+  // the OpenMP settings of the calling thread are left unchanged
+  std::vector<std::thread> threads;
+  for (int w = 0; w < n_workers; w++)
+    threads.emplace_back(worker, (size_t)w);
+
+  for (auto &t : threads)
+    t.join();
+
+  return results;
+}
+
+} // namespace dunescape
@@ -0,0 +1,552 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "macrologger.h"
+
+#include "core/export.hpp"
+#include "core/png.hpp"
+
+#define EXPORT_ROW_BLOCK 64      // image rows converted at once
+#define EXPORT_RAW_BLOCK 1048576 // raw values converted at once
+#define DEFLATE_MAX_CHAIN 16     // hash chain candidates tested per match
+#define DEFLATE_HASH_BITS 15     // hash table size
+#define DEFLATE_WINDOW 32768     // maximum match distance
+
+namespace dunescape
+{
+
+//----------------------------------------------------------------------
+// deflate (fixed Huffman codes)
+//----------------------------------------------------------------------
+
+// bits are packed from the least significant bit, as deflate expects
+struct BitWriter
+{
+  std::vector<uint8_t> bytes;
+  uint64_t             acc = 0;
+  int                  n = 0;
+
+  inline void put(uint32_t v, int nbits)
+  {
+    this->acc |= (uint64_t)v << this->n;
+    this->n += nbits;
+    while (this->n >= 8)
+    {
+      this->bytes.push_back((uint8_t)this->acc);
+      this->acc >>= 8;
+      this->n -= 8;
+    }
+  }
+
+  void append(const BitWriter &other)
+  {
+    if (this->n == 0)
+      this->bytes.insert(this->bytes.end(),
+                         other.bytes.begin(),
+                         other.bytes.end());
+    else
+      for (uint8_t byte : other.bytes)
+        this->put(byte, 8);
+    this->put((uint32_t)other.acc, other.n);
+  }
+
+  void align()
+  {
+    if (this->n > 0)
+      this->put(0, 8 - this->n);
+  }
+};
+
+// fixed Huffman codes, bit-reversed for the writer
+struct FixedCodes
+{
+  uint16_t lit_code[288];
+  uint8_t  lit_bits[288];
+  uint8_t  length_index[259];
+  uint8_t  dist_code[30];
+
+  FixedCodes()
+  {
+    for (int v = 0; v < 288; v++)
+    {
+      int code, nbits;
+      if (v < 144)
+        code = 0x30 + v, nbits = 8;
+      else if (v < 256)
+        code = 0x190 + v - 144, nbits = 9;
+      else if (v < 280)
+        code = v - 256, nbits = 7;
+      else
+        code = 0xc0 + v - 280, nbits = 8;
+
+      this->lit_code[v] = (uint16_t)reverse_bits(code, nbits);
+      this->lit_bits[v] = (uint8_t)nbits;
+    }
+
+    for (int c = 0; c < 29; c++)
+      for (int l = length_base[c]; l < 259; l++)
+        this->length_index[l] = (uint8_t)c;
+
+    for (int c = 0; c < 30; c++)
+      this->dist_code[c] = (uint8_t)reverse_bits(c, 5);
+  }
+};
+
+static const FixedCodes fixed_codes;
+
+static inline void put_symbol(BitWriter &bw, int v)
+{
+  bw.put(fixed_codes.lit_code[v], fixed_codes.lit_bits[v]);
+}
+
+static inline void put_match(BitWriter &bw, int length, int dist)
+{
+  const int lc = fixed_codes.length_index[length];
+
+  put_symbol(bw, 257 + lc);
+  bw.put(length - length_base[lc], length_extra[lc]);
+
+  const int dc = (int)(std::upper_bound(dist_base, dist_base + 30, dist) -
+                       dist_base) -
+                 1;
+
+  bw.put(fixed_codes.dist_code[dc], 5);
+  bw.put(dist - dist_base[dc], dist_extra[dc]);
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// compress a chunk as a single non-final block, matches do not reference
+// data outside of the chunk
+static void deflate_chunk(const uint8_t *data, size_t n, BitWriter &bw)
+{
+  std::vector<int32_t> head(1 << DEFLATE_HASH_BITS, -1);
+  std::vector<int32_t> prev(n);
+
+  bw.bytes.reserve(n / 4);
+  bw.put(0, 1); // BFINAL
+  bw.put(1, 2); // BTYPE, fixed Huffman codes
+
+  size_t i = 0;
+  while (i < n)
+  {
+    int    best_length = 0;
+    size_t best_dist = 0;
+
+    if (i + 3 <= n)
+    {
+      const uint32_t h = hash3(data + i);
+      const size_t   max_length = std::min((size_t)258, n - i);
+      int32_t        cand = head[h];
+
+      for (int chain = 0; (cand >= 0) and (chain < DEFLATE_MAX_CHAIN);
+           chain++)
+      {
+        if (i - cand > DEFLATE_WINDOW)
+          break;
+
+        const uint8_t *a = data + cand;
+        const uint8_t *b = data + i;
+        size_t         l = 0;
+        while (l < max_length and a[l] == b[l])
+          l++;
+
+        if ((int)l > best_length)
+        {
+          best_length = (int)l;
+          best_dist = i - cand;
+          if (l == max_length)
+            break;
+        }
+        cand = prev[cand];
+      }
+
+      prev[i] = head[h];
+      head[h] = (int32_t)i;
+    }
+
+    if (best_length >= 3)
+    {
+      put_match(bw, best_length, (int)best_dist);
+
+      // the skipped positions are still indexed
+      for (size_t k = i + 1; k < i + best_length and k + 3 <= n; k++)
+      {
+        const uint32_t h = hash3(data + k);
+        prev[k] = head[h];
+        head[h] = (int32_t)k;
+      }
+      i += best_length;
+    }
+    else
+      put_symbol(bw, data[i++]);
+  }
+
+  put_symbol(bw, 256); // end of block
+}
+
+//----------------------------------------------------------------------
+// PNG
+//----------------------------------------------------------------------
+
+// big-endian scanline of the image
+static void png_scanline(const void *pixels,
+                         int         width,
+                         int         bit_depth,
+                         int         r,
+                         uint8_t    *dst)
+{
+  if (bit_depth == 8)
+    std::memcpy(dst, (const uint8_t *)pixels + (size_t)r * width, width);
+  else
+  {
+    const uint16_t *src = (const uint16_t *)pixels + (size_t)r * width;
+    for (int x = 0; x < width; x++)
+    {
+      dst[2 * x] = (uint8_t)(src[x] >> 8);
+      dst[2 * x + 1] = (uint8_t)src[x];
+    }
+  }
+}
+
+// filter the rows, the filter minimizing the sum of absolute differences
+// is used for each row
+static void png_filter(const void           *pixels,
+                       int                   width,
+                       int                   height,
+                       int                   bit_depth,
+                       std::vector<uint8_t> &raw)
+{
+  const int    bpp = bit_depth / 8;
+  const size_t row_size = (size_t)width * bpp;
+
+  raw.resize((row_size + 1) * height);
+
+#pragma omp parallel
+  {
+    std::vector<uint8_t> cur(row_size), up(row_size, 0), tmp(row_size);
+
+#pragma omp for schedule(static)
+    for (int r = 0; r < height; r++)
+    {
+      png_scanline(pixels, width, bit_depth, r, cur.data());
+      if (r > 0)
+        png_scanline(pixels, width, bit_depth, r - 1, up.data());
+      else
+        std::fill(up.begin(), up.end(), 0);
+
+      uint8_t *dst = raw.data() + r * (row_size + 1);
+      long     best_sum = -1;
+
+      for (int f = 0; f < 5; f++)
+      {
+        long sum = 0;
+        for (size_t k = 0; k < row_size; k++)
+        {
+          const int a = k >= (size_t)bpp ? cur[k - bpp] : 0;
+          const int b = up[k];
+          const int c = k >= (size_t)bpp ? up[k - bpp] : 0;
+          int       pred = 0;
+
+          switch (f)
+          {
+          case 1: pred = a; break;
+          case 2: pred = b; break;
+          case 3: pred = (a + b) / 2; break;
+          case 4: pred = paeth(a, b, c); break;
+          }
+
+          tmp[k] = (uint8_t)(cur[k] - pred);
+          sum += std::abs((int)(int8_t)tmp[k]);
+        }
+
+        if (best_sum < 0 or sum < best_sum)
+        {
+          best_sum = sum;
+          dst[0] = (uint8_t)f;
+          std::memcpy(dst + 1, tmp.data(), row_size);
+        }
+      }
+    }
+  }
+}
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t v)
+{
+  out.push_back((uint8_t)(v >> 24));
+  out.push_back((uint8_t)(v >> 16));
+  out.push_back((uint8_t)(v >> 8));
+  out.push_back((uint8_t)v);
+}
+
+static bool write_chunk(FILE          *f,
+                        const char    *type,
+                        const uint8_t *data,
+                        size_t         size,
+                        uint32_t       crc)
+{
+  std::vector<uint8_t> hd;
+  std::vector<uint8_t> ft;
+
+  put_u32(hd, (uint32_t)size);
+  hd.insert(hd.end(), type, type + 4);
+  put_u32(ft, crc ^ 0xffffffffu);
+
+  return std::fwrite(hd.data(), 1, hd.size(), f) == hd.size() and
+         (size == 0 or std::fwrite(data, 1, size, f) == size) and
+         std::fwrite(ft.data(), 1, ft.size(), f) == ft.size();
+}
+
+static uint32_t chunk_crc(const char *type, const uint8_t *data, size_t size)
+{
+  uint32_t crc = crc32_update(0xffffffffu, (const uint8_t *)type, 4);
+  return crc32_update(crc, data, size);
+}
+
+bool write_png_gray(const std::string &fname,
+                    int                width,
+                    int                height,
+                    int                bit_depth,
+                    const void        *pixels)
+{
+  if ((width < 1) or (height < 1) or (bit_depth != 8 and bit_depth != 16))
+  {
+    LOG_ERROR("unsupported image size or bit depth");
+    return false;
+  }
+
+  // --- filtered scanlines, compressed by chunks
+  std::vector<uint8_t> raw;
+  png_filter(pixels, width, height, bit_depth, raw);
+
+  const size_t           n_chunks = (raw.size() + PNG_DEFLATE_CHUNK - 1) /
+                          PNG_DEFLATE_CHUNK;
+  std::vector<BitWriter> blocks(n_chunks);
+  std::vector<uint32_t>  adlers(n_chunks);
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t c = 0; c < n_chunks; c++)
+  {
+    const size_t k0 = c * PNG_DEFLATE_CHUNK;
+    const size_t n = std::min((size_t)PNG_DEFLATE_CHUNK, raw.size() - k0);
+
+    deflate_chunk(raw.data() + k0, n, blocks[c]);
+    adlers[c] = adler32(raw.data() + k0, n);
+  }
+
+  // --- zlib stream
+  BitWriter zs;
+  uint32_t  adler = 1;
+
+  zs.put(0x78, 8); // deflate, 32K window
+  zs.put(0x01, 8); // no preset dictionary, (0x7801 % 31 == 0)
+
+  for (size_t c = 0; c < n_chunks; c++)
+  {
+    zs.append(blocks[c]);
+    BitWriter().bytes.swap(blocks[c].bytes); // release memory early
+
+    const size_t k0 = c * PNG_DEFLATE_CHUNK;
+    adler = adler32_combine(adler,
+                            adlers[c],
+                            std::min((size_t)PNG_DEFLATE_CHUNK,
+                                     raw.size() - k0));
+  }
+
+  zs.put(1, 1);         // BFINAL
+  zs.put(1, 2);         // BTYPE, fixed Huffman codes
+  put_symbol(zs, 256);  // empty final block
+  zs.align();
+  raw.clear();
+
+  std::vector<uint8_t> &idat = zs.bytes;
+  put_u32(idat, adler);
+
+  // --- file
+  std::vector<uint8_t> ihdr;
+  put_u32(ihdr, (uint32_t)width);
+  put_u32(ihdr, (uint32_t)height);
+  ihdr.push_back((uint8_t)bit_depth);
+  ihdr.push_back(0); // grayscale
+  ihdr.push_back(0); // deflate
+  ihdr.push_back(0); // adaptive filtering
+  ihdr.push_back(0); // no interlace
+
+  const size_t          n_idat = (idat.size() + PNG_IDAT_SIZE - 1) /
+                        PNG_IDAT_SIZE;
+  std::vector<uint32_t> crcs(n_idat);
+
+#pragma omp parallel for schedule(static)
+  for (size_t c = 0; c < n_idat; c++)
+  {
+    const size_t k0 = c * PNG_IDAT_SIZE;
+    crcs[c] = chunk_crc("IDAT",
+                        idat.data() + k0,
+                        std::min((size_t)PNG_IDAT_SIZE, idat.size() - k0));
+  }
+
+  FILE *f = std::fopen(fname.c_str(), "wb");
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return false;
+  }
+
+  static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+  bool ok = std::fwrite(signature, 1, 8, f) == 8 and
+            write_chunk(f,
+                        "IHDR",
+                        ihdr.data(),
+                        ihdr.size(),
+                        chunk_crc("IHDR", ihdr.data(), ihdr.size()));
+
+  for (size_t c = 0; ok and (c < n_idat); c++)
+  {
+    const size_t k0 = c * PNG_IDAT_SIZE;
+    ok = write_chunk(f,
+                     "IDAT",
+                     idat.data() + k0,
+                     std::min((size_t)PNG_IDAT_SIZE, idat.size() - k0),
+                     crcs[c]);
+  }
+
+  ok = ok and write_chunk(f, "IEND", nullptr, 0, chunk_crc("IEND", nullptr, 0));
+  ok = (std::fclose(f) == 0) and ok;
+
+  if (!ok)
+    LOG_ERROR("cannot write %s", fname.c_str());
+  return ok;
+}
+
+//----------------------------------------------------------------------
+// heightmaps
+//----------------------------------------------------------------------
+
+// image rows [r0, r1), (i, j) used as (x, y) coordinates
+template <typename U>
+static void image_rows(const Array<Height> &h, int r0, int r1, U *dst)
+{
+  const int ni = h.shape[0];
+  const int nj = h.shape[1];
+
+#pragma omp parallel for schedule(static)
+  for (int rb = r0; rb < r1; rb += EXPORT_ROW_BLOCK)
+  {
+    const int rb1 = std::min(r1, rb + EXPORT_ROW_BLOCK);
+
+    if (h.layout == LAYOUT_COLUMN_MAJOR) // image rows are contiguous
+      for (int r = rb; r < rb1; r++)
+      {
+        const Height *col = &h(0, nj - 1 - r);
+        U            *p = dst + (size_t)(r - r0) * ni;
+        for (int i = 0; i < ni; i++)
+          p[i] = (U)col[i];
+      }
+    else // the rows of a block are read along contiguous segments
+      for (int i = 0; i < ni; i++)
+        for (int r = rb; r < rb1; r++)
+          dst[(size_t)(r - r0) * ni + i] = (U)h(i, nj - 1 - r);
+  }
+}
+
+static bool export_raw_float32(const Array<Height> &h,
+                               const std::string   &fname)
+{
+  if (h.shape[0] < 1)
+    return false;
+
+  FILE *f = std::fopen(fname.c_str(), "wb");
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return false;
+  }
+
+  // converted and written by blocks of rows, to bound the memory used
+  const int          rows = std::max(1, EXPORT_RAW_BLOCK / h.shape[0]);
+  std::vector<float> buffer((size_t)rows * h.shape[0]);
+  bool               ok = true;
+
+  for (int r0 = 0; ok and (r0 < h.shape[1]); r0 += rows)
+  {
+    const int    r1 = std::min(h.shape[1], r0 + rows);
+    const size_t n = (size_t)(r1 - r0) * h.shape[0];
+
+    image_rows(h, r0, r1, buffer.data());
+    ok = std::fwrite(buffer.data(), sizeof(float), n, f) == n;
+  }
+  ok = (std::fclose(f) == 0) and ok;
+
+  if (!ok)
+    LOG_ERROR("cannot write %s", fname.c_str());
+  return ok;
+}
+
+const char *export_extension(ExportFormat format)
+{
+  return format == EXPORT_RAW_FLOAT32 ? ".raw" : ".png";
+}
+
+bool export_heightmap(const Array<Height> &h,
+                      const std::string   &fname,
+                      ExportFormat         format)
+{
+  switch (format)
+  {
+  case EXPORT_PNG_8BIT: return h.to_png(fname);
+
+  case EXPORT_PNG_16BIT:
+  {
+    std::vector<uint16_t> img((size_t)h.shape[0] * h.shape[1]);
+
+    image_rows(h, 0, h.shape[1], img.data());
+    return write_png_gray(fname, h.shape[0], h.shape[1], 16, img.data());
+  }
+
+  case EXPORT_RAW_FLOAT32: return export_raw_float32(h, fname);
+  }
+
+  LOG_ERROR("unknown export format");
+  return false;
+}
+
+ExportWriter::~ExportWriter()
+{
+  this->wait();
+}
+
+void ExportWriter::save(const Array<Height> &h,
+                        const std::string   &fname,
+                        ExportFormat         format)
+{
+  this->wait();
+  this->h = h;
+  this->running = true;
+
+  this->thread = std::thread(
+      [this, fname, format]()
+      {
+        this->success = export_heightmap(this->h, fname, format);
+        this->running = false;
+      });
+}
+
+bool ExportWriter::wait()
+{
+  if (this->thread.joinable())
+    this->thread.join();
+  return this->success;
+}
+
+} // namespace dunescape
@@ -0,0 +1,422 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "macrologger.h"
+
+#include "core/frames.hpp"
+
+namespace dunescape
+{
+
+static_assert(sizeof(FramesHeader) == 40, "unexpected frame header padding");
+static_assert(sizeof(FrameIndexEntry) == 32, "unexpected index padding");
+static_assert(sizeof(FramesFooter) == 24, "unexpected frame footer padding");
+
+static inline void put_varint(std::vector<uint8_t> &out, uint64_t v)
+{
+  while (v >= 0x80)
+  {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+static inline bool get_varint(const uint8_t *&p,
+                              const uint8_t  *end,
+                              uint64_t       &v)
+{
+  v = 0;
+  for (int shift = 0; (p < end) and (shift < 64); shift += 7)
+  {
+    uint8_t byte = *p++;
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// encode the differences between 'cur' and 'prev' ('prev' == nullptr for
+// a keyframe) as (number of unchanged cells, zigzag difference) pairs
+static void encode_frame(const Height         *cur,
+                         const Height         *prev,
+                         size_t                n,
+                         std::vector<uint8_t> &out)
+{
+  out.clear();
+  size_t last = 0; // first cell not encoded yet
+
+  for (size_t k = 0; k < n; k++)
+  {
+    int64_t d = (int64_t)cur[k] - (prev ? (int64_t)prev[k] : 0);
+
+    if (d != 0)
+    {
+      put_varint(out, k - last);
+      put_varint(out, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+      last = k + 1;
+    }
+  }
+  if (last < n)
+    put_varint(out, n - last);
+}
+
+// apply the differences of an encoded frame to 'state' (in place)
+static bool decode_frame(const uint8_t *p,
+                         size_t         size,
+                         Height        *state,
+                         size_t         n)
+{
+  const uint8_t *end = p + size;
+  size_t         k = 0;
+
+  while (p < end)
+  {
+    uint64_t run, z;
+    if (!get_varint(p, end, run) or (run > n - k))
+      return false;
+    k += run;
+
+    if (p == end)
+      break;
+    if ((k >= n) or !get_varint(p, end, z))
+      return false;
+
+    int64_t d = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    state[k] = (Height)((int64_t)state[k] + d);
+    k++;
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+// FrameWriter
+//----------------------------------------------------------------------
+
+FrameWriter::FrameWriter(const std::string &fname,
+                         Shape              shape,
+                         Layout             layout,
+                         int                keyframe_interval)
+    : shape(shape), layout(layout),
+      keyframe_interval(std::max(1, keyframe_interval))
+{
+  this->file = std::fopen(fname.c_str(), "wb");
+  if (!this->file)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  FramesHeader hd;
+  std::memset(&hd, 0, sizeof(hd));
+  std::memcpy(hd.magic, FRAMES_MAGIC, sizeof(hd.magic));
+  hd.version = FRAMES_VERSION;
+  hd.header_size = sizeof(FramesHeader);
+  hd.shape[0] = shape[0];
+  hd.shape[1] = shape[1];
+  hd.layout = layout;
+  hd.height_size = sizeof(Height);
+  hd.keyframe_interval = this->keyframe_interval;
+
+  this->success = std::fwrite(&hd, sizeof(hd), 1, this->file) == 1;
+  this->offset = sizeof(hd);
+
+  this->worker = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+  this->close();
+}
+
+bool FrameWriter::append(const Array<Height> &h, uint64_t cycle)
+{
+  if (!this->file)
+    return false;
+
+  if ((h.shape != this->shape) or (h.layout != this->layout))
+  {
+    LOG_ERROR("frame shape or layout differs from the container's");
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(this->mutex);
+
+  // back-pressure if the encoding cannot keep up
+  this->changed.wait(lock,
+                     [this]
+                     { return this->queue.size() < FRAMES_QUEUE_SIZE; });
+
+  Pending frame;
+  if (!this->free_buffers.empty())
+  {
+    frame.h.swap(this->free_buffers.back());
+    this->free_buffers.pop_back();
+  }
+  frame.h.assign(h.vector.begin(), h.vector.end());
+  frame.cycle = cycle;
+
+  this->queue.push_back(std::move(frame));
+  lock.unlock();
+  this->changed.notify_all();
+
+  return true;
+}
+
+bool FrameWriter::close()
+{
+  if (!this->file)
+    return this->success;
+
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->closing = true;
+  }
+  this->changed.notify_all();
+  this->worker.join();
+
+  // index and footer
+  FramesFooter ft;
+  ft.index_offset = this->offset;
+  ft.frame_count = this->index.size();
+  std::memcpy(ft.magic, FRAMES_MAGIC, sizeof(ft.magic));
+
+  if (!this->index.empty())
+    this->success &= std::fwrite(this->index.data(),
+                                 sizeof(FrameIndexEntry),
+                                 this->index.size(),
+                                 this->file) == this->index.size();
+  this->success &= std::fwrite(&ft, sizeof(ft), 1, this->file) == 1;
+  this->success &= std::fclose(this->file) == 0;
+  this->file = nullptr;
+
+  if (!this->success)
+    LOG_ERROR("error while writing the frame container");
+  return this->success;
+}
+
+void FrameWriter::run()
+{
+  while (true)
+  {
+    Pending frame;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->changed.wait(lock,
+                         [this]
+                         { return this->closing or !this->queue.empty(); });
+
+      if (this->queue.empty())
+        return; // closing, and everything has been written
+
+      frame = std::move(this->queue.front());
+      this->queue.pop_front();
+    }
+    this->changed.notify_all();
+
+    this->write_frame(frame);
+
+    // the previous frame buffer is recycled
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->previous.swap(frame.h);
+    if (!frame.h.empty())
+      this->free_buffers.push_back(std::move(frame.h));
+  }
+}
+
+void FrameWriter::write_frame(const Pending &frame)
+{
+  const bool keyframe = this->index.size() % this->keyframe_interval == 0;
+
+  encode_frame(frame.h.data(),
+               keyframe ? nullptr : this->previous.data(),
+               frame.h.size(),
+               this->encoded);
+
+  FrameIndexEntry entry;
+  entry.cycle = frame.cycle;
+  entry.offset = this->offset;
+  entry.size = this->encoded.size();
+  entry.keyframe = keyframe ? 1 : 0;
+  entry.padding = 0;
+
+  if (!this->encoded.empty())
+    this->success &= std::fwrite(this->encoded.data(),
+                                 1,
+                                 this->encoded.size(),
+                                 this->file) == this->encoded.size();
+
+  this->offset += entry.size;
+  this->index.push_back(entry);
+}
+
+//----------------------------------------------------------------------
+// FrameReader
+//----------------------------------------------------------------------
+
+FrameReader::FrameReader(const std::string &fname)
+{
+  FILE *f = std::fopen(fname.c_str(), "rb");
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  FramesHeader hd;
+  FramesFooter ft;
+  bool         ok = std::fread(&hd, sizeof(hd), 1, f) == 1 and
+          std::memcmp(hd.magic, FRAMES_MAGIC, sizeof(hd.magic)) == 0 and
+          hd.version == FRAMES_VERSION and
+          hd.header_size == sizeof(FramesHeader) and
+          hd.height_size == sizeof(Height);
+
+  ok = ok and (hd.shape[0] > 0) and (hd.shape[1] > 0) and
+       ((size_t)hd.shape[0] * hd.shape[1] <= this->state.max_size()) and
+       ((hd.layout == LAYOUT_ROW_MAJOR) or (hd.layout == LAYOUT_COLUMN_MAJOR));
+
+  ok = ok and std::fseek(f, -(long)sizeof(ft), SEEK_END) == 0 and
+       std::fread(&ft, sizeof(ft), 1, f) == 1 and
+       std::memcmp(ft.magic, FRAMES_MAGIC, sizeof(ft.magic)) == 0;
+
+  // the index is to fill the file between the frames and the footer,
+  // checked before it is allocated (the counts of a corrupted file are
+  // arbitrary)
+  const long     end = ok ? std::ftell(f) : -1;
+  const uint64_t file_size = end > 0 ? (uint64_t)end : 0;
+
+  ok = ok and (ft.index_offset >= sizeof(FramesHeader)) and
+       (ft.index_offset <= file_size) and
+       (ft.frame_count <= file_size / sizeof(FrameIndexEntry)) and
+       (ft.index_offset + ft.frame_count * sizeof(FrameIndexEntry) +
+            sizeof(FramesFooter) ==
+        file_size);
+
+  if (ok)
+  {
+    this->index.resize(ft.frame_count);
+    ok = std::fseek(f, (long)ft.index_offset, SEEK_SET) == 0 and
+         std::fread(this->index.data(),
+                    sizeof(FrameIndexEntry),
+                    ft.frame_count,
+                    f) == ft.frame_count;
+
+    // every frame lies between the header and the index
+    for (size_t k = 0; ok and (k < this->index.size()); k++)
+    {
+      const FrameIndexEntry &e = this->index[k];
+
+      ok = (e.offset >= sizeof(FramesHeader)) and
+           (e.offset <= ft.index_offset) and
+           (e.size <= ft.index_offset - e.offset);
+    }
+
+    // the first frame is to be a keyframe, the others being decoded from
+    // the closest one before them
+    ok = ok and (this->index.empty() or this->index[0].keyframe);
+  }
+
+  if (!ok)
+  {
+    LOG_ERROR("%s is not a valid frame container (or was not closed)",
+              fname.c_str());
+    this->index.clear();
+    std::fclose(f);
+    return;
+  }
+
+  // (a valid shape can still be too large for the memory available)
+  try
+  {
+    this->state.resize((size_t)hd.shape[0] * hd.shape[1]);
+  }
+  catch (const std::bad_alloc &)
+  {
+    LOG_ERROR("%s: cannot allocate {%d, %d} frames",
+              fname.c_str(),
+              hd.shape[0],
+              hd.shape[1]);
+    this->index.clear();
+    std::fclose(f);
+    return;
+  }
+
+  this->file = f;
+  this->shape = {hd.shape[0], hd.shape[1]};
+  this->layout = (Layout)hd.layout;
+}
+
+FrameReader::~FrameReader()
+{
+  if (this->file)
+    std::fclose(this->file);
+}
+
+bool FrameReader::apply_frame(size_t k)
+{
+  const FrameIndexEntry &entry = this->index[k];
+
+  if (entry.keyframe)
+    std::fill(this->state.begin(), this->state.end(), 0);
+
+  this->encoded.resize(entry.size);
+  bool ok = std::fseek(this->file, (long)entry.offset, SEEK_SET) == 0 and
+            std::fread(this->encoded.data(), 1, entry.size, this->file) ==
+                entry.size and
+            decode_frame(this->encoded.data(),
+                         entry.size,
+                         this->state.data(),
+                         this->state.size());
+
+  this->state_frame = ok ? (long)k : -1;
+  return ok;
+}
+
+bool FrameReader::read_frame(size_t k, Array<Height> &h)
+{
+  if (!this->file or (k >= this->index.size()))
+    return false;
+
+  // closest keyframe before k, or continue from the current state
+  size_t k0 = k;
+  while ((k0 > 0) and !this->index[k0].keyframe)
+    k0--;
+  if (!this->index[k0].keyframe)
+  {
+    LOG_ERROR("no keyframe before frame %zu", k);
+    return false;
+  }
+  if ((this->state_frame >= (long)k0) and (this->state_frame <= (long)k))
+    k0 = this->state_frame + 1;
+
+  for (size_t q = k0; q <= k; q++)
+    if (!this->apply_frame(q))
+    {
+      LOG_ERROR("corrupted frame %zu", q);
+      return false;
+    }
+
+  h = Array<Height>(this->shape, this->layout);
+  h.vector.assign(this->state.begin(), this->state.end());
+  return true;
+}
+
+bool FrameReader::read_cycle(uint64_t cycle, Array<Height> &h)
+{
+  auto it = std::upper_bound(this->index.begin(),
+                             this->index.end(),
+                             cycle,
+                             [](uint64_t c, const FrameIndexEntry &e)
+                             { return c < e.cycle; });
+
+  if (it == this->index.begin())
+    return false;
+  return this->read_frame(it - this->index.begin() - 1, h);
+}
+
+} // namespace dunescape
@@ -0,0 +1,137 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "core/histogram.hpp"
+
+namespace dunescape
+{
+
+void HeightHistogram::set_counts(std::vector<uint64_t> new_counts)
+{
+  this->histogram = std::move(new_counts);
+  this->n_cells = 0;
+  this->mass = 0;
+  this->sum2 = 0;
+
+  for (size_t v = 0; v < this->histogram.size(); v++)
+  {
+    this->n_cells += this->histogram[v];
+    this->mass += v * this->histogram[v];
+    this->sum2 += v * v * this->histogram[v];
+  }
+
+  for (auto &d : this->deltas)
+    d = Delta();
+
+  this->merge();
+}
+
+void HeightHistogram::merge()
+{
+  for (auto &d : this->deltas)
+  {
+    if (d.counts.size() > this->histogram.size())
+      this->histogram.resize(d.counts.size(), 0);
+
+    for (size_t v = 0; v < d.counts.size(); v++)
+    {
+      this->histogram[v] += d.counts[v];
+      d.counts[v] = 0;
+    }
+    this->mass += d.mass;
+    this->sum2 += d.sum2;
+    d.mass = 0;
+    d.sum2 = 0;
+  }
+
+  // (the range of heights is small, a few hundreds at most)
+  const int n = (int)this->histogram.size();
+
+  this->vmin = 0;
+  while ((this->vmin < n - 1) and (this->histogram[this->vmin] == 0))
+    this->vmin++;
+
+  this->vmax = std::max(0, n - 1);
+  while ((this->vmax > 0) and (this->histogram[this->vmax] == 0))
+    this->vmax--;
+}
+
+HeightSummary HeightHistogram::summary() const
+{
+  HeightSummary s;
+
+  s.n_cells = this->n_cells;
+  s.mass = this->mass;
+  s.min = this->vmin;
+  s.max = this->vmax;
+
+  if (this->n_cells > 0)
+  {
+    const double n = (double)this->n_cells;
+    const double bare = this->histogram.empty() ? 0. : this->histogram[0];
+
+    s.mean = (double)this->mass / n;
+    s.rms = std::sqrt(std::max(0., (double)this->sum2 / n - s.mean * s.mean));
+    s.sandy_fraction = (float)(1. - bare / n);
+  }
+
+  return s;
+}
+
+ConvergenceDetector::ConvergenceDetector(int window, float tolerance)
+    : window(std::max(1, window)), tolerance(tolerance),
+      last_residual(std::numeric_limits<double>::infinity())
+{
+  this->samples.resize((size_t)2 * this->window * n_measures);
+}
+
+bool ConvergenceDetector::update(uint64_t flux, const HeightSummary &s)
+{
+  const double x[n_measures] = {(double)flux, s.rms, s.mean};
+  const size_t w = (size_t)this->window;
+
+  // ring buffer of the last 2 * window cycles: the sample leaving the
+  // recent window enters the previous one, the oldest sample is dropped
+  const size_t slot = this->n_samples % (2 * w);
+  const size_t middle = (this->n_samples + w) % (2 * w);
+
+  for (int m = 0; m < n_measures; m++)
+  {
+    if (this->n_samples >= w)
+    {
+      const double crossing = this->samples[middle * n_measures + m];
+      this->sum_recent[m] -= crossing;
+      this->sum_previous[m] += crossing;
+    }
+    if (this->n_samples >= 2 * w)
+      this->sum_previous[m] -= this->samples[slot * n_measures + m];
+
+    this->samples[slot * n_measures + m] = x[m];
+    this->sum_recent[m] += x[m];
+  }
+  this->n_samples++;
+
+  if (this->n_samples < 2 * w)
+    return false;
+
+  this->last_residual = 0.;
+  for (int m = 0; m < n_measures; m++)
+  {
+    const double a = this->sum_recent[m];
+    const double b = this->sum_previous[m];
+    const double scale = std::max(std::abs(a), std::abs(b));
+
+    if (scale > 0.)
+      this->last_residual = std::max(this->last_residual,
+                                     std::abs(a - b) / scale);
+  }
+
+  this->is_converged = this->last_residual < this->tolerance;
+  return this->is_converged;
+}
+
+} // namespace dunescape
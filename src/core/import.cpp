@@ -0,0 +1,392 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "macrologger.h"
+
+#include "core/import.hpp"
+#include "core/png.hpp"
+#include "core/storage.hpp"
+
+#define IMPORT_ROW_BLOCK 64        // image rows quantized at once
+#define PNG_MAX_INFLATE_RATIO 1032 // deflate expands by 1032:1 at most
+
+namespace dunescape
+{
+
+static const char *names[] = {"png", "raw8", "raw16", "raw"};
+
+bool import_format_from_name(const std::string &name, ImportFormat &format)
+{
+  for (int k = IMPORT_PNG; k <= IMPORT_RAW_FLOAT32; k++)
+    if (name == names[k])
+    {
+      format = (ImportFormat)k;
+      return true;
+    }
+  return false;
+}
+
+//----------------------------------------------------------------------
+// quantization
+//----------------------------------------------------------------------
+
+// image rows to sand height, (i, j) used as (x, y) coordinates and
+// 'load(r, x)' returning the value of pixel x of image row r
+template <typename Load>
+static void quantize_rows(Array<Height> &h,
+                          const Load    &load,
+                          float          scale,
+                          float          offset)
+{
+  const int   ni = h.shape[0];
+  const int   nj = h.shape[1];
+  const float hmax = (float)std::numeric_limits<Height>::max();
+
+  auto quantize = [&](float v) -> Height
+  {
+    v = std::min(std::max(0.f, (v - offset) * scale), hmax);
+    return (Height)(v + 0.5f);
+  };
+
+#pragma omp parallel for schedule(static)
+  for (int rb = 0; rb < nj; rb += IMPORT_ROW_BLOCK)
+  {
+    const int rb1 = std::min(nj, rb + IMPORT_ROW_BLOCK);
+
+    if (h.layout == LAYOUT_COLUMN_MAJOR) // image rows are contiguous
+      for (int r = rb; r < rb1; r++)
+      {
+        Height *col = &h(0, nj - 1 - r);
+        for (int i = 0; i < ni; i++)
+          col[i] = quantize(load(r, i));
+      }
+    else // the rows of a block are written along contiguous segments
+      for (int i = 0; i < ni; i++)
+        for (int r = rb; r < rb1; r++)
+          h(i, nj - 1 - r) = quantize(load(r, i));
+  }
+}
+
+template <typename T>
+static bool import_raw(Array<Height> &h,
+                       const void    *data,
+                       size_t         bytes,
+                       float          scale,
+                       float          offset)
+{
+  const size_t ni = (size_t)h.shape[0];
+
+  if (bytes != ni * h.shape[1] * sizeof(T))
+  {
+    LOG_ERROR("raw heightmap of %zu bytes, %zu expected for {%d, %d}",
+              bytes,
+              ni * h.shape[1] * sizeof(T),
+              h.shape[0],
+              h.shape[1]);
+    return false;
+  }
+
+  // native values, read straight from the mapping
+  const T *src = (const T *)data;
+
+  advise_storage(data, bytes, STORAGE_WILL_NEED);
+  quantize_rows(
+      h,
+      [src, ni](int r, int x) { return (float)src[r * ni + x]; },
+      scale,
+      offset);
+  return true;
+}
+
+//----------------------------------------------------------------------
+// PNG
+//----------------------------------------------------------------------
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+struct PngChunk
+{
+  const uint8_t *type; // followed by the data, then the CRC
+  uint32_t       size;
+};
+
+// split a PNG file in chunks, up to IEND, with their CRC checked in
+// parallel
+static bool png_chunks(const uint8_t         *data,
+                       size_t                 bytes,
+                       std::vector<PngChunk> &chunks)
+{
+  static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+  if ((bytes < 8) or (std::memcmp(data, signature, 8) != 0))
+  {
+    LOG_ERROR("not a PNG file");
+    return false;
+  }
+
+  for (size_t k = 8; true; k += 12 + chunks.back().size)
+  {
+    if ((bytes - k < 12) or (bytes - k - 12 < get_u32(data + k)))
+    {
+      LOG_ERROR("truncated PNG file");
+      return false;
+    }
+    chunks.push_back({data + k + 4, get_u32(data + k)});
+
+    if (std::memcmp(chunks.back().type, "IEND", 4) == 0)
+      break;
+  }
+
+  bool ok = true;
+
+#pragma omp parallel for schedule(dynamic) reduction(&& : ok)
+  for (size_t c = 0; c < chunks.size(); c++)
+  {
+    const uint8_t *p = chunks[c].type;
+    const uint32_t crc = crc32_update(0xffffffffu, p, 4 + chunks[c].size);
+
+    ok = ok and ((crc ^ 0xffffffffu) == get_u32(p + 4 + chunks[c].size));
+  }
+
+  if (!ok)
+    LOG_ERROR("PNG chunk checksum mismatch");
+  return ok;
+}
+
+// reverse the filter of each row in place, rows of 1 + row_size bytes
+static bool png_unfilter(uint8_t *raw, int height, size_t row_size, int bpp)
+{
+  std::vector<uint8_t> zero(row_size, 0); // above the first row
+  const uint8_t       *up = zero.data();
+
+  for (int r = 0; r < height; r++, up = raw + 1, raw += row_size + 1)
+  {
+    uint8_t *cur = raw + 1;
+
+    switch (raw[0])
+    {
+    case 0: break;
+    case 1:
+      for (size_t k = bpp; k < row_size; k++)
+        cur[k] += cur[k - bpp];
+      break;
+    case 2:
+      for (size_t k = 0; k < row_size; k++)
+        cur[k] += up[k];
+      break;
+    case 3:
+      for (size_t k = 0; k < (size_t)bpp; k++)
+        cur[k] += up[k] / 2;
+      for (size_t k = bpp; k < row_size; k++)
+        cur[k] += (cur[k - bpp] + up[k]) / 2;
+      break;
+    case 4:
+      for (size_t k = 0; k < (size_t)bpp; k++)
+        cur[k] += up[k];
+      for (size_t k = bpp; k < row_size; k++)
+        cur[k] += paeth(cur[k - bpp], up[k], up[k - bpp]);
+      break;
+    default: LOG_ERROR("invalid PNG filter type %d", raw[0]); return false;
+    }
+  }
+  return true;
+}
+
+// channels per color type, 0 for palette and invalid types
+static const int channels_of[7] = {1, 0, 3, 0, 2, 0, 4};
+
+static bool import_png(Array<Height> &h,
+                       const void    *data,
+                       size_t         bytes,
+                       float          scale,
+                       float          offset)
+{
+  std::vector<PngChunk> chunks;
+
+  if (!png_chunks((const uint8_t *)data, bytes, chunks))
+    return false;
+
+  // --- header
+  const uint8_t *ihdr = chunks[0].type + 4;
+
+  if ((std::memcmp(chunks[0].type, "IHDR", 4) != 0) or (chunks[0].size != 13))
+  {
+    LOG_ERROR("invalid PNG header");
+    return false;
+  }
+
+  const uint32_t width = get_u32(ihdr);
+  const uint32_t height = get_u32(ihdr + 4);
+  const int      bit_depth = ihdr[8];
+  const int      color_type = ihdr[9];
+  const int      channels = color_type <= 6 ? channels_of[color_type] : 0;
+
+  if ((bit_depth != 8 and bit_depth != 16) or (channels == 0) or
+      (ihdr[10] != 0) or (ihdr[11] != 0) or (ihdr[12] != 0))
+  {
+    LOG_ERROR("unsupported PNG image (bit depth %d, color type %d, "
+              "interlace %d), 8 or 16 bit non-palette images expected",
+              bit_depth,
+              color_type,
+              ihdr[12]);
+    return false;
+  }
+
+  if ((width != (uint32_t)h.shape[0]) or (height != (uint32_t)h.shape[1]))
+  {
+    LOG_ERROR("PNG image of {%u, %u}, {%d, %d} expected",
+              width,
+              height,
+              h.shape[0],
+              h.shape[1]);
+    return false;
+  }
+
+  // --- image data, the IDAT chunks forming a single zlib stream
+  std::vector<uint8_t> zs;
+
+  for (const PngChunk &c : chunks)
+    if (std::memcmp(c.type, "IDAT", 4) == 0)
+      zs.insert(zs.end(), c.type + 4, c.type + 4 + c.size);
+
+  const int    bpp = channels * bit_depth / 8;
+  const size_t row_size = (size_t)width * bpp;
+
+  std::vector<uint8_t> raw((row_size + 1) * height);
+
+  if (!inflate_zlib(zs.data(), zs.size(), raw.data(), raw.size()))
+    return false;
+  zs = std::vector<uint8_t>();
+
+  if (!png_unfilter(raw.data(), (int)height, row_size, bpp))
+    return false;
+
+  // --- first channel of each pixel, big-endian samples
+  const uint8_t *pixels = raw.data() + 1;
+  const size_t   stride = row_size + 1;
+
+  if (bit_depth == 8)
+    quantize_rows(
+        h,
+        [pixels, stride, bpp](int r, int x)
+        { return (float)pixels[r * stride + (size_t)x * bpp]; },
+        scale,
+        offset);
+  else
+    quantize_rows(
+        h,
+        [pixels, stride, bpp](int r, int x)
+        {
+          const uint8_t *p = pixels + r * stride + (size_t)x * bpp;
+          return (float)((p[0] << 8) | p[1]);
+        },
+        scale,
+        offset);
+  return true;
+}
+
+//----------------------------------------------------------------------
+// heightmaps
+//----------------------------------------------------------------------
+
+bool read_png_shape(const std::string &fname, Shape &shape)
+{
+  static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+  // signature and IHDR chunk (length, type, 13 bytes of data, CRC)
+  uint8_t header[33];
+  FILE   *f = std::fopen(fname.c_str(), "rb");
+
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return false;
+  }
+
+  const bool ok =
+      (std::fread(header, 1, 33, f) == 33) and
+      (std::memcmp(header, signature, 8) == 0) and
+      (get_u32(header + 8) == 13) and
+      (std::memcmp(header + 12, "IHDR", 4) == 0) and
+      ((crc32_update(0xffffffffu, header + 12, 17) ^ 0xffffffffu) ==
+       get_u32(header + 29));
+
+  const bool sized = ok and (std::fseek(f, 0, SEEK_END) == 0);
+  const long bytes = sized ? std::ftell(f) : -1;
+  std::fclose(f);
+
+  if (!ok or (bytes < 0))
+  {
+    LOG_ERROR("%s is not a valid PNG file", fname.c_str());
+    return false;
+  }
+
+  const uint32_t width = get_u32(header + 16);
+  const uint32_t height = get_u32(header + 20);
+
+  // the image data, at least one byte per pixel and one per row, cannot
+  // be compressed beyond the ratio of deflate
+  if ((width == 0) or (width > (uint32_t)INT32_MAX) or (height == 0) or
+      (height > (uint32_t)INT32_MAX) or
+      (((uint64_t)width + 1) * height >
+       (uint64_t)bytes * PNG_MAX_INFLATE_RATIO))
+  {
+    LOG_ERROR("%s: PNG image of {%u, %u} inconsistent with its size of %ld "
+              "bytes",
+              fname.c_str(),
+              width,
+              height,
+              bytes);
+    return false;
+  }
+
+  shape = {(int)width, (int)height};
+  return true;
+}
+
+bool import_heightmap(Array<Height>     &h,
+                      const std::string &fname,
+                      ImportFormat       format,
+                      float              scale,
+                      float              offset)
+{
+  size_t      bytes = 0;
+  const void *data = map_input_file(fname, bytes);
+
+  if (!data)
+    return false;
+
+  bool ok = false;
+
+  switch (format)
+  {
+  case IMPORT_PNG: ok = import_png(h, data, bytes, scale, offset); break;
+  case IMPORT_RAW_UINT8:
+    ok = import_raw<uint8_t>(h, data, bytes, scale, offset);
+    break;
+  case IMPORT_RAW_UINT16:
+    ok = import_raw<uint16_t>(h, data, bytes, scale, offset);
+    break;
+  case IMPORT_RAW_FLOAT32:
+    ok = import_raw<float>(h, data, bytes, scale, offset);
+    break;
+  }
+
+  unmap_storage_file((void *)data, bytes);
+
+  if (!ok)
+    LOG_ERROR("cannot import %s", fname.c_str());
+  return ok;
+}
+
+} // namespace dunescape
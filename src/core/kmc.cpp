@@ -0,0 +1,182 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <cmath>
+#include <utility>
+
+#include "core/kmc.hpp"
+
+namespace dunescape
+{
+
+KineticMonteCarlo::KineticMonteCarlo(DuneField &df) : df(df)
+{
+  this->rebuild();
+}
+
+void KineticMonteCarlo::rebuild()
+{
+  const Storage<uint64_t> &words = this->df.active.words;
+  const size_t             n = words.size();
+
+  this->counts.resize(n);
+  this->total = 0;
+
+  for (size_t w = 0; w < n; w++)
+  {
+    this->counts[w] = (uint8_t)__builtin_popcountll(words[w]);
+    this->total += this->counts[w];
+  }
+
+  // sums of the counts of KMC_FAN_OUT children per node, level by level
+  // up to a single root
+  this->sums.clear();
+
+  for (size_t m = n; (m > 1) or this->sums.empty();)
+  {
+    std::vector<uint32_t> level((m + KMC_FAN_OUT - 1) / KMC_FAN_OUT, 0);
+
+    for (size_t c = 0; c < m; c++)
+      level[c / KMC_FAN_OUT] += this->sums.empty() ? this->counts[c]
+                                                   : this->sums.back()[c];
+    m = level.size();
+    this->sums.push_back(std::move(level));
+  }
+
+  this->changes.clear();
+}
+
+size_t KineticMonteCarlo::find_word(uint64_t &k) const
+{
+  // descend from the root, skipping the children holding at most k active
+  // cells (k < total, so the descent never runs past the last child)
+  size_t c = 0;
+
+  for (int l = (int)this->sums.size() - 2; l >= 0; l--)
+  {
+    const std::vector<uint32_t> &level = this->sums[l];
+
+    for (c *= KMC_FAN_OUT; level[c] <= k; c++)
+      k -= level[c];
+  }
+
+  for (c *= KMC_FAN_OUT; this->counts[c] <= k; c++)
+    k -= this->counts[c];
+
+  return c;
+}
+
+void KineticMonteCarlo::apply_changes()
+{
+  const Storage<uint64_t> &words = this->df.active.words;
+
+  for (size_t w : this->changes)
+  {
+    const int c = __builtin_popcountll(words[w]);
+    const int d = c - this->counts[w];
+
+    if (d == 0)
+      continue;
+
+    this->counts[w] = (uint8_t)c;
+    this->total += d;
+    for (size_t l = 0, node = w / KMC_FAN_OUT; l < this->sums.size();
+         l++, node /= KMC_FAN_OUT)
+      this->sums[l][node] += d;
+  }
+  this->changes.clear();
+}
+
+uint64_t KineticMonteCarlo::run(double duration)
+{
+  DuneField &df = this->df;
+  const int  nj = df.shape[1];
+  const int  wpc = df.active.words_per_column;
+  uint64_t   n_moves = 0;
+
+  // slabs blown in, a Poisson process of rate 'sand_inflow' per column
+  const double inflow = df.boundary == BOUNDARY_OPEN
+                            ? (double)df.sand_inflow * nj
+                            : 0.;
+  const double t_end = this->time + duration;
+
+  STATS_RESERVE(df.stats);
+  df.heights.reserve();
+
+  df.active_changes.assign(1, &this->changes);
+
+  while (this->time < t_end)
+  {
+    const double rate = (double)this->total + inflow;
+    const double t_cycle = std::floor(this->time) + 1.;
+
+    // time of the next event, the process being memoryless the draw is
+    // simply discarded if the cycle (or the run) ends before
+    CounterRng   rng(df.seed,
+                     df.cycle_count,
+                     KMC_RNG_STREAM + this->cycle_events++);
+    const double u = (double)((rng.next_u64() >> 11) + 1) /
+                     9007199254740992.; // in ]0, 1]
+    const double t = rate > 0. ? this->time - std::log(u) / rate : INFINITY;
+
+    if (t >= std::min(t_cycle, t_end))
+    {
+      if (t_cycle > t_end)
+      {
+        this->time = t_end;
+        break;
+      }
+
+      // end of a cycle, the avalanches are relaxed in parallel
+      this->time = t_cycle;
+      df.active_changes.clear();
+
+      if (df.relax_avalanches)
+      {
+        STATS_TIMER(t0);
+        df.relax();
+        this->rebuild();
+        STATS_TIME(df.stats, STATS_PHASE_RELAX, t0);
+      }
+
+      df.heights.merge();
+      df.cycle_count++;
+      this->cycle_events = 0;
+      STATS_CYCLE(df.stats);
+
+      df.active_changes.assign(1, &this->changes);
+      continue;
+    }
+
+    this->time = t;
+    this->n_events++;
+
+    if ((inflow > 0.) and (rng.next_float() * rate >= (double)this->total))
+      df.move_slab(-1, (int)rng.next_below(nj), rng);
+    else
+    {
+      // k-th active cell, k-th bit set of its word
+      uint64_t     k = rng.next_below(this->total);
+      const size_t w = this->find_word(k);
+      uint64_t     x = df.active.words[w];
+
+      for (; k > 0; k--)
+        x &= x - 1;
+
+      const int i = (int)(w % wpc) * 64 + __builtin_ctzll(x);
+      const int j = (int)(w / wpc);
+
+      df.move_slab(i, j, rng);
+      STATS_COUNT(df.stats, n_eroded, 1);
+    }
+
+    n_moves++;
+    this->apply_changes();
+  }
+
+  df.active_changes.clear();
+  df.heights.merge();
+  return n_moves;
+}
+
+} // namespace dunescape
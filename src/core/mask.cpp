@@ -0,0 +1,66 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <algorithm>
+
+#include "core/mask.hpp"
+
+namespace dunescape
+{
+
+Mask::Mask(Shape shape, const MappedAllocator<uint64_t> &allocator)
+    : words(allocator)
+{
+  this->set_shape(shape);
+}
+
+void Mask::set_shape(Shape new_shape)
+{
+  this->shape = new_shape;
+  this->words_per_column = (this->shape[0] + 63) / 64;
+  this->words.assign((size_t)this->shape[1] * this->words_per_column, 0);
+}
+
+size_t Mask::count() const
+{
+  size_t n = 0;
+  for (auto &w : this->words)
+    n += __builtin_popcountll(w);
+  return n;
+}
+
+void Mask::fill(bool value)
+{
+  if (!value)
+  {
+    std::fill(this->words.begin(), this->words.end(), 0);
+    return;
+  }
+
+  // padding bits at the end of each column are kept to 0
+  const int      nlast = this->shape[0] - 64 * (this->words_per_column - 1);
+  const uint64_t last = nlast == 64 ? ~(uint64_t)0
+                                    : (((uint64_t)1 << nlast) - 1);
+
+  for (int j = 0; j < this->shape[1]; j++)
+  {
+    uint64_t *col = this->column(j);
+    for (int k = 0; k < this->words_per_column - 1; k++)
+      col[k] = ~(uint64_t)0;
+    if (this->words_per_column > 0)
+      col[this->words_per_column - 1] = last;
+  }
+}
+
+Array<uint8_t> Mask::to_array() const
+{
+  Array<uint8_t> array = Array<uint8_t>(this->shape);
+
+  for (int i = 0; i < this->shape[0]; i++)
+    for (int j = 0; j < this->shape[1]; j++)
+      array(i, j) = (*this)(i, j);
+  return array;
+}
+
+} // namespace dunescape
@@ -0,0 +1,226 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "core/multires.hpp"
+
+namespace dunescape
+{
+
+// full resolution cells covered by cell k of an axis of n0 cells, at a
+// level whose cells cover (up to) 'scale' of them
+static int64_t extent(int k, int scale, int n0)
+{
+  return std::min(scale, n0 - k * scale);
+}
+
+Array<Height> downsample_heights(const Array<Height> &h,
+                                 Shape               shape0,
+                                 int                 level)
+{
+  const int     scale = 1 << level;
+  const Shape   shape = {(h.shape[0] + 1) / 2, (h.shape[1] + 1) / 2};
+  Array<Height> hc(shape, h.layout);
+
+  // sums in fine slabs times full resolution cells, the remainder (less
+  // than one coarse slab) being carried over along the columns
+  int64_t carry = 0;
+
+  for (int jc = 0; jc < shape[1]; jc++)
+    for (int ic = 0; ic < shape[0]; ic++)
+    {
+      const int i1 = std::min(2 * ic + 2, h.shape[0]);
+      const int j1 = std::min(2 * jc + 2, h.shape[1]);
+      int64_t   sum = carry;
+
+      for (int j = 2 * jc; j < j1; j++)
+        for (int i = 2 * ic; i < i1; i++)
+          sum += extent(i, scale, shape0[0]) * extent(j, scale, shape0[1]) *
+                 h(i, j);
+
+      const int64_t n = 2 * extent(ic, 2 * scale, shape0[0]) *
+                        extent(jc, 2 * scale, shape0[1]);
+      hc(ic, jc) = (Height)(sum / n);
+      carry = sum % n;
+    }
+
+  return hc;
+}
+
+Array<Height> upsample_heights(const Array<Height> &h,
+                               Shape               shape0,
+                               int                 level,
+                               Boundary            boundary)
+{
+  const int     nic = h.shape[0];
+  const int     njc = h.shape[1];
+  const int     scale = 1 << (level - 1); // of the fine cells
+  const Shape   shape = {(shape0[0] + scale - 1) / scale,
+                         (shape0[1] + scale - 1) / scale};
+  const int64_t hmax = std::numeric_limits<Height>::max();
+  Array<Height> hf(shape, h.layout);
+
+  // coarse neighbor along an axis, wrapped or clamped
+  auto neighbor = [](int k, int n, bool periodic)
+  {
+    if (k < 0)
+      return periodic ? k + n : 0;
+    if (k >= n)
+      return periodic ? k - n : n - 1;
+    return k;
+  };
+
+  // sand in fine slabs times full resolution cells, the remainder that
+  // cannot be shared out (less than the area of a fine cell) being
+  // carried over along the columns
+  int64_t carry = 0;
+
+  for (int jc = 0; jc < njc; jc++)
+    for (int ic = 0; ic < nic; ic++)
+    {
+      // the centers of the fine cells are a quarter of a coarse cell away
+      // from the center of their coarse cell, towards the neighbor
+      // weighted by 1/4
+      double  v[4];
+      int64_t area[4];
+      int     fi[4], fj[4];
+      int     n = 0;
+      double  sum = 0.;
+
+      for (int dj = 0; dj < 2; dj++)
+        for (int di = 0; di < 2; di++)
+        {
+          const int i = 2 * ic + di;
+          const int j = 2 * jc + dj;
+
+          if ((i >= shape[0]) or (j >= shape[1]))
+            continue;
+
+          const int in = neighbor(ic + 2 * di - 1,
+                                  nic,
+                                  periodic_rows(boundary));
+          const int jn = neighbor(jc + 2 * dj - 1,
+                                  njc,
+                                  periodic_columns(boundary));
+
+          fi[n] = i;
+          fj[n] = j;
+          area[n] = extent(i, scale, shape0[0]) *
+                    extent(j, scale, shape0[1]);
+          v[n] = 0.5625 * h(ic, jc) + 0.1875 * (h(in, jc) + h(ic, jn)) +
+                 0.0625 * h(in, jn);
+          sum += v[n] * area[n];
+          n++;
+        }
+
+      // sand of the coarse cell shared by the fine cells in proportion to
+      // the interpolated heights
+      const int64_t total = 2 * extent(ic, 2 * scale, shape0[0]) *
+                                extent(jc, 2 * scale, shape0[1]) *
+                                h(ic, jc) +
+                            carry;
+      int64_t       w[4];
+      double        frac[4];
+      int64_t       left = total;
+
+      for (int k = 0; k < n; k++)
+      {
+        const double x = sum > 0. ? v[k] * total / sum : 0.;
+        w[k] = (int64_t)x;
+        frac[k] = x - w[k];
+        left -= w[k] * area[k];
+      }
+
+      // rounding errors on the shares taken back from the smallest
+      // remainders, then largest remainders first (lowest index on ties)
+      // among the cells that still fit
+      while (left < 0)
+      {
+        int kmin = -1;
+        for (int k = 0; k < n; k++)
+          if ((w[k] > 0) and ((kmin < 0) or (frac[k] < frac[kmin])))
+            kmin = k;
+        w[kmin]--;
+        frac[kmin] = 2.;
+        left += area[kmin];
+      }
+
+      while (true)
+      {
+        int kmax = -1;
+        for (int k = 0; k < n; k++)
+          if ((area[k] <= left) and ((kmax < 0) or (frac[k] > frac[kmax])))
+            kmax = k;
+        if (kmax < 0)
+          break;
+        w[kmax]++;
+        frac[kmax] = -1.;
+        left -= area[kmax];
+      }
+
+      carry = left;
+
+      for (int k = 0; k < n; k++)
+        hf(fi[k], fj[k]) = (Height)std::min(w[k], hmax);
+    }
+
+  return hf;
+}
+
+void warm_start(DuneField              &df,
+                const MultiresSchedule &schedule,
+                MultiresCallback        on_level)
+{
+  const int n_coarse = std::max(0, schedule.levels - 1);
+
+  if (n_coarse == 0)
+    return;
+
+  // shapes of the levels, full resolution first, and coarsest height
+  std::vector<Shape> shapes = {df.shape};
+  Array<Height>      h = df.h;
+
+  for (int k = 1; k <= n_coarse; k++)
+  {
+    h = downsample_heights(h, df.shape, k - 1);
+    shapes.push_back(h.shape);
+  }
+
+  for (int k = n_coarse; k > 0; k--)
+  {
+    DuneField c(shapes[k], df.h.layout);
+
+    c.shadow_slope = df.shadow_slope;
+    c.hop_length = std::max(1, df.hop_length >> k);
+    c.prob_deposit_bare = df.prob_deposit_bare;
+    c.prob_deposit_sand = df.prob_deposit_sand;
+    c.relax_avalanches = df.relax_avalanches;
+    c.boundary = df.boundary;
+    c.sand_inflow = df.sand_inflow;
+    c.seed = df.seed;
+
+    c.h = std::move(h);
+    c.update_shadow();
+    if (c.relax_avalanches)
+      c.queue_relaxation();
+
+    for (int it = 0; it < schedule.cycles_at(n_coarse - k); it++)
+      c.cycle();
+
+    if (on_level)
+      on_level(c, n_coarse - k);
+
+    h = upsample_heights(c.h, df.shape, k, df.boundary);
+  }
+
+  df.h = std::move(h);
+  df.update_shadow();
+  df.modified_columns.assign(df.shape[1], 1);
+  if (df.relax_avalanches)
+    df.queue_relaxation();
+}
+
+} // namespace dunescape
@@ -0,0 +1,483 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "macrologger.h"
+
+#include "core/png.hpp"
+
+#define ADLER_BASE 65521
+#define ADLER_BLOCK 1048576   // bytes checksummed independently
+#define INFLATE_FAST_BITS 9   // codes decoded with a single table lookup
+#define INFLATE_MAX_BITS 15   // longest Huffman code
+#define INFLATE_MAX_CODES 288 // literal / length alphabet size
+
+namespace dunescape
+{
+
+//----------------------------------------------------------------------
+// tables
+//----------------------------------------------------------------------
+
+const int length_base[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                             11, 13, 15, 17,  19,  23,  27,  31,
+                             35, 43, 51, 59,  67,  83,  99,  115,
+                             131, 163, 195, 227, 258};
+const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                              1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                              4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int dist_base[30] = {1,    2,    3,    4,     5,     7,
+                           9,    13,   17,   25,    33,    49,
+                           65,   97,   129,  193,   257,   385,
+                           513,  769,  1025, 1537,  2049,  3073,
+                           4097, 6145, 8193, 12289, 16385, 24577};
+const int dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                            4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                            9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+uint32_t reverse_bits(uint32_t code, int nbits)
+{
+  uint32_t r = 0;
+  for (int k = 0; k < nbits; k++)
+    r |= ((code >> k) & 1) << (nbits - 1 - k);
+  return r;
+}
+
+//----------------------------------------------------------------------
+// checksums
+//----------------------------------------------------------------------
+
+struct CrcTable
+{
+  uint32_t v[256];
+
+  CrcTable()
+  {
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      this->v[n] = c;
+    }
+  }
+};
+
+static const CrcTable crc_table;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t n)
+{
+  for (size_t k = 0; k < n; k++)
+    crc = crc_table.v[(crc ^ p[k]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+uint32_t adler32(const uint8_t *p, size_t n)
+{
+  uint32_t a = 1, b = 0;
+
+  while (n > 0)
+  {
+    // largest block without overflow of 'b'
+    size_t m = std::min(n, (size_t)5552);
+    for (size_t k = 0; k < m; k++)
+    {
+      a += p[k];
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+    p += m;
+    n -= m;
+  }
+  return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+  uint32_t rem = (uint32_t)(len2 % ADLER_BASE);
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (uint32_t)((uint64_t)rem * sum1 % ADLER_BASE);
+
+  sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+  sum1 %= ADLER_BASE;
+  sum2 %= ADLER_BASE;
+  return (sum2 << 16) | sum1;
+}
+
+static uint32_t adler32_parallel(const uint8_t *p, size_t n)
+{
+  const size_t          n_blocks = (n + ADLER_BLOCK - 1) / ADLER_BLOCK;
+  std::vector<uint32_t> adlers(n_blocks);
+
+#pragma omp parallel for schedule(static)
+  for (size_t c = 0; c < n_blocks; c++)
+  {
+    const size_t k0 = c * ADLER_BLOCK;
+    adlers[c] = adler32(p + k0, std::min((size_t)ADLER_BLOCK, n - k0));
+  }
+
+  uint32_t adler = 1;
+
+  for (size_t c = 0; c < n_blocks; c++)
+    adler = adler32_combine(adler,
+                            adlers[c],
+                            std::min((size_t)ADLER_BLOCK, n - c * ADLER_BLOCK));
+  return adler;
+}
+
+//----------------------------------------------------------------------
+// inflate
+//----------------------------------------------------------------------
+
+// bits are read from the least significant bit, the input being padded
+// with zeros past its end (reading them is an error)
+struct BitReader
+{
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t       acc = 0;
+  int            n = 0;
+  int            padding = 0;
+  bool           overrun = false;
+
+  BitReader(const uint8_t *p, const uint8_t *end) : p(p), end(end) {}
+
+  inline void refill()
+  {
+    for (; this->n <= 56; this->n += 8)
+      if (this->p < this->end)
+        this->acc |= (uint64_t)*this->p++ << this->n;
+      else
+        this->padding += 8;
+  }
+
+  inline uint32_t peek(int nbits) const
+  {
+    return (uint32_t)(this->acc & (((uint64_t)1 << nbits) - 1));
+  }
+
+  inline void consume(int nbits)
+  {
+    this->acc >>= nbits;
+    this->n -= nbits;
+    this->overrun = this->overrun or (this->n < this->padding);
+  }
+
+  inline uint32_t get(int nbits)
+  {
+    this->refill();
+    const uint32_t v = this->peek(nbits);
+    this->consume(nbits);
+    return v;
+  }
+};
+
+// canonical Huffman code, the short codes are decoded with a lookup table
+// and the longer ones bit by bit
+struct Huffman
+{
+  uint16_t fast[1 << INFLATE_FAST_BITS]; // (length << 9) | symbol, or 0
+  uint16_t count[INFLATE_MAX_BITS + 1];  // number of codes per length
+  uint16_t symbol[INFLATE_MAX_CODES];    // sorted by code
+
+  bool build(const uint8_t *lengths, int n)
+  {
+    uint16_t offset[INFLATE_MAX_BITS + 1];
+    uint32_t next[INFLATE_MAX_BITS + 1];
+
+    std::memset(this->count, 0, sizeof(this->count));
+    std::memset(this->fast, 0, sizeof(this->fast));
+
+    for (int s = 0; s < n; s++)
+      this->count[lengths[s]]++;
+    this->count[0] = 0;
+
+    // over-subscribed codes are invalid, incomplete ones are allowed
+    int left = 1;
+
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++)
+    {
+      left = 2 * left - this->count[len];
+      if (left < 0)
+        return false;
+    }
+
+    uint32_t code = 0;
+
+    offset[1] = 0;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++)
+    {
+      code = (code + this->count[len - 1]) << 1;
+      next[len] = code;
+      if (len > 1)
+        offset[len] = offset[len - 1] + this->count[len - 1];
+    }
+
+    for (int s = 0; s < n; s++)
+    {
+      const int len = lengths[s];
+
+      if (len == 0)
+        continue;
+
+      this->symbol[offset[len]++] = (uint16_t)s;
+
+      if (len <= INFLATE_FAST_BITS)
+        for (uint32_t r = reverse_bits(next[len], len);
+             r < (1u << INFLATE_FAST_BITS);
+             r += 1u << len)
+          this->fast[r] = (uint16_t)((len << 9) | s);
+      next[len]++;
+    }
+    return true;
+  }
+
+  // return the next symbol, -1 for an invalid code
+  inline int decode(BitReader &br) const
+  {
+    br.refill();
+
+    const uint16_t e = this->fast[br.peek(INFLATE_FAST_BITS)];
+
+    if (e)
+    {
+      br.consume(e >> 9);
+      return e & 511;
+    }
+
+    int code = 0, first = 0, index = 0;
+
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++)
+    {
+      code |= (int)((br.acc >> (len - 1)) & 1);
+
+      const int c = this->count[len];
+
+      if (code - first < c)
+      {
+        br.consume(len);
+        return this->symbol[index + code - first];
+      }
+      index += c;
+      first = (first + c) << 1;
+      code <<= 1;
+    }
+    return -1;
+  }
+};
+
+struct FixedHuffman
+{
+  Huffman lit;
+  Huffman dist;
+
+  FixedHuffman()
+  {
+    uint8_t lengths[INFLATE_MAX_CODES];
+
+    for (int s = 0; s < INFLATE_MAX_CODES; s++)
+      lengths[s] = s < 144 ? 8 : (s < 256 ? 9 : (s < 280 ? 7 : 8));
+    this->lit.build(lengths, INFLATE_MAX_CODES);
+
+    std::fill(lengths, lengths + 30, 5);
+    this->dist.build(lengths, 30);
+  }
+};
+
+static const FixedHuffman fixed_huffman;
+
+static bool read_dynamic_codes(BitReader &br, Huffman &lit, Huffman &dist)
+{
+  static const uint8_t order[19] =
+      {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+  const int nlit = (int)br.get(5) + 257;
+  const int ndist = (int)br.get(5) + 1;
+  const int nclen = (int)br.get(4) + 4;
+
+  if ((nlit > 286) or (ndist > 30))
+    return false;
+
+  // code length code, then the code lengths of both alphabets
+  uint8_t lengths[286 + 30] = {0};
+  Huffman clen;
+
+  for (int k = 0; k < nclen; k++)
+    lengths[order[k]] = (uint8_t)br.get(3);
+
+  if (!clen.build(lengths, 19))
+    return false;
+
+  for (int k = 0; k < nlit + ndist;)
+  {
+    const int sym = clen.decode(br);
+
+    if (sym < 0)
+      return false;
+
+    if (sym < 16)
+    {
+      lengths[k++] = (uint8_t)sym;
+      continue;
+    }
+
+    int     rep;
+    uint8_t value = 0;
+
+    if (sym == 16) // previous length repeated
+    {
+      if (k == 0)
+        return false;
+      value = lengths[k - 1];
+      rep = 3 + (int)br.get(2);
+    }
+    else if (sym == 17)
+      rep = 3 + (int)br.get(3);
+    else
+      rep = 11 + (int)br.get(7);
+
+    if (k + rep > nlit + ndist)
+      return false;
+    while (rep-- > 0)
+      lengths[k++] = value;
+  }
+
+  return (lengths[256] > 0) and lit.build(lengths, nlit) and
+         dist.build(lengths + nlit, ndist) and !br.overrun;
+}
+
+static bool inflate_block(BitReader     &br,
+                          const Huffman &lit,
+                          const Huffman &dist,
+                          uint8_t       *dst,
+                          size_t         dst_size,
+                          size_t        &pos)
+{
+  while (!br.overrun)
+  {
+    int sym = lit.decode(br);
+
+    if (sym < 0)
+      return false;
+
+    if (sym < 256)
+    {
+      if (pos == dst_size)
+        return false;
+      dst[pos++] = (uint8_t)sym;
+      continue;
+    }
+
+    if (sym == 256) // end of block
+      return true;
+
+    sym -= 257;
+    if (sym >= 29)
+      return false;
+
+    const size_t length = length_base[sym] + br.get(length_extra[sym]);
+    const int    d = dist.decode(br);
+
+    if ((d < 0) or (d >= 30))
+      return false;
+
+    const size_t distance = dist_base[d] + br.get(dist_extra[d]);
+
+    if ((distance > pos) or (length > dst_size - pos))
+      return false;
+
+    // byte by byte, a match overlapping its own output repeats it
+    const uint8_t *src = dst + pos - distance;
+
+    for (size_t k = 0; k < length; k++)
+      dst[pos + k] = src[k];
+    pos += length;
+  }
+  return false;
+}
+
+static bool inflate_stored(BitReader &br,
+                           uint8_t   *dst,
+                           size_t     dst_size,
+                           size_t    &pos)
+{
+  br.consume(br.n & 7); // to the next byte boundary
+
+  const uint32_t len = br.get(16);
+  const uint32_t nlen = br.get(16);
+
+  if (((len ^ 0xffffu) != nlen) or (len > dst_size - pos))
+    return false;
+
+  for (uint32_t k = 0; k < len; k++)
+    dst[pos++] = (uint8_t)br.get(8);
+  return !br.overrun;
+}
+
+bool inflate_zlib(const uint8_t *src,
+                  size_t         src_size,
+                  uint8_t       *dst,
+                  size_t         dst_size)
+{
+  // header: deflate, window up to 32K, no preset dictionary
+  if ((src_size < 6) or ((src[0] & 0x0f) != 8) or ((src[0] >> 4) > 7) or
+      (((src[0] << 8) | src[1]) % 31 != 0) or (src[1] & 0x20))
+  {
+    LOG_ERROR("unsupported zlib stream");
+    return false;
+  }
+
+  BitReader br(src + 2, src + src_size - 4);
+  Huffman   lit, dist;
+  size_t    pos = 0;
+  bool      last = false;
+  bool      ok = true;
+
+  while (ok and !last)
+  {
+    last = br.get(1);
+
+    switch (br.get(2))
+    {
+    case 0: ok = inflate_stored(br, dst, dst_size, pos); break;
+    case 1:
+      ok = inflate_block(br,
+                         fixed_huffman.lit,
+                         fixed_huffman.dist,
+                         dst,
+                         dst_size,
+                         pos);
+      break;
+    case 2:
+      ok = read_dynamic_codes(br, lit, dist) and
+           inflate_block(br, lit, dist, dst, dst_size, pos);
+      break;
+    default: ok = false;
+    }
+  }
+
+  if (!ok or (pos != dst_size))
+  {
+    LOG_ERROR("corrupted zlib stream");
+    return false;
+  }
+
+  const uint8_t *t = src + src_size - 4;
+  const uint32_t adler = ((uint32_t)t[0] << 24) | ((uint32_t)t[1] << 16) |
+                         ((uint32_t)t[2] << 8) | (uint32_t)t[3];
+
+  if (adler32_parallel(dst, dst_size) != adler)
+  {
+    LOG_ERROR("zlib stream checksum mismatch");
+    return false;
+  }
+  return true;
+}
+
+} // namespace dunescape
@@ -0,0 +1,492 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <atomic>
+
+#include "core/shadow_kernels.hpp"
+
+#ifdef DUNESCAPE_X86_SIMD
+#include <immintrin.h>
+
+// false positives of GCC on the AVX-512 intrinsics (undefined pass-through
+// operands of the unmasked variants)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#endif
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+
+namespace dunescape
+{
+
+// --- Scalar kernels
+
+// move the shadow envelope one cell downwind, the envelope is cast by
+// the cell of height 'hb' at a distance 'kb' upstream ('kb' < 0 for an
+// empty envelope) and 'v' is the height of the cell being passed
+static inline void push_envelope(int v, int &hb, int &kb, float slope)
+{
+  const bool replace = (kb < 0) | ((float)(v - hb) >= -(float)kb * slope);
+  hb = replace ? v : hb;
+  kb = replace ? 1 : kb + 1;
+}
+
+// move the envelopes of 'n' columns one row downwind, return the
+// maximum height of the row (the kernels are kept out of the OpenMP
+// regions so that the compiler can keep everything in registers)
+static int envelope_sweep_row_scalar(const Height *__restrict h_row,
+                                     int *__restrict          hb,
+                                     int *__restrict          kb,
+                                     int                      n,
+                                     float                    slope)
+{
+  int hmax = 0;
+
+  for (int j = 0; j < n; j++)
+  {
+    int hb_j = hb[j];
+    int kb_j = kb[j];
+
+    hmax = std::max(hmax, (int)h_row[j]);
+    push_envelope(h_row[j], hb_j, kb_j, slope);
+    hb[j] = hb_j;
+    kb[j] = kb_j;
+  }
+  return hmax;
+}
+
+// compute the shadow of 'n' columns for one row and move the envelopes
+// downwind, cells are either certainly not shadowed, or certainly
+// shadowed by the cell casting the envelope, or flagged as near-ties
+// (return true if there is any). Shadow and sandy cell bits are
+// accumulated at position 'bit' of the column words 'shadow_words' and
+// 'sandy_words'
+static bool shadow_sweep_row_scalar(const Height *__restrict h_row,
+                                    uint64_t *__restrict shadow_words,
+                                    uint64_t *__restrict sandy_words,
+                                    int                  bit,
+                                    int *__restrict      hb,
+                                    int *__restrict      kb,
+                                    uint8_t *__restrict  near_tie,
+                                    int                  n,
+                                    float                slope,
+                                    float                margin,
+                                    const int *__restrict thresholds)
+{
+  int n_ties = 0;
+
+  for (int j = 0; j < n; j++)
+  {
+    const int   v = h_row[j];
+    int         hb_j = hb[j];
+    int         kb_j = kb[j];
+    const float envelope = (float)hb_j - (float)kb_j * slope;
+    const bool  lit = envelope - margin < (float)v;
+    const bool  dark = hb_j - v >= thresholds[kb_j];
+    const bool  tie = !(lit | dark);
+
+    shadow_words[j] |= (uint64_t)dark << bit;
+    sandy_words[j] |= (uint64_t)(v > 0) << bit;
+    near_tie[j] = tie;
+    n_ties += tie;
+    push_envelope(v, hb_j, kb_j, slope);
+    hb[j] = hb_j;
+    kb[j] = kb_j;
+  }
+  return n_ties > 0;
+}
+
+#ifdef DUNESCAPE_X86_SIMD
+
+// The SIMD kernels process the columns 8 (AVX2) or 16 (AVX-512) at a
+// time with the very same operations as the scalar ones: the envelope
+// updates (integer heights and distances, float comparisons of exactly
+// rounded products) are bit-identical, and the 'lit' test can only
+// differ by a rounding on the margin, in which case the cell is
+// resolved by the exact search as a near-tie. The shadow is identical
+// whatever the level. Remaining columns are handed over to the scalar
+// kernels.
+
+// --- AVX2 kernels
+
+TARGET_AVX2 static inline __m256i load8(const uint8_t *p)
+{
+  return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+}
+
+TARGET_AVX2 static inline __m256i load8(const uint16_t *p)
+{
+  return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+}
+
+TARGET_AVX2 static inline __m256i load8(const int *p)
+{
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+
+TARGET_AVX2 static inline void push_envelope_avx2(__m256i  v,
+                                                  __m256i &hb,
+                                                  __m256i &kb,
+                                                  __m256   neg_slope)
+{
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256  dv = _mm256_cvtepi32_ps(_mm256_sub_epi32(v, hb));
+  const __m256  dk = _mm256_mul_ps(_mm256_cvtepi32_ps(kb), neg_slope);
+  const __m256i replace = _mm256_or_si256(
+      _mm256_cmpgt_epi32(_mm256_setzero_si256(), kb),
+      _mm256_castps_si256(_mm256_cmp_ps(dv, dk, _CMP_GE_OQ)));
+
+  hb = _mm256_blendv_epi8(hb, v, replace);
+  kb = _mm256_blendv_epi8(_mm256_add_epi32(kb, one), one, replace);
+}
+
+// or the 0/1 values of 8 columns, shifted by 'shift', into their words
+TARGET_AVX2 static inline void accumulate_bits_avx2(uint64_t *words,
+                                                    __m256i   values,
+                                                    __m128i   shift)
+{
+  __m256i      *w = (__m256i *)words;
+  const __m256i lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(values));
+  const __m256i hi = _mm256_cvtepu32_epi64(
+      _mm256_extracti128_si256(values, 1));
+
+  _mm256_storeu_si256(w,
+                      _mm256_or_si256(_mm256_loadu_si256(w),
+                                      _mm256_sll_epi64(lo, shift)));
+  _mm256_storeu_si256(w + 1,
+                      _mm256_or_si256(_mm256_loadu_si256(w + 1),
+                                      _mm256_sll_epi64(hi, shift)));
+}
+
+TARGET_AVX2 static int envelope_sweep_row_avx2(
+    const Height *__restrict h_row,
+    int *__restrict hb,
+    int *__restrict kb,
+    int   n,
+    float slope)
+{
+  const __m256 neg_slope = _mm256_set1_ps(-slope);
+  __m256i      vmax = _mm256_setzero_si256();
+  int          j = 0;
+
+  for (; j + 8 <= n; j += 8)
+  {
+    const __m256i v = load8(h_row + j);
+    __m256i       hb_j = _mm256_loadu_si256((const __m256i *)(hb + j));
+    __m256i       kb_j = _mm256_loadu_si256((const __m256i *)(kb + j));
+
+    vmax = _mm256_max_epi32(vmax, v);
+    push_envelope_avx2(v, hb_j, kb_j, neg_slope);
+    _mm256_storeu_si256((__m256i *)(hb + j), hb_j);
+    _mm256_storeu_si256((__m256i *)(kb + j), kb_j);
+  }
+
+  alignas(32) int lanes[8];
+  _mm256_store_si256((__m256i *)lanes, vmax);
+
+  int hmax = *std::max_element(lanes, lanes + 8);
+
+  if (j < n)
+    hmax = std::max(hmax,
+                    envelope_sweep_row_scalar(h_row + j,
+                                              hb + j,
+                                              kb + j,
+                                              n - j,
+                                              slope));
+  return hmax;
+}
+
+TARGET_AVX2 static bool shadow_sweep_row_avx2(
+    const Height *__restrict h_row,
+    uint64_t *__restrict shadow_words,
+    uint64_t *__restrict sandy_words,
+    int             bit,
+    int *__restrict hb,
+    int *__restrict kb,
+    uint8_t *__restrict near_tie,
+    int   n,
+    float slope,
+    float margin,
+    const int *__restrict thresholds)
+{
+  const __m256  slope_v = _mm256_set1_ps(slope);
+  const __m256  neg_slope = _mm256_set1_ps(-slope);
+  const __m256  margin_v = _mm256_set1_ps(margin);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i all = _mm256_set1_epi32(-1);
+  const __m128i shift = _mm_cvtsi32_si128(bit);
+  __m256i       any_tie = _mm256_setzero_si256();
+  int           j = 0;
+
+  for (; j + 8 <= n; j += 8)
+  {
+    const __m256i v = load8(h_row + j);
+    __m256i       hb_j = _mm256_loadu_si256((const __m256i *)(hb + j));
+    __m256i       kb_j = _mm256_loadu_si256((const __m256i *)(kb + j));
+
+    const __m256 envelope = _mm256_sub_ps(
+        _mm256_cvtepi32_ps(hb_j),
+        _mm256_mul_ps(_mm256_cvtepi32_ps(kb_j), slope_v));
+    const __m256i lit = _mm256_castps_si256(
+        _mm256_cmp_ps(_mm256_sub_ps(envelope, margin_v),
+                      _mm256_cvtepi32_ps(v),
+                      _CMP_LT_OQ));
+    const __m256i threshold = _mm256_i32gather_epi32(thresholds, kb_j, 4);
+    const __m256i dark = _mm256_cmpgt_epi32(_mm256_sub_epi32(hb_j, v),
+                                            _mm256_sub_epi32(threshold, one));
+
+    // shadow and sandy bits, 4 column words per 256 bit register
+    accumulate_bits_avx2(shadow_words + j, _mm256_srli_epi32(dark, 31), shift);
+    accumulate_bits_avx2(sandy_words + j,
+                         _mm256_min_epu32(v, one), // v > 0
+                         shift);
+
+    // near-ties, narrowed to bytes
+    const __m256i tie = _mm256_xor_si256(_mm256_or_si256(lit, dark), all);
+
+    any_tie = _mm256_or_si256(any_tie, tie);
+    const __m128i tie16 = _mm_packs_epi32(_mm256_castsi256_si128(tie),
+                                          _mm256_extracti128_si256(tie, 1));
+    const __m128i tie8 = _mm_packs_epi16(tie16, tie16);
+
+    _mm_storel_epi64((__m128i *)(near_tie + j),
+                     _mm_and_si128(tie8, _mm_set1_epi8(1)));
+
+    push_envelope_avx2(v, hb_j, kb_j, neg_slope);
+    _mm256_storeu_si256((__m256i *)(hb + j), hb_j);
+    _mm256_storeu_si256((__m256i *)(kb + j), kb_j);
+  }
+
+  bool tail_tie = j < n and shadow_sweep_row_scalar(h_row + j,
+                                                    shadow_words + j,
+                                                    sandy_words + j,
+                                                    bit,
+                                                    hb + j,
+                                                    kb + j,
+                                                    near_tie + j,
+                                                    n - j,
+                                                    slope,
+                                                    margin,
+                                                    thresholds);
+
+  return tail_tie or !_mm256_testz_si256(any_tie, any_tie);
+}
+
+// --- AVX-512 kernels
+
+TARGET_AVX512 static inline __m512i load16(const uint8_t *p)
+{
+  return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)p));
+}
+
+TARGET_AVX512 static inline __m512i load16(const uint16_t *p)
+{
+  return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p));
+}
+
+TARGET_AVX512 static inline __m512i load16(const int *p)
+{
+  return _mm512_loadu_si512(p);
+}
+
+TARGET_AVX512 static inline void push_envelope_avx512(__m512i  v,
+                                                      __m512i &hb,
+                                                      __m512i &kb,
+                                                      __m512   neg_slope)
+{
+  const __m512i   one = _mm512_set1_epi32(1);
+  const __m512    dv = _mm512_cvtepi32_ps(_mm512_sub_epi32(v, hb));
+  const __m512    dk = _mm512_mul_ps(_mm512_cvtepi32_ps(kb), neg_slope);
+  const __mmask16 replace = _mm512_cmplt_epi32_mask(kb,
+                                                    _mm512_setzero_si512()) |
+                            _mm512_cmp_ps_mask(dv, dk, _CMP_GE_OQ);
+
+  hb = _mm512_mask_mov_epi32(hb, replace, v);
+  kb = _mm512_mask_mov_epi32(_mm512_add_epi32(kb, one), replace, one);
+}
+
+// or 'bits' into the words of the 16 columns flagged in 'mask'
+TARGET_AVX512 static inline void accumulate_bits_avx512(uint64_t *words,
+                                                        __mmask16 mask,
+                                                        __m512i   bits)
+{
+  const __m512i lo = _mm512_loadu_si512(words);
+  const __m512i hi = _mm512_loadu_si512(words + 8);
+
+  _mm512_storeu_si512(words,
+                      _mm512_mask_or_epi64(lo, (__mmask8)mask, lo, bits));
+  _mm512_storeu_si512(words + 8,
+                      _mm512_mask_or_epi64(hi,
+                                           (__mmask8)(mask >> 8),
+                                           hi,
+                                           bits));
+}
+
+TARGET_AVX512 static int envelope_sweep_row_avx512(
+    const Height *__restrict h_row,
+    int *__restrict hb,
+    int *__restrict kb,
+    int   n,
+    float slope)
+{
+  const __m512 neg_slope = _mm512_set1_ps(-slope);
+  __m512i      vmax = _mm512_setzero_si512();
+  int          j = 0;
+
+  for (; j + 16 <= n; j += 16)
+  {
+    const __m512i v = load16(h_row + j);
+    __m512i       hb_j = _mm512_loadu_si512(hb + j);
+    __m512i       kb_j = _mm512_loadu_si512(kb + j);
+
+    vmax = _mm512_max_epi32(vmax, v);
+    push_envelope_avx512(v, hb_j, kb_j, neg_slope);
+    _mm512_storeu_si512(hb + j, hb_j);
+    _mm512_storeu_si512(kb + j, kb_j);
+  }
+
+  alignas(64) int lanes[16];
+  _mm512_store_si512(lanes, vmax);
+
+  int hmax = *std::max_element(lanes, lanes + 16);
+
+  if (j < n)
+    hmax = std::max(hmax,
+                    envelope_sweep_row_scalar(h_row + j,
+                                              hb + j,
+                                              kb + j,
+                                              n - j,
+                                              slope));
+  return hmax;
+}
+
+TARGET_AVX512 static bool shadow_sweep_row_avx512(
+    const Height *__restrict h_row,
+    uint64_t *__restrict shadow_words,
+    uint64_t *__restrict sandy_words,
+    int             bit,
+    int *__restrict hb,
+    int *__restrict kb,
+    uint8_t *__restrict near_tie,
+    int   n,
+    float slope,
+    float margin,
+    const int *__restrict thresholds)
+{
+  const __m512  slope_v = _mm512_set1_ps(slope);
+  const __m512  neg_slope = _mm512_set1_ps(-slope);
+  const __m512  margin_v = _mm512_set1_ps(margin);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i bits = _mm512_set1_epi64((long long)((uint64_t)1 << bit));
+  __mmask16     any_tie = 0;
+  int           j = 0;
+
+  for (; j + 16 <= n; j += 16)
+  {
+    const __m512i v = load16(h_row + j);
+    __m512i       hb_j = _mm512_loadu_si512(hb + j);
+    __m512i       kb_j = _mm512_loadu_si512(kb + j);
+
+    const __m512 envelope = _mm512_sub_ps(
+        _mm512_cvtepi32_ps(hb_j),
+        _mm512_mul_ps(_mm512_cvtepi32_ps(kb_j), slope_v));
+    const __mmask16 lit = _mm512_cmp_ps_mask(_mm512_sub_ps(envelope,
+                                                           margin_v),
+                                             _mm512_cvtepi32_ps(v),
+                                             _CMP_LT_OQ);
+    const __m512i   threshold = _mm512_i32gather_epi32(kb_j, thresholds, 4);
+    const __mmask16 dark = _mm512_cmpge_epi32_mask(
+        _mm512_sub_epi32(hb_j, v),
+        threshold);
+
+    // shadow and sandy bits, 8 column words per 512 bit register
+    accumulate_bits_avx512(shadow_words + j, dark, bits);
+    accumulate_bits_avx512(sandy_words + j,
+                           _mm512_cmpgt_epi32_mask(v, _mm512_setzero_si512()),
+                           bits);
+
+    // near-ties, narrowed to bytes
+    const __mmask16 tie = (__mmask16)~(lit | dark);
+
+    any_tie |= tie;
+    _mm_storeu_si128((__m128i *)(near_tie + j),
+                     _mm512_cvtepi32_epi8(_mm512_maskz_mov_epi32(tie, one)));
+
+    push_envelope_avx512(v, hb_j, kb_j, neg_slope);
+    _mm512_storeu_si512(hb + j, hb_j);
+    _mm512_storeu_si512(kb + j, kb_j);
+  }
+
+  bool tail_tie = j < n and shadow_sweep_row_scalar(h_row + j,
+                                                    shadow_words + j,
+                                                    sandy_words + j,
+                                                    bit,
+                                                    hb + j,
+                                                    kb + j,
+                                                    near_tie + j,
+                                                    n - j,
+                                                    slope,
+                                                    margin,
+                                                    thresholds);
+
+  return tail_tie or (any_tie != 0);
+}
+
+#endif
+
+// --- Runtime dispatch
+
+static const ShadowKernels kernels[] = {
+    {envelope_sweep_row_scalar, shadow_sweep_row_scalar},
+#ifdef DUNESCAPE_X86_SIMD
+    {envelope_sweep_row_avx2, shadow_sweep_row_avx2},
+    {envelope_sweep_row_avx512, shadow_sweep_row_avx512},
+#endif
+};
+
+static SimdLevel detect_simd_level()
+{
+#ifdef DUNESCAPE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+#endif
+  return SIMD_SCALAR;
+}
+
+static const SimdLevel  supported_level = detect_simd_level();
+static std::atomic<int> current_level(supported_level);
+
+const ShadowKernels &shadow_kernels()
+{
+  return kernels[current_level.load(std::memory_order_relaxed)];
+}
+
+SimdLevel simd_level() { return (SimdLevel)current_level.load(); }
+
+SimdLevel set_simd_level(SimdLevel level)
+{
+  level = std::min(std::max(level, SIMD_SCALAR), supported_level);
+  current_level = level;
+  return level;
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+  switch (level)
+  {
+  case SIMD_AVX2:
+    return "avx2";
+  case SIMD_AVX512:
+    return "avx512";
+  default:
+    return "scalar";
+  }
+}
+
+} // namespace dunescape
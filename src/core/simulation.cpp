@@ -0,0 +1,146 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <algorithm>
+#include <chrono>
+
+#include <omp.h>
+
+#include "core/simulation.hpp"
+
+namespace dunescape
+{
+
+Simulation::Simulation(Shape shape, int n_threads)
+    : df(shape), n_threads(n_threads)
+{
+  this->worker = std::thread(&Simulation::run, this);
+}
+
+Simulation::~Simulation()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->wake_up.notify_one();
+  this->worker.join();
+}
+
+void Simulation::post(std::function<void(DuneField &)> command)
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->commands.push_back(command);
+  }
+  this->wake_up.notify_one();
+}
+
+void Simulation::set_paused(bool new_paused)
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->paused = new_paused;
+  }
+  this->wake_up.notify_one();
+}
+
+void Simulation::step()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->pending_steps++;
+  }
+  this->wake_up.notify_one();
+}
+
+void Simulation::run()
+{
+  // OpenMP settings are per thread
+  if (this->n_threads > 0)
+    omp_set_num_threads(this->n_threads);
+
+  uint64_t n_moves = 0;
+  float    rate = 0.f;
+
+  this->publish(n_moves, rate);
+
+  while (true)
+  {
+    std::vector<std::function<void(DuneField &)>> todo;
+    int                                           n_cycles = 0;
+
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->wake_up.wait(lock,
+                         [this]
+                         {
+                           return this->stopping or
+                                  !this->commands.empty() or
+                                  !this->paused or (this->pending_steps > 0);
+                         });
+
+      if (this->stopping)
+        return;
+
+      todo.swap(this->commands);
+
+      if (!this->paused)
+        n_cycles = std::max(1, this->cycles_per_snapshot.load());
+      else if (this->pending_steps > 0)
+      {
+        n_cycles = 1;
+        this->pending_steps--;
+      }
+    }
+
+    for (auto &command : todo)
+      command(this->df);
+
+    if (n_cycles > 0)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+
+      for (int k = 0; k < n_cycles; k++)
+        n_moves = this->df.cycle();
+
+      std::chrono::duration<float> dt = std::chrono::steady_clock::now() -
+                                        t0;
+      float current = dt.count() > 0.f ? (float)n_cycles / dt.count() : 0.f;
+      rate = rate > 0.f ? 0.9f * rate + 0.1f * current : current;
+    }
+
+    this->publish(n_moves, rate);
+  }
+}
+
+void Simulation::publish(uint64_t n_moves, float cycles_per_second)
+{
+  const int nj = this->df.shape[1];
+
+  this->snapshot_count++;
+
+  if ((int)this->column_id.size() != nj)
+    this->column_id.assign(nj, this->snapshot_count);
+
+  for (int j = 0; j < nj; j++)
+    if (this->df.modified_columns[j])
+      this->column_id[j] = this->snapshot_count;
+  this->df.clear_modified_columns();
+
+  // buffers are reused, nothing is allocated while the shape is unchanged
+  Snapshot &s = this->snapshots.back();
+
+  s.h = this->df.h;
+  s.id = this->snapshot_count;
+  s.column_id = this->column_id;
+  s.cycle_count = this->df.cycle_count;
+  s.n_moves = n_moves;
+  s.cycles_per_second = cycles_per_second;
+  s.heights = this->df.heights.summary();
+  s.stats = this->df.stats.collect();
+
+  this->snapshots.publish();
+}
+
+} // namespace dunescape
@@ -0,0 +1,118 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include "macrologger.h"
+
+#include "core/stats.hpp"
+
+namespace dunescape
+{
+
+const char *stats_phase_name(int phase)
+{
+  static const char *names[STATS_PHASE_COUNT] = {"even_strips",
+                                                 "odd_strips",
+                                                 "shadow",
+                                                 "relaxation"};
+  return (phase >= 0 and phase < STATS_PHASE_COUNT) ? names[phase] : "";
+}
+
+void Stats::reserve()
+{
+  const size_t n = (size_t)omp_get_max_threads();
+
+  if (this->counters.size() < n)
+    this->counters.resize(n);
+}
+
+CycleStats Stats::collect()
+{
+  CycleStats s;
+
+  s.n_cycles = this->n_cycles;
+
+  for (auto &c : this->counters)
+  {
+    s.n_eroded += c.n_eroded;
+    s.n_deposited += c.n_deposited;
+    s.n_avalanches += c.n_avalanches;
+    s.n_shadow_cells += c.n_shadow_cells;
+    for (int k = 0; k < STATS_HOP_BINS; k++)
+      s.hops[k] += c.hops[k];
+    c = StatsCounters();
+  }
+
+  for (int p = 0; p < STATS_PHASE_COUNT; p++)
+  {
+    s.seconds[p] = this->seconds[p];
+    this->seconds[p] = 0.;
+  }
+  this->n_cycles = 0;
+
+  return s;
+}
+
+StatsWriter::StatsWriter(const std::string &fname)
+{
+  const size_t dot = fname.rfind('.');
+  const std::string ext = dot == std::string::npos ? "" : fname.substr(dot);
+
+  this->json = (ext == ".json") or (ext == ".jsonl");
+  this->f.open(fname);
+
+  if (!this->f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  if (!this->json)
+  {
+    this->f << "cycle,n_cycles,n_eroded,n_deposited,n_avalanches,"
+               "n_shadow_cells";
+    for (int p = 0; p < STATS_PHASE_COUNT; p++)
+      this->f << ",seconds_" << stats_phase_name(p);
+    for (int k = 0; k < STATS_HOP_BINS; k++)
+      this->f << ",hops_" << k + 1;
+    this->f << "\n";
+  }
+}
+
+void StatsWriter::write(uint64_t cycle_count, const CycleStats &s)
+{
+  if (!this->f)
+    return;
+
+  if (this->json)
+  {
+    this->f << "{\"cycle\": " << cycle_count
+            << ", \"n_cycles\": " << s.n_cycles
+            << ", \"n_eroded\": " << s.n_eroded
+            << ", \"n_deposited\": " << s.n_deposited
+            << ", \"n_avalanches\": " << s.n_avalanches
+            << ", \"n_shadow_cells\": " << s.n_shadow_cells
+            << ", \"seconds\": {";
+    for (int p = 0; p < STATS_PHASE_COUNT; p++)
+      this->f << (p ? ", " : "") << "\"" << stats_phase_name(p)
+              << "\": " << s.seconds[p];
+    this->f << "}, \"hops\": [";
+    for (int k = 0; k < STATS_HOP_BINS; k++)
+      this->f << (k ? ", " : "") << s.hops[k];
+    this->f << "]}\n";
+  }
+  else
+  {
+    this->f << cycle_count << "," << s.n_cycles << "," << s.n_eroded << ","
+            << s.n_deposited << "," << s.n_avalanches << ","
+            << s.n_shadow_cells;
+    for (int p = 0; p < STATS_PHASE_COUNT; p++)
+      this->f << "," << s.seconds[p];
+    for (int k = 0; k < STATS_HOP_BINS; k++)
+      this->f << "," << s.hops[k];
+    this->f << "\n";
+  }
+
+  this->f.flush();
+}
+
+} // namespace dunescape
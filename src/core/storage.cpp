@@ -0,0 +1,125 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macrologger.h"
+
+#include "core/storage.hpp"
+
+namespace dunescape
+{
+
+void *map_storage_file(const std::string &directory, size_t bytes)
+{
+  std::string       pattern = directory + "/dunescape_XXXXXX";
+  std::vector<char> fname(pattern.begin(), pattern.end());
+  fname.push_back('\0');
+
+  int fd = mkstemp(fname.data());
+  if (fd < 0)
+  {
+    LOG_ERROR("cannot create a storage file in %s: %s",
+              directory.c_str(),
+              std::strerror(errno));
+    return nullptr;
+  }
+  unlink(fname.data()); // the file is removed once unmapped
+
+  // the blocks are reserved upfront, running out of disk space later on
+  // would only be reported by a SIGBUS
+  int   err = posix_fallocate(fd, 0, (off_t)bytes);
+  void *ptr = MAP_FAILED;
+
+  if (err == 0)
+  {
+    ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+      err = errno;
+  }
+  close(fd); // the mapping remains valid
+
+  if (ptr == MAP_FAILED)
+  {
+    LOG_ERROR("cannot map %zu bytes in %s: %s",
+              bytes,
+              directory.c_str(),
+              std::strerror(err));
+    return nullptr;
+  }
+
+  return ptr;
+}
+
+const void *map_input_file(const std::string &fname, size_t &bytes)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    LOG_ERROR("cannot open %s: %s", fname.c_str(), std::strerror(errno));
+    return nullptr;
+  }
+
+  struct stat st;
+  void       *ptr = MAP_FAILED;
+  int         err = 0;
+
+  if (fstat(fd, &st) != 0)
+    err = errno;
+  else if (st.st_size == 0)
+    err = ENODATA;
+  else
+  {
+    bytes = (size_t)st.st_size;
+    ptr = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+      err = errno;
+  }
+  close(fd); // the mapping remains valid
+
+  if (ptr == MAP_FAILED)
+  {
+    LOG_ERROR("cannot map %s: %s", fname.c_str(), std::strerror(err));
+    return nullptr;
+  }
+
+  return ptr;
+}
+
+void unmap_storage_file(void *ptr, size_t bytes)
+{
+  if (ptr)
+    munmap(ptr, bytes);
+}
+
+void advise_storage(const void *ptr, size_t bytes, StorageAdvice advice)
+{
+  static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+  if (bytes == 0)
+    return;
+
+  const uintptr_t p0 = (uintptr_t)ptr & ~(page - 1);
+  const uintptr_t p1 = (uintptr_t)ptr + bytes;
+
+  switch (advice)
+  {
+  case STORAGE_WILL_NEED:
+    madvise((void *)p0, p1 - p0, MADV_WILLNEED);
+    break;
+  case STORAGE_COLD:
+#ifdef MADV_COLD
+    madvise((void *)p0, p1 - p0, MADV_COLD);
+#endif
+    break;
+  }
+}
+
+} // namespace dunescape
@@ -0,0 +1,249 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <omp.h>
+
+#include "macrologger.h"
+
+#include "core/dunefield.hpp"
+#include "core/ensemble.hpp"
+#include "core/export.hpp"
+
+struct EnsembleOptions
+{
+  dunescape::EnsembleSweep sweep;
+  int                      threads = 0;
+  int                      threads_per_run = 0;
+  std::string              output = "ensemble";
+  std::string              format = "png";
+};
+
+// comma-separated values, "a-b" for a range of integers
+template <typename T> static std::vector<T> parse_list(const char *str)
+{
+  std::vector<T>    list;
+  std::stringstream ss(str);
+  std::string       item;
+
+  while (std::getline(ss, item, ','))
+  {
+    size_t dash = item.find('-', 1);
+
+    if (std::is_integral<T>::value and dash != std::string::npos)
+      for (long v = std::atol(item.substr(0, dash).c_str());
+           v <= std::atol(item.substr(dash + 1).c_str());
+           v++)
+        list.push_back((T)v);
+    else
+      list.push_back((T)std::atof(item.c_str()));
+  }
+  return list;
+}
+
+static void print_usage(const char *exe)
+{
+  std::cout
+      << "Usage: " << exe << " [options]\n"
+      << "\n"
+      << "Runs the cartesian product of the parameter lists.\n"
+      << "\n"
+      << "Options:\n"
+      << "  --width N               Grid size along the wind direction (512)\n"
+      << "  --height N              Grid size across the wind direction (128)\n"
+      << "  --sand-height N         Initial sand height upper bound (4)\n"
+      << "  --cycles N              Number of simulation cycles (1000)\n"
+      << "  --prob-bare X,X,...     Probabilities of deposit on bare ground "
+         "(0.4)\n"
+      << "  --prob-sand X,X,...     Probabilities of deposit on sandy ground "
+         "(0.6)\n"
+      << "  --hop-lengths N,N,...   Hop lengths (1)\n"
+      << "  --seeds N,N,...         Random seed numbers, a-b for a range (1)\n"
+      << "  --threads N             Total number of threads, 0 for all (0)\n"
+      << "  --threads-per-run N     Threads per run, 0 to balance them\n"
+      << "                          automatically (0)\n"
+      << "  --output PREFIX         Output file prefix, the summary is\n"
+      << "                          written to PREFIX_summary.csv (ensemble)\n"
+      << "  --output-format F       Final state of each run: png, png16, raw\n"
+      << "                          or none (png)\n"
+      << "  --help                  Show this message\n";
+}
+
+static bool parse_args(int argc, char **argv, EnsembleOptions &opt)
+{
+  dunescape::EnsembleSweep &sw = opt.sweep;
+
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+
+    if (arg == "--help" or arg == "-h")
+    {
+      print_usage(argv[0]);
+      std::exit(0);
+    }
+
+    if (k + 1 >= argc)
+    {
+      LOG_ERROR("missing value for option %s", arg.c_str());
+      return false;
+    }
+    const char *value = argv[++k];
+
+    if (arg == "--width")
+      sw.shape[0] = std::atoi(value);
+    else if (arg == "--height")
+      sw.shape[1] = std::atoi(value);
+    else if (arg == "--sand-height")
+      sw.h0 = std::atoi(value);
+    else if (arg == "--cycles")
+      sw.cycles = std::atoi(value);
+    else if (arg == "--prob-bare")
+      sw.prob_deposit_bare = parse_list<float>(value);
+    else if (arg == "--prob-sand")
+      sw.prob_deposit_sand = parse_list<float>(value);
+    else if (arg == "--hop-lengths")
+      sw.hop_lengths = parse_list<int>(value);
+    else if (arg == "--seeds")
+      sw.seeds = parse_list<uint>(value);
+    else if (arg == "--threads")
+      opt.threads = std::atoi(value);
+    else if (arg == "--threads-per-run")
+      opt.threads_per_run = std::atoi(value);
+    else if (arg == "--output")
+      opt.output = value;
+    else if (arg == "--output-format")
+      opt.format = value;
+    else
+    {
+      LOG_ERROR("unknown option %s", arg.c_str());
+      return false;
+    }
+  }
+
+  if (sw.shape[0] < 1 or sw.shape[1] < 1 or sw.cycles < 0 or sw.h0 < 0)
+  {
+    LOG_ERROR("invalid grid size, sand height or number of cycles");
+    return false;
+  }
+
+  if (opt.format != "png" and opt.format != "png16" and
+      opt.format != "raw" and opt.format != "none")
+  {
+    LOG_ERROR("unknown output format %s", opt.format.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static void write_summary(const std::string                         &fname,
+                          const std::vector<dunescape::EnsembleResult> &results)
+{
+  std::ofstream f(fname);
+
+  if (!f)
+  {
+    LOG_ERROR("cannot open %s", fname.c_str());
+    return;
+  }
+
+  f << "id,seed,hop_length,prob_deposit_bare,prob_deposit_sand,cycles,"
+       "mean_height,rms_height,max_height,bare_fraction,shadow_fraction,"
+       "n_moves,seconds\n";
+
+  for (auto &r : results)
+    f << r.member.id << "," << r.member.seed << "," << r.member.hop_length
+      << "," << r.member.prob_deposit_bare << ","
+      << r.member.prob_deposit_sand << "," << r.member.cycles << ","
+      << r.mean_height << "," << r.rms_height << "," << r.max_height << ","
+      << r.bare_fraction << "," << r.shadow_fraction << "," << r.n_moves
+      << "," << r.seconds << "\n";
+}
+
+int main(int argc, char **argv)
+{
+  EnsembleOptions opt;
+
+  if (!parse_args(argc, argv, opt))
+  {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  const std::vector<dunescape::EnsembleMember> members = opt.sweep.members();
+
+  dunescape::EnsembleRunner runner;
+  runner.n_threads = opt.threads;
+  runner.threads_per_member = opt.threads_per_run;
+
+  LOG_INFO("%zu runs, shape: {%d, %d}, cycles: %d, threads: %d",
+           members.size(),
+           opt.sweep.shape[0],
+           opt.sweep.shape[1],
+           opt.sweep.cycles,
+           opt.threads > 0 ? opt.threads : omp_get_max_threads());
+
+  // --- Run
+  std::atomic<int> n_done(0);
+
+  auto on_done =
+      [&](const dunescape::DuneField &df, const dunescape::EnsembleResult &r)
+  {
+    if (opt.format != "none")
+    {
+      dunescape::ExportFormat format = opt.format == "png16"
+                                           ? dunescape::EXPORT_PNG_16BIT
+                                       : opt.format == "raw"
+                                           ? dunescape::EXPORT_RAW_FLOAT32
+                                           : dunescape::EXPORT_PNG_8BIT;
+      char buffer[32];
+      std::snprintf(buffer,
+                    sizeof(buffer),
+                    "_run%04d%s",
+                    r.member.id,
+                    dunescape::export_extension(format));
+
+      dunescape::export_heightmap(df.h, opt.output + buffer, format);
+    }
+
+    LOG_INFO("[%d/%zu] run %d done in %.3f s",
+             ++n_done,
+             members.size(),
+             r.member.id,
+             r.seconds);
+  };
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  std::vector<dunescape::EnsembleResult> results = runner.run(members,
+                                                              on_done);
+
+  auto   t1 = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(t1 - t0).count();
+
+  write_summary(opt.output + "_summary.csv", results);
+
+  double busy = 0.;
+  for (auto &r : results)
+    busy += r.seconds;
+
+  LOG_INFO("%zu runs in %.3f s (%.1f runs/s, %.2f runs in flight on average)",
+           results.size(),
+           elapsed,
+           elapsed > 0. ? results.size() / elapsed : 0.,
+           elapsed > 0. ? busy / elapsed : 0.);
+
+  return 0;
+}
@@ -2,12 +2,16 @@
 // MIT License. The full license is in the file LICENSE, distributed
 // with this software.
 
+#include <cfloat>
+#include <cstdio>
 #include <iostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <omp.h>
 
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
@@ -15,48 +19,265 @@
 
 #include "core/array.hpp"
 #include "core/dunefield.hpp"
+#include "core/export.hpp"
+#include "core/simulation.hpp"
+#include "core/stats.hpp"
+
+#define STATS_HISTORY_SIZE 256 // number of snapshots in the rolling plots
+
+// pixel buffer object entry points (OpenGL 3.0 or ARB_map_buffer_range
+// for glMapBufferRange), loaded at runtime
+static PFNGLGENBUFFERSPROC     gl_gen_buffers = nullptr;
+static PFNGLDELETEBUFFERSPROC  gl_delete_buffers = nullptr;
+static PFNGLBINDBUFFERPROC     gl_bind_buffer = nullptr;
+static PFNGLBUFFERDATAPROC     gl_buffer_data = nullptr;
+static PFNGLMAPBUFFERRANGEPROC gl_map_buffer_range = nullptr;
+static PFNGLUNMAPBUFFERPROC    gl_unmap_buffer = nullptr;
+
+static bool load_pbo_functions()
+{
+  gl_gen_buffers = (PFNGLGENBUFFERSPROC)glfwGetProcAddress("glGenBuffers");
+  gl_delete_buffers =
+      (PFNGLDELETEBUFFERSPROC)glfwGetProcAddress("glDeleteBuffers");
+  gl_bind_buffer = (PFNGLBINDBUFFERPROC)glfwGetProcAddress("glBindBuffer");
+  gl_buffer_data = (PFNGLBUFFERDATAPROC)glfwGetProcAddress("glBufferData");
+  gl_map_buffer_range =
+      (PFNGLMAPBUFFERRANGEPROC)glfwGetProcAddress("glMapBufferRange");
+  gl_unmap_buffer = (PFNGLUNMAPBUFFERPROC)glfwGetProcAddress("glUnmapBuffer");
+
+  return gl_gen_buffers and gl_delete_buffers and gl_bind_buffer and
+         gl_buffer_data and gl_map_buffer_range and gl_unmap_buffer;
+}
 
-void array_to_texture(dunescape::Array &array,
-                      GLuint           &image_texture,
-                      int               colormap)
+// Texture of the dune field preview. The texture storage is only
+// allocated when the shape or the number of channels change, then the
+// image rows of the columns modified since the snapshot previously
+// displayed are converted straight into a streaming pixel buffer and
+// uploaded with glTexSubImage2D (from a client-side buffer if pixel
+// buffers are not available or fail to be mapped).
+struct PreviewTexture
 {
-  glBindTexture(GL_TEXTURE_2D, image_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  GLuint                 texture = 0;
+  GLuint                 pbo = 0;
+  dunescape::Shape       shape = {0, 0};
+  int                    channels = 0;
+  dunescape::ColormapLut lut;
+  std::vector<uint8_t>   img;
+  uint64_t               displayed_id = 0;
+
+  void init()
+  {
+    glGenTextures(1, &this->texture);
+    glBindTexture(GL_TEXTURE_2D, this->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    if (load_pbo_functions())
+      gl_gen_buffers(1, &this->pbo);
+  }
+
+  void destroy()
+  {
+    if (this->pbo)
+      gl_delete_buffers(1, &this->pbo);
+    glDeleteTextures(1, &this->texture);
+  }
+
+  void update(const dunescape::Snapshot &snapshot, int colormap)
+  {
+    const dunescape::Array<dunescape::Height> &h = snapshot.h;
+    const int                                  ni = h.shape[0];
+    const int                                  nj = h.shape[1];
+
+    if ((ni == 0) or (nj == 0))
+      return;
+
+    // a new range or colormap changes every pixel (the maximum is
+    // tracked by the simulation, no need to scan the heights)
+    float vmax = (float)snapshot.heights.max;
+    bool  all_rows = (vmax != this->lut.vmax) or (colormap != this->lut.cmap);
+
+    this->lut.update((dunescape::Colormap)colormap,
+                     vmax,
+                     std::is_integral<dunescape::Height>::value);
+
+    const GLenum format = this->lut.channels == 1 ? GL_LUMINANCE : GL_RGB;
 
-  // Upload pixels into texture
+    glBindTexture(GL_TEXTURE_2D, this->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 #if defined(GL_UNPACK_ROW_LENGTH) && !defined(__EMSCRIPTEN__)
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 #endif
 
-  switch (colormap)
+    if ((this->shape != h.shape) or (this->channels != this->lut.channels))
+    {
+      this->shape = h.shape;
+      this->channels = this->lut.channels;
+      glTexImage2D(GL_TEXTURE_2D,
+                   0,
+                   GL_RGBA,
+                   ni,
+                   nj,
+                   0,
+                   format,
+                   GL_UNSIGNED_BYTE,
+                   nullptr);
+      all_rows = true;
+    }
+
+    // columns modified since the snapshot last displayed, image row r
+    // is the column nj - 1 - r
+    int j0 = 0;
+    int j1 = nj - 1;
+
+    if (!all_rows)
+    {
+      while ((j0 <= j1) and (snapshot.column_id[j0] <= this->displayed_id))
+        j0++;
+      while ((j1 >= j0) and (snapshot.column_id[j1] <= this->displayed_id))
+        j1--;
+    }
+
+    if (j0 > j1)
+    {
+      this->displayed_id = snapshot.id;
+      return;
+    }
+
+    const int r0 = nj - 1 - j1;
+    const int r1 = nj - j0;
+
+    const size_t size = (size_t)(r1 - r0) * ni * this->channels;
+    bool         uploaded = false;
+
+    if (this->pbo)
+    {
+      gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, this->pbo);
+
+      // orphan the previous storage so that mapping never waits for the
+      // upload of the previous frame to complete
+      gl_buffer_data(GL_PIXEL_UNPACK_BUFFER,
+                     (GLsizeiptr)ni * nj * this->channels,
+                     nullptr,
+                     GL_STREAM_DRAW);
+
+      uint8_t *dst = (uint8_t *)gl_map_buffer_range(
+          GL_PIXEL_UNPACK_BUFFER,
+          0,
+          (GLsizeiptr)size,
+          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+      // (the content of the buffer is undefined when unmapping fails,
+      // e.g. after a video mode change)
+      if (dst)
+      {
+        h.to_img_8bit_rows(dst, this->lut, r0, r1);
+        uploaded = gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+      }
+      if (uploaded)
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,
+                        0,
+                        r0,
+                        ni,
+                        r1 - r0,
+                        format,
+                        GL_UNSIGNED_BYTE,
+                        nullptr);
+      gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    if (!uploaded)
+    {
+      this->img.resize(size);
+      h.to_img_8bit_rows(this->img.data(), this->lut, r0, r1);
+      glTexSubImage2D(GL_TEXTURE_2D,
+                      0,
+                      0,
+                      r0,
+                      ni,
+                      r1 - r0,
+                      format,
+                      GL_UNSIGNED_BYTE,
+                      this->img.data());
+    }
+
+    // (once the rows are uploaded, through either path)
+    this->displayed_id = snapshot.id;
+  }
+};
+
+// rolling history of a value, one sample per snapshot
+struct RollingPlot
+{
+  std::vector<float> values = std::vector<float>(STATS_HISTORY_SIZE, 0.f);
+  int                offset = 0;
+
+  void push(float v)
   {
-  case 0:
-    glTexImage2D(GL_TEXTURE_2D,
-                 0,
-                 GL_RGBA,
-                 array.shape[0],
-                 array.shape[1],
-                 0,
-                 GL_LUMINANCE,
-                 GL_UNSIGNED_BYTE,
-                 array.to_img_8bit_grayscale().data());
-    break;
-
-  case 1:
-    glTexImage2D(GL_TEXTURE_2D,
-                 0,
-                 GL_RGBA,
-                 array.shape[0],
-                 array.shape[1],
-                 0,
-                 GL_RGB,
-                 GL_UNSIGNED_BYTE,
-                 array.to_img_8bit_nipy().data());
-    break;
+    this->values[this->offset] = v;
+    this->offset = (this->offset + 1) % STATS_HISTORY_SIZE;
   }
+
+  void plot(const char *label, const char *overlay_format)
+  {
+    const float last = this->values[(this->offset + STATS_HISTORY_SIZE - 1) %
+                                    STATS_HISTORY_SIZE];
+    char        overlay[64];
+    std::snprintf(overlay, sizeof(overlay), overlay_format, last);
+
+    ImGui::PlotLines(label,
+                     this->values.data(),
+                     STATS_HISTORY_SIZE,
+                     this->offset,
+                     overlay,
+                     0.f,
+                     FLT_MAX,
+                     ImVec2(0.f, 50.f));
+  }
+};
+
+// solver statistics shown in the "Stats" window, per cycle
+struct StatsHistory
+{
+  RollingPlot cycles_per_second;
+  RollingPlot eroded;
+  RollingPlot avalanches;
+  RollingPlot shadow_cells;
+  RollingPlot ms[dunescape::STATS_PHASE_COUNT];
+  float       hops[STATS_HOP_BINS] = {};
+
+  void push(const dunescape::Snapshot &snapshot)
+  {
+    const dunescape::CycleStats &s = snapshot.stats;
+    const float                  n = (float)std::max<uint64_t>(1, s.n_cycles);
+
+    this->cycles_per_second.push(snapshot.cycles_per_second);
+    this->eroded.push((float)s.n_eroded / n);
+    this->avalanches.push((float)s.n_avalanches / n);
+    this->shadow_cells.push((float)s.n_shadow_cells / n);
+    for (int p = 0; p < dunescape::STATS_PHASE_COUNT; p++)
+      this->ms[p].push(1e3f * (float)s.seconds[p] / n);
+
+    // slabs per number of hops, normalized
+    const float total = std::max(1.f, (float)s.n_eroded);
+    for (int k = 0; k < STATS_HOP_BINS; k++)
+      this->hops[k] = (float)s.hops[k] / total;
+  }
+};
+
+// commands executed by the simulation thread only capture copies of
+// the settings
+static void reset_field(dunescape::DuneField &df, int h0)
+{
+  df.h.randomize(0, h0, df.seed);
+  df.update_shadow();
+  if (df.relax_avalanches)
+    df.queue_relaxation();
+  df.cycle_count = 0;
+  df.modified_columns.assign(df.shape[1], 1);
 }
 
 static void glfw_error_callback(int error, const char *description)
@@ -66,22 +287,25 @@ static void glfw_error_callback(int error, const char *description)
 
 int main()
 {
-  omp_set_num_threads(omp_get_max_threads() - 1);
-
-  // --- Initialize dune field
-  static int           width = 512;
-  static int           height = 128;
-  static int           h0 = 4;
-  static int           seed = 1;
-  std::vector<int>     shape = {width, height};
-  dunescape::DuneField df = dunescape::DuneField(shape);
-
-  df.seed = seed;
-  df.h.randomize(0, h0, 1);
-  df.update_shadow();
+  // --- Initialize dune field, simulated on a background thread and
+  // leaving one core for the user interface
+  static int       width = 512;
+  static int       height = 128;
+  static int       h0 = 4;
+  static int       seed = 1;
+  dunescape::Shape shape = {width, height};
+
+  dunescape::Simulation sim(shape, std::max(1, omp_get_max_threads() - 1));
+
+  sim.post(
+      [](dunescape::DuneField &df)
+      {
+        df.seed = 1;
+        reset_field(df, 4);
+      });
+  sim.set_paused(false);
 
-  GLuint image_texture = 0;
-  glGenTextures(1, &image_texture); // to show dune field
+  dunescape::ExportWriter exporter;
 
   // --- ImGUI init
   glfwSetErrorCallback(glfw_error_callback);
@@ -133,6 +357,11 @@ int main()
   ImGui_ImplGlfw_InitForOpenGL(window, true);
   ImGui_ImplOpenGL3_Init(glsl_version);
 
+  PreviewTexture preview; // to show dune field
+  preview.init();
+
+  StatsHistory history;
+
   while (!glfwWindowShouldClose(window))
   {
     glfwPollEvents();
@@ -142,103 +371,238 @@ int main()
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
 
-    static bool pause = false;
+    static bool  pause = false;
+    static int   cmap = dunescape::CMAP_GRAYSCALE;
+    static int   export_format = dunescape::EXPORT_PNG_8BIT;
+    static int   cycles_per_snapshot = 1;
+    static int   hop_length = 1;
+    static float prob_bare = 0.4f;
+    static float prob_sand = 0.6f;
+    static bool  relax = false;
+    static int   boundary = dunescape::BOUNDARY_PERIODIC;
+    static float sand_inflow = 0.f;
+
+    // latest state published by the simulation thread
+    const bool                 new_snapshot = sim.acquire_snapshot();
+    const dunescape::Snapshot &snapshot = sim.snapshot();
 
-    static int cmap = 0;
-    static int sub_iterations = 1;
+    if (new_snapshot and (snapshot.stats.n_cycles > 0 or !STATS_ENABLED))
+      history.push(snapshot);
 
     {
       ImGui::Begin("Settings");
 
       if (ImGui::Button("Reset"))
       {
-        df.h.randomize(0, h0, df.seed);
-        array_to_texture(df.h, image_texture, cmap);
+        int h = h0;
+        sim.post([h](dunescape::DuneField &df) { reset_field(df, h); });
       }
 
       ImGui::SameLine();
       {
-        if (ImGui::Button("Export"))
-          df.h.to_png("export.png");
-
-        if (ImGui::IsItemHovered())
+        // the export runs in the background, the UI is not blocked
+        static const char *fnames[] = {"export.png",
+                                       "export_16bit.png",
+                                       "export.raw"};
+        const char        *fname = fnames[export_format];
+
+        ImGui::BeginDisabled(exporter.busy());
+        if (ImGui::Button(exporter.busy() ? "Exporting..." : "Export"))
+          exporter.save(snapshot.h,
+                        fname,
+                        (dunescape::ExportFormat)export_format);
+        ImGui::EndDisabled();
+
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
         {
           ImGui::BeginTooltip();
           ImGui::PushTextWrapPos(ImGui::GetFontSize() * 35.0f);
-          ImGui::TextUnformatted("Saved to export.png");
+          ImGui::Text("Saved to %s", fname);
           ImGui::PopTextWrapPos();
           ImGui::EndTooltip();
         }
       }
 
       ImGui::SameLine();
-      ImGui::Checkbox("Pause simulation", &pause);
-      if (!pause)
-        for (int it = 0; it < sub_iterations; it++)
-        {
-          df.cycle();
-          array_to_texture(df.h, image_texture, cmap);
-        }
-      else
+      if (ImGui::Checkbox("Pause simulation", &pause))
+        sim.set_paused(pause);
+      if (pause)
       {
         ImGui::SameLine();
         if (ImGui::Button("Next frame"))
-        {
-          df.cycle();
-          array_to_texture(df.h, image_texture, cmap);
-        }
+          sim.step();
       }
 
+      ImGui::Text("Cycle %llu, %.1f cycles/s",
+                  (unsigned long long)snapshot.cycle_count,
+                  snapshot.cycles_per_second);
+      ImGui::Text("Height max %d, rms %.2f, sand cover %.1f%%",
+                  snapshot.heights.max,
+                  snapshot.heights.rms,
+                  100.f * snapshot.heights.sandy_fraction);
+
       ImGui::SliderInt("Width", &width, 32, 2048);
       ImGui::SliderInt("Height", &height, 32, 2048);
 
-      if ((width != df.shape[0]) or (height != df.shape[1]))
+      if ((width != shape[0]) or (height != shape[1]))
       {
         width -= width % 32;
         height -= height % 32;
-        df.set_shape({width, height});
-        array_to_texture(df.h, image_texture, cmap);
+        shape = {width, height};
+        sim.post([shape](dunescape::DuneField &df) { df.set_shape(shape); });
       }
 
       ImGui::Spacing();
       ImGui::SeparatorText("Initialization");
 
       ImGui::SliderInt("Sand height", &h0, 1, 50);
-      ImGui::DragInt("Seed", &seed);
-      df.seed = (uint)seed;
+      if (ImGui::DragInt("Seed", &seed))
+      {
+        uint v = (uint)seed;
+        sim.post([v](dunescape::DuneField &df) { df.seed = v; });
+      }
 
       ImGui::Spacing();
       ImGui::SeparatorText("Parameters");
 
-      ImGui::InputInt("Hop length", &df.hop_length);
-      df.hop_length = std::max(1, df.hop_length);
+      if (ImGui::InputInt("Hop length", &hop_length))
+      {
+        hop_length = std::max(1, hop_length);
+        int v = hop_length;
+        sim.post([v](dunescape::DuneField &df) { df.hop_length = v; });
+      }
+
+      if (ImGui::SliderFloat("Pr. deposit bare", &prob_bare, 0.f, 1.f))
+      {
+        float v = prob_bare;
+        sim.post([v](dunescape::DuneField &df) { df.prob_deposit_bare = v; });
+      }
+
+      if (ImGui::SliderFloat("Pr. sandy bare", &prob_sand, 0.f, 1.f))
+      {
+        float v = prob_sand;
+        sim.post([v](dunescape::DuneField &df) { df.prob_deposit_sand = v; });
+      }
+
+      if (ImGui::Checkbox("Relax avalanches", &relax))
+      {
+        bool v = relax;
+        sim.post(
+            [v](dunescape::DuneField &df)
+            {
+              df.relax_avalanches = v;
+              if (v)
+                df.queue_relaxation();
+            });
+      }
+
+      if (ImGui::Combo("Boundary", &boundary, "Periodic\0Open\0Walls\0"))
+      {
+        dunescape::Boundary v = (dunescape::Boundary)boundary;
+        sim.post(
+            [v](dunescape::DuneField &df)
+            {
+              df.boundary = v;
+              df.update_shadow();
+              if (df.relax_avalanches)
+                df.queue_relaxation();
+            });
+      }
 
-      ImGui::SliderFloat("Pr. deposit bare", &df.prob_deposit_bare, 0.f, 1.f);
-      ImGui::SliderFloat("Pr. sandy bare", &df.prob_deposit_sand, 0.f, 1.f);
+      if (boundary == dunescape::BOUNDARY_OPEN and
+          ImGui::SliderFloat("Sand inflow", &sand_inflow, 0.f, 1.f))
+      {
+        float v = sand_inflow;
+        sim.post([v](dunescape::DuneField &df) { df.sand_inflow = v; });
+      }
 
       ImGui::Spacing();
       ImGui::SeparatorText("Preview");
 
       ImGui::Text("Colormap:");
       ImGui::SameLine();
-      ImGui::RadioButton("Grayscale", &cmap, 0);
+      ImGui::RadioButton("Grayscale", &cmap, dunescape::CMAP_GRAYSCALE);
       ImGui::SameLine();
-      ImGui::RadioButton("Nipy spectral", &cmap, 1);
+      ImGui::RadioButton("Nipy spectral",
+                         &cmap,
+                         dunescape::CMAP_NIPY_SPECTRAL);
 
-      ImGui::InputInt("Sub-iterations (before render)", &sub_iterations);
+      if (ImGui::InputInt("Cycles per snapshot", &cycles_per_snapshot))
+      {
+        cycles_per_snapshot = std::max(1, cycles_per_snapshot);
+        sim.cycles_per_snapshot = cycles_per_snapshot;
+      }
+
+      ImGui::Spacing();
+      ImGui::SeparatorText("Export");
+
+      ImGui::RadioButton("PNG 8 bit",
+                         &export_format,
+                         dunescape::EXPORT_PNG_8BIT);
+      ImGui::SameLine();
+      ImGui::RadioButton("PNG 16 bit",
+                         &export_format,
+                         dunescape::EXPORT_PNG_16BIT);
+      ImGui::SameLine();
+      ImGui::RadioButton("Raw float32",
+                         &export_format,
+                         dunescape::EXPORT_RAW_FLOAT32);
 
       ImGui::End();
     }
 
+    {
+      ImGui::Begin("Stats");
+
+      history.cycles_per_second.plot("Cycles/s", "%.1f");
+
+      if (STATS_ENABLED)
+      {
+        ImGui::SeparatorText("Per cycle");
+
+        history.eroded.plot("Slabs moved", "%.0f");
+        history.avalanches.plot("Avalanches", "%.0f");
+        history.shadow_cells.plot("Shadow cells", "%.0f");
+
+        ImGui::SeparatorText("Wall time per cycle (ms)");
+
+        history.ms[dunescape::STATS_PHASE_EVEN].plot("Even strips", "%.3f");
+        history.ms[dunescape::STATS_PHASE_ODD].plot("Odd strips", "%.3f");
+        history.ms[dunescape::STATS_PHASE_SHADOW].plot("Shadow", "%.3f");
+        history.ms[dunescape::STATS_PHASE_RELAX].plot("Relaxation", "%.3f");
+
+        ImGui::SeparatorText("Hops per slab");
+
+        ImGui::PlotHistogram("Fraction",
+                             history.hops,
+                             STATS_HOP_BINS,
+                             0,
+                             nullptr,
+                             0.f,
+                             1.f,
+                             ImVec2(0.f, 80.f));
+      }
+      else
+        ImGui::TextWrapped("Solver counters and timings are disabled, "
+                           "build with -DDUNESCAPE_STATS=ON to enable them.");
+
+      ImGui::End();
+    }
+
+    // texture refreshed once per rendered frame, whatever the simulation
+    // rate
+    preview.update(snapshot, cmap);
+
     {
       ImGui::Begin("Dune field");
 
       ImVec2 win_size = ImGui::GetWindowSize();
-      float  img_scaling =
-          std::min(win_size[0] / df.shape[0], win_size[1] / df.shape[1]);
-      ImVec2 img_size = {img_scaling * df.shape[0], img_scaling * df.shape[1]};
+      float  img_scaling = std::min(win_size[0] / preview.shape[0],
+                                   win_size[1] / preview.shape[1]);
+      ImVec2 img_size = {img_scaling * preview.shape[0],
+                         img_scaling * preview.shape[1]};
 
-      ImGui::Image((void *)(intptr_t)image_texture, img_size);
+      ImGui::Image((void *)(intptr_t)preview.texture, img_size);
 
       ImGui::End();
     }
@@ -259,6 +623,7 @@ int main()
   }
 
   // Cleanup
+  preview.destroy();
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
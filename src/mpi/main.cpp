@@ -0,0 +1,303 @@
+// Copyright (c) 2023 Otto Link. Distributed under the terms of the
+// MIT License. The full license is in the file LICENSE, distributed
+// with this software.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "macrologger.h"
+
+#include "core/distributed.hpp"
+#include "core/export.hpp"
+
+// ring of MPI ranks
+class MpiExchange : public dunescape::Exchange
+{
+public:
+  MpiExchange(MPI_Comm comm) : comm(comm)
+  {
+    MPI_Comm_rank(comm, &this->rank);
+    MPI_Comm_size(comm, &this->size);
+  }
+
+  void shift(int                      direction,
+             const std::vector<char> &send,
+             std::vector<char>       &recv)
+  {
+    const int dest = (this->rank + direction + this->size) % this->size;
+    const int src = (this->rank - direction + this->size) % this->size;
+    uint64_t  n_send = send.size();
+    uint64_t  n_recv = 0;
+
+    MPI_Sendrecv(&n_send,
+                 1,
+                 MPI_UINT64_T,
+                 dest,
+                 0,
+                 &n_recv,
+                 1,
+                 MPI_UINT64_T,
+                 src,
+                 0,
+                 this->comm,
+                 MPI_STATUS_IGNORE);
+
+    recv.resize(n_recv);
+    MPI_Sendrecv(send.data(),
+                 (int)n_send,
+                 MPI_BYTE,
+                 dest,
+                 1,
+                 recv.data(),
+                 (int)n_recv,
+                 MPI_BYTE,
+                 src,
+                 1,
+                 this->comm,
+                 MPI_STATUS_IGNORE);
+  }
+
+  uint64_t sum(uint64_t value)
+  {
+    uint64_t total = 0;
+    MPI_Allreduce(&value, &total, 1, MPI_UINT64_T, MPI_SUM, this->comm);
+    return total;
+  }
+
+  int max(int value)
+  {
+    int vmax = 0;
+    MPI_Allreduce(&value, &vmax, 1, MPI_INT, MPI_MAX, this->comm);
+    return vmax;
+  }
+
+private:
+  MPI_Comm comm;
+  int      rank, size;
+};
+
+struct MpiOptions
+{
+  int         width = 512;
+  int         height = 128;
+  int         h0 = 4;
+  uint        seed = 1;
+  int         hop_length = 1;
+  float       prob_deposit_bare = 0.4f;
+  float       prob_deposit_sand = 0.6f;
+  int         cycles = 1000;
+  int         output_every = 0;
+  std::string output = "dunefield";
+  std::string format = "png";
+};
+
+static void print_usage(const char *exe)
+{
+  std::cout
+      << "Usage: mpirun -n RANKS " << exe << " [options]\n"
+      << "\n"
+      << "The field is split across the wind direction into one band of\n"
+      << "rows per rank, each rank writing its own band (images are the\n"
+      << "bands side by side, rank 0 on the left).\n"
+      << "\n"
+      << "Options:\n"
+      << "  --width N           Grid size along the wind direction (512)\n"
+      << "  --height N          Grid size across the wind direction (128)\n"
+      << "  --sand-height N     Initial sand height upper bound (4)\n"
+      << "  --seed N            Random seed number (1)\n"
+      << "  --hop-length N      Hop length (1)\n"
+      << "  --prob-bare X       Probability of deposit on bare ground (0.4)\n"
+      << "  --prob-sand X       Probability of deposit on sandy ground (0.6)\n"
+      << "  --cycles N          Number of simulation cycles (1000)\n"
+      << "  --output-every N    Output cadence in cycles, 0 for the final\n"
+      << "                      state only (0)\n"
+      << "  --output PREFIX     Output file prefix, PREFIX_rankNNN_CYCLE.EXT\n"
+      << "                      (dunefield)\n"
+      << "  --output-format F   Output format: png, png16 or raw (png)\n"
+      << "  --help              Show this message\n";
+}
+
+static bool parse_args(int argc, char **argv, MpiOptions &opt, bool verbose)
+{
+  for (int k = 1; k < argc; k++)
+  {
+    std::string arg = argv[k];
+
+    if (arg == "--help" or arg == "-h")
+    {
+      if (verbose)
+        print_usage(argv[0]);
+      MPI_Finalize();
+      std::exit(0);
+    }
+
+    if (k + 1 >= argc)
+    {
+      if (verbose)
+        LOG_ERROR("missing value for option %s", arg.c_str());
+      return false;
+    }
+    const char *value = argv[++k];
+
+    if (arg == "--width")
+      opt.width = std::atoi(value);
+    else if (arg == "--height")
+      opt.height = std::atoi(value);
+    else if (arg == "--sand-height")
+      opt.h0 = std::atoi(value);
+    else if (arg == "--seed")
+      opt.seed = (uint)std::strtoul(value, nullptr, 10);
+    else if (arg == "--hop-length")
+      opt.hop_length = std::atoi(value);
+    else if (arg == "--prob-bare")
+      opt.prob_deposit_bare = (float)std::atof(value);
+    else if (arg == "--prob-sand")
+      opt.prob_deposit_sand = (float)std::atof(value);
+    else if (arg == "--cycles")
+      opt.cycles = std::atoi(value);
+    else if (arg == "--output-every")
+      opt.output_every = std::atoi(value);
+    else if (arg == "--output")
+      opt.output = value;
+    else if (arg == "--output-format")
+      opt.format = value;
+    else
+    {
+      if (verbose)
+        LOG_ERROR("unknown option %s", arg.c_str());
+      return false;
+    }
+  }
+
+  if (opt.width < 1 or opt.height < 1 or opt.cycles < 0 or opt.h0 < 0)
+  {
+    if (verbose)
+      LOG_ERROR("invalid grid size, sand height or number of cycles");
+    return false;
+  }
+  opt.hop_length = std::max(1, opt.hop_length);
+
+  if (opt.format != "png" and opt.format != "png16" and opt.format != "raw")
+  {
+    if (verbose)
+      LOG_ERROR("unknown output format %s", opt.format.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static void write_output(const dunescape::DistributedField &df,
+                         const MpiOptions                  &opt)
+{
+  dunescape::ExportFormat format = opt.format == "png16"
+                                       ? dunescape::EXPORT_PNG_16BIT
+                                   : opt.format == "raw"
+                                       ? dunescape::EXPORT_RAW_FLOAT32
+                                       : dunescape::EXPORT_PNG_8BIT;
+  char buffer[64];
+  std::snprintf(buffer,
+                sizeof(buffer),
+                "_rank%03d_%06llu%s",
+                df.rank,
+                (unsigned long long)df.local.cycle_count,
+                dunescape::export_extension(format));
+
+  dunescape::export_heightmap(df.band_heights(), opt.output + buffer, format);
+}
+
+int main(int argc, char **argv)
+{
+  MPI_Init(&argc, &argv);
+
+  int rank, n_ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+
+  MpiOptions opt;
+
+  if (!parse_args(argc, argv, opt, rank == 0))
+  {
+    if (rank == 0)
+      print_usage(argv[0]);
+    MPI_Finalize();
+    return 1;
+  }
+
+  if (opt.width < n_ranks)
+  {
+    if (rank == 0)
+      LOG_ERROR("the width (%d) must be at least the number of ranks (%d)",
+                opt.width,
+                n_ranks);
+    MPI_Finalize();
+    return 1;
+  }
+
+  // --- Initialize dune field
+  MpiExchange                 ex(MPI_COMM_WORLD);
+  dunescape::DistributedField df({opt.width, opt.height}, rank, n_ranks);
+
+  df.local.seed = opt.seed;
+  df.local.hop_length = opt.hop_length;
+  df.local.prob_deposit_bare = opt.prob_deposit_bare;
+  df.local.prob_deposit_sand = opt.prob_deposit_sand;
+  df.randomize(opt.h0);
+  df.synchronize(ex);
+
+  if (rank == 0)
+    LOG_INFO("shape: {%d, %d}, cycles: %d, ranks: %d",
+             opt.width,
+             opt.height,
+             opt.cycles,
+             n_ranks);
+
+  // --- Run
+  auto     t0 = std::chrono::steady_clock::now();
+  uint64_t n_moves = 0;
+
+  for (int it = 0; it < opt.cycles; it++)
+  {
+    n_moves = ex.sum(df.cycle(ex));
+
+    if (opt.output_every > 0 and (it + 1) % opt.output_every == 0)
+    {
+      write_output(df, opt);
+      if (rank == 0)
+        LOG_INFO("cycle %d, %llu slabs moved",
+                 it + 1,
+                 (unsigned long long)n_moves);
+    }
+  }
+
+  auto   t1 = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(t1 - t0).count();
+
+  if (opt.output_every <= 0 or opt.cycles == 0 or
+      opt.cycles % opt.output_every != 0)
+    write_output(df, opt);
+
+  // total amount of sand, conserved by the cycles
+  const dunescape::Array<dunescape::Height> band = df.band_heights();
+  uint64_t                                  mass = 0;
+  for (auto v : band.vector)
+    mass += v;
+  mass = ex.sum(mass);
+
+  if (rank == 0)
+    LOG_INFO("%d cycles in %.3f s (%.1f cycles/s), %llu slabs, halo: %d rows",
+             opt.cycles,
+             elapsed,
+             elapsed > 0. ? opt.cycles / elapsed : 0.,
+             (unsigned long long)mass,
+             df.halo);
+
+  MPI_Finalize();
+  return 0;
+}